@@ -0,0 +1,253 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+
+#include "capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+#define READ_SIZE (16 * 1024)
+// Reads per wakeup, so one chatty job can't keep the loop from other sources
+#define MAX_READS 16
+// Let a job run well ahead of the shell before it blocks on a full pipe
+#define PIPE_SIZE (1024 * 1024)
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Move output out of memory: into the spill file if there is one, otherwise
+ * it is only counted
+ */
+static void spill(capture_t *cap, const char *data, size_t len) {
+    if (cap->spill_fd != -1 && write_all(cap->spill_fd, data, len) == -1) {
+        perror("write spill file");
+        close(cap->spill_fd);
+        cap->spill_fd = -1;
+    }
+    if (cap->spill_fd == -1) {
+        cap->discarded += len;
+    }
+}
+
+/*
+ * Drop the oldest bytes held in memory
+ */
+static void evict(capture_t *cap, size_t len) {
+    size_t first = cap->size - cap->start;
+    if (first > len) {
+        first = len;
+    }
+    spill(cap, cap->buf + cap->start, first);
+    spill(cap, cap->buf, len - first);
+    cap->start = (cap->start + len) % cap->size;
+    cap->len -= len;
+}
+
+static void append(capture_t *cap, const char *data, size_t len) {
+    if (cap->follow_fd != -1 && write_all(cap->follow_fd, data, len) == -1) {
+        cap->follow_fd = -1;
+    }
+    if (len >= cap->size) {
+        // Only the tail of this chunk fits, everything before it goes out
+        evict(cap, cap->len);
+        spill(cap, data, len - cap->size);
+        data += len - cap->size;
+        len = cap->size;
+        cap->start = 0;
+    } else if (cap->len + len > cap->size) {
+        evict(cap, cap->len + len - cap->size);
+    }
+
+    size_t end = (cap->start + cap->len) % cap->size;
+    size_t first = cap->size - end;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(cap->buf + end, data, first);
+    memcpy(cap->buf, data + first, len - first);
+    cap->len += len;
+}
+
+static void on_readable(int fd, void *arg) {
+    capture_t *cap = arg;
+    char buf[READ_SIZE];
+    for (int i = 0; i < MAX_READS; i++) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n > 0) {
+            append(cap, buf, n);
+            continue;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && errno == EAGAIN) {
+            return;
+        }
+        // End of output: the job and anything it started have closed the pipe
+        event_loop_remove(cap->loop, fd);
+        close(fd);
+        cap->fd = -1;
+        return;
+    }
+}
+
+capture_t *capture_new(event_loop_t *loop, int fd, size_t size, const char *spill_path) {
+    capture_t *cap = calloc(1, sizeof(capture_t));
+    if (cap == NULL || (cap->buf = malloc(size)) == NULL) {
+        free(cap);
+        close(fd);
+        return NULL;
+    }
+    cap->fd = fd;
+    cap->loop = loop;
+    cap->size = size;
+    cap->spill_fd = -1;
+    cap->follow_fd = -1;
+    cap->interrupt_fd = -1;
+
+    if (spill_path != NULL &&
+        (cap->spill_fd = open(spill_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                              0644)) == -1) {
+        perror("open spill file");
+    }
+    // A larger pipe is only an optimization, the default size works too
+    fcntl(fd, F_SETPIPE_SZ, PIPE_SIZE);
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 ||
+        event_loop_add(loop, fd, on_readable, cap) == -1) {
+        perror("capture");
+        close(fd);
+        cap->fd = -1;
+        capture_free(cap);
+        return NULL;
+    }
+    return cap;
+}
+
+void capture_drain(capture_t *cap) {
+    if (cap->fd != -1) {
+        on_readable(cap->fd, cap);
+    }
+}
+
+int capture_replay(capture_t *cap, int out_fd) {
+    capture_drain(cap);
+
+    if (cap->discarded > 0) {
+        dprintf(out_fd, "(%llu earlier bytes discarded)\n", cap->discarded);
+    }
+    if (cap->spill_fd != -1) {
+        char buf[READ_SIZE];
+        off_t offset = 0;
+        ssize_t n;
+        while ((n = pread(cap->spill_fd, buf, sizeof(buf), offset)) > 0) {
+            if (write_all(out_fd, buf, n) == -1) {
+                return -1;
+            }
+            offset += n;
+        }
+        if (n == -1) {
+            perror("read spill file");
+            return -1;
+        }
+    }
+
+    size_t first = cap->size - cap->start;
+    if (first > cap->len) {
+        first = cap->len;
+    }
+    if (write_all(out_fd, cap->buf + cap->start, first) == -1 ||
+        write_all(out_fd, cap->buf, cap->len - first) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+static void on_interrupt(int fd, void *arg) {
+    capture_t *cap = arg;
+    struct signalfd_siginfo info;
+    if (read(fd, &info, sizeof(info)) == sizeof(info)) {
+        cap->is_interrupted = 1;
+    }
+}
+
+int capture_follow(capture_t *cap, int out_fd) {
+    if (capture_replay(cap, out_fd) == -1) {
+        return -1;
+    }
+    if (cap->fd == -1) {
+        return 0;
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    if (sigprocmask(SIG_BLOCK, &mask, &cap->old_mask) == -1) {
+        perror("sigprocmask");
+        return -1;
+    }
+    cap->is_interrupted = 0;
+    cap->interrupt_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (cap->interrupt_fd == -1 ||
+        event_loop_add(cap->loop, cap->interrupt_fd, on_interrupt, cap) == -1) {
+        perror("signalfd");
+        if (cap->interrupt_fd != -1) {
+            close(cap->interrupt_fd);
+            cap->interrupt_fd = -1;
+        }
+        sigprocmask(SIG_SETMASK, &cap->old_mask, NULL);
+        return -1;
+    }
+    cap->follow_fd = out_fd;
+    return 0;
+}
+
+int capture_is_following(const capture_t *cap) {
+    return cap->fd != -1 && !cap->is_interrupted;
+}
+
+void capture_unfollow(capture_t *cap) {
+    cap->follow_fd = -1;
+    if (cap->interrupt_fd == -1) {
+        return;
+    }
+    event_loop_remove(cap->loop, cap->interrupt_fd);
+    close(cap->interrupt_fd);
+    cap->interrupt_fd = -1;
+    sigprocmask(SIG_SETMASK, &cap->old_mask, NULL);
+}
+
+void capture_free(capture_t *cap) {
+    if (cap == NULL) {
+        return;
+    }
+    capture_unfollow(cap);
+    if (cap->fd != -1) {
+        event_loop_remove(cap->loop, cap->fd);
+        close(cap->fd);
+    }
+    if (cap->spill_fd != -1) {
+        close(cap->spill_fd);
+    }
+    free(cap->buf);
+    free(cap);
+}
@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <signal.h>
+#include <stddef.h>
+
+#include "event_loop.h"
+
+#define CAPTURE_DEFAULT_SIZE (64 * 1024)
+
+/*
+ * Output of a background job, collected from a pipe by the shell
+ * Only the most recent 'size' bytes are kept in memory. Older bytes go to
+ * the spill file if there is one, and are otherwise discarded (and counted)
+ */
+typedef struct capture {
+    int fd;    // Read end of the job's output pipe, -1 once the job closed it
+    event_loop_t *loop;
+    char *buf;
+    size_t size;
+    size_t start;
+    size_t len;
+    unsigned long long discarded;
+    int spill_fd;
+    int follow_fd;    // Also copy new output here as it arrives, -1 if not following
+    // Ctrl-C while following with capture_follow(), -1 otherwise
+    int interrupt_fd;
+    int is_interrupted;
+    sigset_t old_mask;
+} capture_t;
+
+/*
+ * Start capturing from the read end of a job's output pipe
+ * The pipe is drained by the event loop whenever it has data, so the job
+ * never waits on the shell for longer than it takes to fill the pipe
+ * loop: The shell's event loop
+ * fd: Read end of the pipe, owned by the capture from now on
+ * size: Number of bytes to keep in memory
+ * spill_path: File to append output that no longer fits in memory, or NULL
+ * Returns the new capture or NULL on error (fd is closed in that case)
+ */
+capture_t *capture_new(event_loop_t *loop, int fd, size_t size, const char *spill_path);
+
+/*
+ * Read output that is already waiting in the pipe, without blocking
+ * The event loop does this whenever it runs, this is for callers that need
+ * the capture to be up to date right now
+ * cap: The capture to update
+ */
+void capture_drain(capture_t *cap);
+
+/*
+ * Write everything captured so far: the spill file's contents, if any,
+ * followed by the output held in memory
+ * cap: The capture to replay
+ * out_fd: Where to write the output
+ * Returns 0 on success or -1 on error
+ */
+int capture_replay(capture_t *cap, int out_fd);
+
+/*
+ * Replay a capture, then keep copying new output as the event loop collects
+ * it, until capture_unfollow()
+ * The shell keeps the terminal while following, so Ctrl-C is taken as a
+ * request to stop following rather than ending the shell
+ * cap: The capture to follow
+ * out_fd: Where to write the output
+ * Returns 0 on success or -1 on error
+ */
+int capture_follow(capture_t *cap, int out_fd);
+
+/*
+ * Check whether following a capture is still useful
+ * cap: The capture being followed
+ * Returns 1 until the job closes its end of the pipe or the user presses
+ * Ctrl-C, 0 afterwards
+ */
+int capture_is_following(const capture_t *cap);
+
+/*
+ * Stop following a capture, once capture_is_following() says so
+ * cap: The capture being followed
+ */
+void capture_unfollow(capture_t *cap);
+
+/*
+ * Stop capturing and release all resources
+ * The spill file, if any, is left on disk
+ * cap: The capture to free, may be NULL
+ */
+void capture_free(capture_t *cap);
+
+#endif    // CAPTURE_H
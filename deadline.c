@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "deadline.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Longest limit that still fits a timer in milliseconds, about 49 days
+#define MAX_SECONDS 4000000.0
+
+/*
+ * Parse a number of seconds into milliseconds
+ * Returns 0 on success or -1 if the value is invalid
+ */
+static int parse_seconds(const char *s, unsigned *ms) {
+    char *end;
+    double seconds = strtod(s, &end);
+    if (end == s || *end != '\0' || !(seconds >= 0 && seconds <= MAX_SECONDS)) {
+        return -1;
+    }
+    *ms = (unsigned) (seconds * 1000 + 0.5);
+    // Only an actual 0 means "no limit"
+    if (*ms == 0 && seconds > 0) {
+        *ms = 1;
+    }
+    return 0;
+}
+
+int deadline_parse(const strvec_t *tokens, unsigned start, unsigned *timeout_ms,
+                   unsigned *kill_after_ms) {
+    int have_timeout = 0;
+    *kill_after_ms = DEADLINE_DEFAULT_KILL_AFTER_MS;
+    unsigned i = start;
+    while (i < tokens->length) {
+        const char *token = strvec_get(tokens, i);
+        if (strcmp(token, "-k") == 0) {
+            if (i + 1 >= tokens->length ||
+                parse_seconds(strvec_get(tokens, i + 1), kill_after_ms) == -1) {
+                return -1;
+            }
+            i += 2;
+        } else if (!have_timeout) {
+            if (parse_seconds(token, timeout_ms) == -1) {
+                return -1;
+            }
+            have_timeout = 1;
+            i++;
+        } else {
+            break;
+        }
+    }
+    return have_timeout ? i : -1;
+}
+
+static void signal_group(deadline_t *d, int sig) {
+    // The job may have exited during the grace period
+    if (kill(-d->pgid, sig) == -1 && errno != ESRCH) {
+        perror("kill");
+    }
+}
+
+static void on_kill_after(int timer, void *arg) {
+    deadline_t *d = arg;
+    event_loop_remove_timer(d->loop, timer);
+    d->timer = -1;
+    signal_group(d, SIGKILL);
+}
+
+static void on_expired(int timer, void *arg) {
+    deadline_t *d = arg;
+    event_loop_remove_timer(d->loop, timer);
+    d->timer = -1;
+    d->timed_out = 1;
+    signal_group(d, SIGTERM);
+    // A stopped job only acts on SIGTERM once it runs again
+    signal_group(d, SIGCONT);
+    d->timer = event_loop_add_timer(d->loop, d->kill_after_ms, 0, on_kill_after, d);
+}
+
+deadline_t *deadline_new(event_loop_t *loop, pid_t pgid, unsigned timeout_ms,
+                         unsigned kill_after_ms) {
+    deadline_t *d = malloc(sizeof(deadline_t));
+    if (d == NULL) {
+        return NULL;
+    }
+    d->loop = loop;
+    d->pgid = pgid;
+    d->kill_after_ms = kill_after_ms;
+    d->timed_out = 0;
+    if ((d->timer = event_loop_add_timer(loop, timeout_ms, 0, on_expired, d)) == -1) {
+        free(d);
+        return NULL;
+    }
+    return d;
+}
+
+void deadline_free(deadline_t *d) {
+    if (d == NULL) {
+        return;
+    }
+    if (d->timer != -1) {
+        event_loop_remove_timer(d->loop, d->timer);
+    }
+    free(d);
+}
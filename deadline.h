@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#include <sys/types.h>
+
+#include "event_loop.h"
+#include "string_vector.h"
+
+// Grace period between SIGTERM and SIGKILL when none is given
+#define DEADLINE_DEFAULT_KILL_AFTER_MS 5000
+
+/*
+ * Time limit for a job, enforced by a timer on the shell's event loop
+ * When it expires the job's whole process group gets SIGTERM, then SIGKILL
+ * once a grace period has passed too, so a job can't outlive its deadline
+ */
+typedef struct deadline {
+    event_loop_t *loop;
+    pid_t pgid;
+    int timer;    // -1 once there is nothing left to send
+    unsigned kill_after_ms;
+    int timed_out;
+} deadline_t;
+
+/*
+ * Parse a time limit and optional grace period from a builtin's arguments:
+ * "SECS [-k KILL_AFTER]" or "-k KILL_AFTER SECS", where both are (possibly
+ * fractional) numbers of seconds. A limit of 0 means no limit
+ * tokens: The builtin's tokens
+ * start: Index of the first argument to parse
+ * timeout_ms: Where to store the time limit in milliseconds
+ * kill_after_ms: Where to store the grace period in milliseconds,
+ *                DEADLINE_DEFAULT_KILL_AFTER_MS if none is given
+ * Returns the index of the first token after the parsed arguments, or -1 if
+ * the arguments are invalid
+ */
+int deadline_parse(const strvec_t *tokens, unsigned start, unsigned *timeout_ms,
+                   unsigned *kill_after_ms);
+
+/*
+ * Start a deadline for a job
+ * loop: The shell's event loop, which must keep running for the deadline to fire
+ * pgid: The job's process group
+ * timeout_ms: Milliseconds until the job is sent SIGTERM, must not be 0
+ * kill_after_ms: Milliseconds from then until it is sent SIGKILL
+ * Returns the new deadline or NULL on error
+ */
+deadline_t *deadline_new(event_loop_t *loop, pid_t pgid, unsigned timeout_ms,
+                         unsigned kill_after_ms);
+
+/*
+ * Cancel a deadline (if it hasn't fired yet) and free it
+ * d: The deadline to free, may be NULL
+ */
+void deadline_free(deadline_t *d);
+
+#endif    // DEADLINE_H
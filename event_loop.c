@@ -0,0 +1,942 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+
+#include "event_loop.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 32
+#define RING_ENTRIES 256
+
+// Not defined by older C libraries
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+typedef enum {
+    SOURCE_FD,
+    SOURCE_TIMER,
+    SOURCE_CHILD,
+    SOURCE_READ,
+    SOURCE_SIGNAL,
+} source_kind_t;
+
+/*
+ * Anything the loop waits on. With io_uring each source has at most one
+ * request of its own in flight (a poll, timeout, waitid or read), whose
+ * completion carries the source's address
+ */
+typedef struct event_source {
+    source_kind_t kind;
+    int fd;                           // -1 if none (a timer or child with io_uring)
+    int id;                           // Timer ID, or the child's process ID
+    int is_removed;
+    event_handler_t handler;          // NULL once readability isn't watched
+    event_handler_t write_handler;    // NULL unless writability is watched too
+    child_handler_t child_handler;
+    read_handler_t read_handler;
+    void *arg;
+    void *buf;                        // Reads
+    size_t len;
+    int is_immediate;                 // Read from a regular file, with epoll
+    unsigned interval_ms;             // Timers
+    struct __kernel_timespec expiry;  // Next expiration on CLOCK_MONOTONIC, with io_uring
+    siginfo_t info;                   // Filled in by io_uring's waitid
+    uint32_t poll_events;             // Events the poll in flight waits for, 0 if none
+    int is_cancelling;                // A request to cancel the source's own is in flight
+    unsigned num_in_flight;           // io_uring requests that will complete with this source
+    struct event_source *prev;
+    struct event_source *next;
+} event_source_t;
+
+static void free_retired(event_loop_t *loop) {
+    event_source_t **link = &loop->retired;
+    while (*link != NULL) {
+        event_source_t *source = *link;
+        if (source->num_in_flight > 0) {
+            link = &source->next;
+            continue;
+        }
+        *link = source->next;
+        free(source);
+    }
+}
+
+static event_source_t *new_source(event_loop_t *loop, source_kind_t kind, int fd, void *arg) {
+    event_source_t *source = calloc(1, sizeof(event_source_t));
+    if (source == NULL) {
+        return NULL;
+    }
+    source->kind = kind;
+    source->fd = fd;
+    source->arg = arg;
+    source->next = loop->sources;
+    if (loop->sources != NULL) {
+        loop->sources->prev = source;
+    }
+    loop->sources = source;
+    return source;
+}
+
+/*
+ * Take a source out of the loop, to be freed once nothing refers to it
+ */
+static void retire(event_loop_t *loop, event_source_t *source) {
+    if (source->prev != NULL) {
+        source->prev->next = source->next;
+    } else {
+        loop->sources = source->next;
+    }
+    if (source->next != NULL) {
+        source->next->prev = source->prev;
+    }
+    source->is_removed = 1;
+    source->prev = NULL;
+    source->next = loop->retired;
+    loop->retired = source;
+}
+
+static event_source_t *find_source(event_loop_t *loop, source_kind_t kind, int key) {
+    for (event_source_t *source = loop->sources; source != NULL; source = source->next) {
+        int source_key = kind == SOURCE_TIMER || kind == SOURCE_CHILD ? source->id : source->fd;
+        if (source->kind == kind && source_key == key) {
+            return source;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Queue an io_uring request, whose completion is handed to the source (or
+ * ignored if the source is NULL)
+ * Returns the request to fill in, or NULL on error
+ */
+static struct io_uring_sqe *queue(event_loop_t *loop, int opcode, int fd,
+                                  event_source_t *source) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    if (sqe == NULL) {
+        errno = EBUSY;
+        return NULL;
+    }
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (uintptr_t) source;
+    if (source != NULL) {
+        source->num_in_flight++;
+    }
+    return sqe;
+}
+
+/*
+ * Queue the cancellation of a source's own request, and submit it right away
+ * so e.g. a descriptor closed after its removal isn't held open by a poll
+ */
+static void cancel_request(event_loop_t *loop, event_source_t *source) {
+    if (source->num_in_flight == 0 || source->is_cancelling) {
+        return;
+    }
+    int opcode = IORING_OP_ASYNC_CANCEL;
+    if (source->kind == SOURCE_TIMER) {
+        opcode = IORING_OP_TIMEOUT_REMOVE;
+    } else if (source->kind == SOURCE_FD || source->kind == SOURCE_SIGNAL) {
+        opcode = IORING_OP_POLL_REMOVE;
+    }
+    struct io_uring_sqe *sqe = queue(loop, opcode, -1, NULL);
+    if (sqe != NULL) {
+        sqe->addr = (uintptr_t) source;
+        source->is_cancelling = 1;
+        uring_submit_and_wait(&loop->ring, 0);
+    }
+}
+
+static uint32_t wanted_events(const event_source_t *source) {
+    if (source->kind == SOURCE_SIGNAL) {
+        return POLLIN;
+    }
+    return (source->handler != NULL ? POLLIN : 0) | (source->write_handler != NULL ? POLLOUT : 0);
+}
+
+/*
+ * Start a one-shot poll for what the source's handlers want, unless one is
+ * already in flight. One-shot polls report a descriptor that is still ready
+ * again, like epoll does
+ * Returns 0 on success or -1 on error
+ */
+static int arm_poll(event_loop_t *loop, event_source_t *source) {
+    uint32_t events = wanted_events(source);
+    if (events == 0 || source->poll_events != 0 || source->is_removed) {
+        return 0;
+    }
+    struct io_uring_sqe *sqe = queue(loop, IORING_OP_POLL_ADD, source->fd, source);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->poll32_events = events;
+    source->poll_events = events;
+    return 0;
+}
+
+static int arm_timer(event_loop_t *loop, event_source_t *source) {
+    struct io_uring_sqe *sqe = queue(loop, IORING_OP_TIMEOUT, -1, source);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->addr = (uintptr_t) &source->expiry;
+    sqe->len = 1;
+    sqe->timeout_flags = IORING_TIMEOUT_ABS;
+    return 0;
+}
+
+static int arm_waitid(event_loop_t *loop, event_source_t *source) {
+    struct io_uring_sqe *sqe = queue(loop, URING_OP_WAITID, source->id, source);
+    if (sqe == NULL) {
+        return -1;
+    }
+    memset(&source->info, 0, sizeof(source->info));
+    sqe->len = P_PID;
+    sqe->file_index = WEXITED | WSTOPPED | WCONTINUED;
+    sqe->addr2 = (uintptr_t) &source->info;
+    return 0;
+}
+
+static int arm_read(event_loop_t *loop, event_source_t *source) {
+    struct io_uring_sqe *sqe = queue(loop, IORING_OP_READ, source->fd, source);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->addr = (uintptr_t) source->buf;
+    sqe->len = source->len;
+    // From the current position, like read()
+    sqe->off = (uint64_t) -1;
+    return 0;
+}
+
+/*
+ * Stop whatever the backend does for a source and retire it
+ */
+static void detach(event_loop_t *loop, event_source_t *source) {
+    if (loop->backend == EVENT_LOOP_URING) {
+        cancel_request(loop, source);
+    } else {
+        if (source->kind == SOURCE_READ && source->is_immediate) {
+            loop->num_immediate--;
+        } else if (source->fd != -1) {
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+        }
+        // The loop's own descriptors
+        if (source->kind == SOURCE_TIMER || source->kind == SOURCE_CHILD) {
+            close(source->fd);
+        }
+    }
+    retire(loop, source);
+}
+
+int event_loop_init(event_loop_t *loop, event_backend_t backend) {
+    loop->epoll_fd = -1;
+    loop->signal_fd = -1;
+    loop->signal_source = NULL;
+    loop->sources = NULL;
+    loop->retired = NULL;
+    loop->deferred = NULL;
+    loop->num_deferred = 0;
+    loop->cap_deferred = 0;
+    loop->num_immediate = 0;
+    loop->next_timer_id = 1;
+    loop->child_handler = NULL;
+    loop->child_arg = NULL;
+
+    static const int uring_ops[] = {
+        IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE,   IORING_OP_TIMEOUT, IORING_OP_TIMEOUT_REMOVE,
+        IORING_OP_READ,     IORING_OP_ASYNC_CANCEL, URING_OP_WAITID,
+    };
+    loop->backend = EVENT_LOOP_EPOLL;
+    if (backend == EVENT_LOOP_URING &&
+        uring_init(&loop->ring, RING_ENTRIES, uring_ops, sizeof(uring_ops) / sizeof(int)) == 0) {
+        loop->backend = EVENT_LOOP_URING;
+    } else if ((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+        perror("sigprocmask");
+        event_loop_free(loop);
+        return -1;
+    }
+    if ((loop->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+        perror("signalfd");
+        event_loop_free(loop);
+        return -1;
+    }
+    if ((loop->signal_source = new_source(loop, SOURCE_SIGNAL, loop->signal_fd, NULL)) == NULL) {
+        perror("malloc");
+        event_loop_free(loop);
+        return -1;
+    }
+    int ret;
+    if (loop->backend == EVENT_LOOP_URING) {
+        ret = arm_poll(loop, loop->signal_source);
+    } else {
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = loop->signal_source};
+        ret = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->signal_fd, &ev);
+    }
+    if (ret == -1) {
+        perror("Failed to watch for SIGCHLD");
+        event_loop_free(loop);
+        return -1;
+    }
+    return 0;
+}
+
+void event_loop_free(event_loop_t *loop) {
+    while (loop->sources != NULL) {
+        event_source_t *source = loop->sources;
+        loop->sources = source->next;
+        if (loop->backend == EVENT_LOOP_EPOLL &&
+            (source->kind == SOURCE_TIMER || source->kind == SOURCE_CHILD) && source->fd != -1) {
+            close(source->fd);
+        }
+        free(source);
+    }
+    while (loop->retired != NULL) {
+        event_source_t *source = loop->retired;
+        loop->retired = source->next;
+        free(source);
+    }
+    free(loop->deferred);
+    loop->deferred = NULL;
+    if (loop->signal_fd != -1) {
+        close(loop->signal_fd);
+    }
+    // Closing the ring cancels whatever is still in flight
+    if (loop->backend == EVENT_LOOP_URING) {
+        uring_free(&loop->ring);
+    } else if (loop->epoll_fd != -1) {
+        close(loop->epoll_fd);
+    }
+}
+
+int event_loop_add(event_loop_t *loop, int fd, event_handler_t handler, void *arg) {
+    event_source_t *source = new_source(loop, SOURCE_FD, fd, arg);
+    if (source == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    source->handler = handler;
+    int ret;
+    if (loop->backend == EVENT_LOOP_URING) {
+        ret = arm_poll(loop, source);
+    } else {
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = source};
+        ret = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+    if (ret == -1) {
+        perror("Failed to watch descriptor");
+        source->fd = -1;
+        retire(loop, source);
+        return -1;
+    }
+    return 0;
+}
+
+int event_loop_remove(event_loop_t *loop, int fd) {
+    event_source_t *source = find_source(loop, SOURCE_FD, fd);
+    if (source == NULL) {
+        return -1;
+    }
+    detach(loop, source);
+    return 0;
+}
+
+/*
+ * Point a source at new handlers, updating what the backend watches it for.
+ * A source with neither handler isn't watched at all, so a hangup can't keep
+ * waking the loop up, but stays registered
+ * Returns 0 on success or -1 on error
+ */
+static int set_handlers(event_loop_t *loop, event_source_t *source, event_handler_t handler,
+                        event_handler_t write_handler) {
+    uint32_t old_events = wanted_events(source);
+    source->handler = handler;
+    source->write_handler = write_handler;
+    uint32_t new_events = wanted_events(source);
+    if (old_events == new_events) {
+        return 0;
+    }
+
+    if (loop->backend == EVENT_LOOP_URING) {
+        // A poll for the old events is replaced once its cancellation completes
+        if (source->poll_events != 0) {
+            cancel_request(loop, source);
+            return 0;
+        }
+        return arm_poll(loop, source);
+    }
+    struct epoll_event ev = {.events = new_events, .data.ptr = source};
+    int op = old_events == 0 ? EPOLL_CTL_ADD : new_events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    if (epoll_ctl(loop->epoll_fd, op, source->fd, &ev) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+int event_loop_on_writable(event_loop_t *loop, int fd, event_handler_t handler) {
+    event_source_t *source = find_source(loop, SOURCE_FD, fd);
+    if (source == NULL) {
+        return -1;
+    }
+    return set_handlers(loop, source, source->handler, handler);
+}
+
+int event_loop_on_readable(event_loop_t *loop, int fd, event_handler_t handler) {
+    event_source_t *source = find_source(loop, SOURCE_FD, fd);
+    if (source == NULL) {
+        return -1;
+    }
+    return set_handlers(loop, source, handler, source->write_handler);
+}
+
+/*
+ * Move an io_uring timer's expiration forward by a number of milliseconds
+ */
+static void add_ms(struct __kernel_timespec *ts, unsigned ms) {
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+int event_loop_add_timer(event_loop_t *loop, unsigned delay_ms, unsigned interval_ms,
+                         event_handler_t handler, void *arg) {
+    if (loop->backend == EVENT_LOOP_URING) {
+        event_source_t *source = new_source(loop, SOURCE_TIMER, -1, arg);
+        if (source == NULL) {
+            perror("malloc");
+            return -1;
+        }
+        source->id = loop->next_timer_id++;
+        source->handler = handler;
+        source->interval_ms = interval_ms;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        source->expiry.tv_sec = now.tv_sec;
+        source->expiry.tv_nsec = now.tv_nsec;
+        add_ms(&source->expiry, delay_ms);
+        if (arm_timer(loop, source) == -1) {
+            perror("Failed to start timer");
+            retire(loop, source);
+            return -1;
+        }
+        return source->id;
+    }
+
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1) {
+        perror("timerfd_create");
+        return -1;
+    }
+    struct itimerspec spec;
+    // A zero it_value would disarm the timer, so round up to 1ns
+    spec.it_value.tv_sec = delay_ms / 1000;
+    spec.it_value.tv_nsec = (delay_ms % 1000) * 1000000L + (delay_ms == 0);
+    spec.it_interval.tv_sec = interval_ms / 1000;
+    spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+    if (timerfd_settime(fd, 0, &spec, NULL) == -1) {
+        perror("timerfd_settime");
+        close(fd);
+        return -1;
+    }
+
+    event_source_t *source = new_source(loop, SOURCE_TIMER, fd, arg);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = source};
+    if (source == NULL || epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("Failed to start timer");
+        if (source != NULL) {
+            retire(loop, source);
+        }
+        close(fd);
+        return -1;
+    }
+    source->id = fd;
+    source->handler = handler;
+    source->interval_ms = interval_ms;
+    return fd;
+}
+
+int event_loop_remove_timer(event_loop_t *loop, int id) {
+    event_source_t *source = find_source(loop, SOURCE_TIMER, id);
+    if (source == NULL) {
+        return -1;
+    }
+    detach(loop, source);
+    return 0;
+}
+
+int event_loop_watch_child(event_loop_t *loop, pid_t pid, child_handler_t handler, void *arg) {
+    event_source_t *source = new_source(loop, SOURCE_CHILD, -1, arg);
+    if (source == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    source->id = pid;
+    source->child_handler = handler;
+    if (loop->backend == EVENT_LOOP_URING) {
+        if (arm_waitid(loop, source) == -1) {
+            perror("Failed to watch child");
+            retire(loop, source);
+            return -1;
+        }
+        return 0;
+    }
+
+    // The pidfd reports the exit. Stops and continues only come as SIGCHLD,
+    // and without pidfds (before Linux 5.3) so do exits
+    source->fd = syscall(SYS_pidfd_open, pid, 0);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = source};
+    if (source->fd != -1 && epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, source->fd, &ev) == -1) {
+        close(source->fd);
+        source->fd = -1;
+    }
+    return 0;
+}
+
+int event_loop_unwatch_child(event_loop_t *loop, pid_t pid) {
+    event_source_t *source = find_source(loop, SOURCE_CHILD, pid);
+    if (source == NULL) {
+        return -1;
+    }
+    detach(loop, source);
+    return 0;
+}
+
+int event_loop_read(event_loop_t *loop, int fd, void *buf, size_t len, read_handler_t handler,
+                    void *arg) {
+    event_source_t *source = new_source(loop, SOURCE_READ, fd, arg);
+    if (source == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    source->buf = buf;
+    source->len = len;
+    source->read_handler = handler;
+    if (loop->backend == EVENT_LOOP_URING) {
+        if (arm_read(loop, source) == -1) {
+            perror("Failed to start read");
+            retire(loop, source);
+            return -1;
+        }
+        return 0;
+    }
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = source};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        if (errno != EPERM) {
+            perror("epoll_ctl");
+            retire(loop, source);
+            return -1;
+        }
+        // A regular file, always readable
+        source->is_immediate = 1;
+        loop->num_immediate++;
+    }
+    return 0;
+}
+
+/*
+ * Hand a source's completed read to its handler
+ * len: Number of bytes read, or a negative error number
+ */
+static void finish_read(event_loop_t *loop, event_source_t *source, ssize_t len) {
+    int fd = source->fd;
+    read_handler_t handler = source->read_handler;
+    void *arg = source->arg;
+    detach(loop, source);
+    if (len < 0) {
+        errno = -len;
+        len = -1;
+    }
+    handler(fd, len, arg);
+}
+
+/*
+ * Convert what waitid() reports into a status as waitpid() would store it
+ */
+static int wait_status(const siginfo_t *info) {
+    switch (info->si_code) {
+        case CLD_EXITED:
+            return (info->si_status & 0xff) << 8;
+        case CLD_KILLED:
+            return info->si_status & 0x7f;
+        case CLD_DUMPED:
+            return (info->si_status & 0x7f) | 0x80;
+        case CLD_CONTINUED:
+            return 0xffff;
+        default:
+            // Stopped or trapped
+            return (info->si_status & 0xff) << 8 | 0x7f;
+    }
+}
+
+/*
+ * Pass a watched child's new state on to its handler, ending the watch if
+ * the child is gone
+ */
+static void child_changed(event_loop_t *loop, event_source_t *source, int status) {
+    pid_t pid = source->id;
+    child_handler_t handler = source->child_handler;
+    void *arg = source->arg;
+    if (status == -1 || (!WIFSTOPPED(status) && !WIFCONTINUED(status))) {
+        detach(loop, source);
+    }
+    handler(pid, status, arg);
+}
+
+/*
+ * Collect every change of state of a child watched with epoll
+ * options: Which changes to look for (WEXITED, WSTOPPED, WCONTINUED)
+ */
+static void poll_child(event_loop_t *loop, event_source_t *source, int options) {
+    while (!source->is_removed) {
+        siginfo_t info;
+        info.si_pid = 0;
+        int ret = source->fd != -1 ? waitid(P_PIDFD, source->fd, &info, options | WNOHANG)
+                                   : waitid(P_PID, source->id, &info, options | WNOHANG);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret == -1) {
+            child_changed(loop, source, -1);
+        } else if (info.si_pid == 0) {
+            return;
+        } else {
+            child_changed(loop, source, wait_status(&info));
+        }
+    }
+}
+
+/*
+ * Look for stopped and continued children after a SIGCHLD, which with epoll
+ * is the only way to learn of those
+ */
+static void scan_children(event_loop_t *loop) {
+    unsigned num_children = 0;
+    for (event_source_t *source = loop->sources; source != NULL; source = source->next) {
+        num_children += source->kind == SOURCE_CHILD;
+    }
+    if (num_children == 0) {
+        return;
+    }
+    // Handlers may add and remove sources, so work from a snapshot (removed
+    // sources aren't freed before the end of the dispatch batch)
+    event_source_t **children = malloc(num_children * sizeof(event_source_t *));
+    if (children == NULL) {
+        perror("malloc");
+        return;
+    }
+    unsigned i = 0;
+    for (event_source_t *source = loop->sources; source != NULL; source = source->next) {
+        if (source->kind == SOURCE_CHILD) {
+            children[i++] = source;
+        }
+    }
+    for (i = 0; i < num_children; i++) {
+        int options = WSTOPPED | WCONTINUED | (children[i]->fd == -1 ? WEXITED : 0);
+        poll_child(loop, children[i], options);
+    }
+    free(children);
+}
+
+static void on_signal(event_loop_t *loop) {
+    // Drain pending SIGCHLDs, one wakeup covers them all
+    struct signalfd_siginfo info;
+    while (read(loop->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+    }
+    if (loop->child_handler != NULL) {
+        loop->child_handler(loop->signal_fd, loop->child_arg);
+    }
+    if (loop->backend == EVENT_LOOP_EPOLL) {
+        scan_children(loop);
+    }
+}
+
+/*
+ * Call a descriptor's handlers for the events it is ready for (POLLIN etc.)
+ */
+static void dispatch_ready(event_source_t *source, uint32_t ready) {
+    if (source->handler == NULL && (ready & (POLLERR | POLLHUP))) {
+        // Only watched for writability, the write will report the error
+        ready |= POLLOUT;
+    }
+    if ((ready & POLLOUT) && source->write_handler != NULL) {
+        source->write_handler(source->fd, source->arg);
+        // The write handler may have removed the source
+        if (source->is_removed || ready == POLLOUT) {
+            return;
+        }
+    }
+    if (source->handler != NULL) {
+        source->handler(source->fd, source->arg);
+    }
+}
+
+static void complete(event_loop_t *loop, const struct io_uring_cqe *cqe) {
+    event_source_t *source = (event_source_t *) (uintptr_t) cqe->user_data;
+    if (source == NULL) {
+        // A cancellation, whose outcome shows in the cancelled request
+        return;
+    }
+    source->num_in_flight--;
+    int was_cancelled = source->is_cancelling;
+    source->is_cancelling = 0;
+
+    switch (source->kind) {
+        case SOURCE_FD:
+        case SOURCE_SIGNAL:
+            source->poll_events = 0;
+            if (source->is_removed) {
+                return;
+            }
+            if (cqe->res < 0 && cqe->res != -ECANCELED) {
+                // e.g. the descriptor was closed without being removed first
+                fprintf(stderr, "poll: %s\n", strerror(-cqe->res));
+                return;
+            }
+            if (cqe->res > 0 && source->kind == SOURCE_SIGNAL) {
+                on_signal(loop);
+            } else if (cqe->res > 0) {
+                dispatch_ready(source, cqe->res);
+            }
+            // Cancelled because the handlers changed, or done: watch again for
+            // whatever the handlers want now
+            arm_poll(loop, source);
+            return;
+
+        case SOURCE_TIMER:
+            if (source->is_removed || cqe->res != -ETIME) {
+                return;
+            }
+            if (source->interval_ms > 0) {
+                // Expirations missed while the shell was busy are dropped
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                add_ms(&source->expiry, source->interval_ms);
+                if (source->expiry.tv_sec < now.tv_sec ||
+                    (source->expiry.tv_sec == now.tv_sec && source->expiry.tv_nsec < now.tv_nsec)) {
+                    source->expiry.tv_sec = now.tv_sec;
+                    source->expiry.tv_nsec = now.tv_nsec;
+                    add_ms(&source->expiry, source->interval_ms);
+                }
+                arm_timer(loop, source);
+            }
+            source->handler(source->id, source->arg);
+            return;
+
+        case SOURCE_CHILD:
+            if (source->is_removed) {
+                return;
+            }
+            if (cqe->res == 0) {
+                int status = wait_status(&source->info);
+                if (WIFSTOPPED(status) || WIFCONTINUED(status)) {
+                    arm_waitid(loop, source);
+                }
+                child_changed(loop, source, status);
+            } else {
+                child_changed(loop, source, -1);
+            }
+            return;
+
+        case SOURCE_READ:
+            if (source->is_removed) {
+                return;
+            }
+            if (was_cancelled && (cqe->res == -ECANCELED || cqe->res == -EINTR)) {
+                detach(loop, source);
+            } else if (cqe->res == -EINTR) {
+                arm_read(loop, source);
+            } else {
+                finish_read(loop, source, cqe->res);
+            }
+            return;
+    }
+}
+
+/*
+ * Keep a completion for the next run of the loop
+ */
+static void defer(event_loop_t *loop, const struct io_uring_cqe *cqe) {
+    if (loop->num_deferred == loop->cap_deferred) {
+        unsigned new_cap = loop->cap_deferred > 0 ? loop->cap_deferred * 2 : 16;
+        struct io_uring_cqe *new_deferred =
+            realloc(loop->deferred, new_cap * sizeof(struct io_uring_cqe));
+        if (new_deferred == NULL) {
+            // Losing it would leave its source waiting forever
+            perror("realloc");
+            abort();
+        }
+        loop->deferred = new_deferred;
+        loop->cap_deferred = new_cap;
+    }
+    loop->deferred[loop->num_deferred++] = *cqe;
+}
+
+int event_loop_cancel_read(event_loop_t *loop, int fd) {
+    event_source_t *source = find_source(loop, SOURCE_READ, fd);
+    if (source == NULL) {
+        return 0;
+    }
+    if (loop->backend == EVENT_LOOP_EPOLL) {
+        detach(loop, source);
+        return 0;
+    }
+
+    // The read's completion says whether it got data first, everything else
+    // that completes meanwhile waits for the next run of the loop
+    cancel_request(loop, source);
+    while (source->num_in_flight > 0) {
+        if (uring_submit_and_wait(&loop->ring, -1) == -1) {
+            perror("io_uring_enter");
+            return -1;
+        }
+        struct io_uring_cqe cqe;
+        while (source->num_in_flight > 0 && uring_next_cqe(&loop->ring, &cqe)) {
+            if (cqe.user_data == (uintptr_t) source) {
+                complete(loop, &cqe);
+            } else {
+                defer(loop, &cqe);
+            }
+        }
+    }
+    // The cancellation itself may not have completed yet, but is ignored anyway
+    return 0;
+}
+
+void event_loop_on_child(event_loop_t *loop, event_handler_t handler, void *arg) {
+    loop->child_handler = handler;
+    loop->child_arg = arg;
+}
+
+static int run_uring(event_loop_t *loop, int timeout_ms) {
+    if (uring_submit_and_wait(&loop->ring, loop->num_deferred > 0 ? 0 : timeout_ms) == -1) {
+        perror("io_uring_enter");
+        return -1;
+    }
+    int handled = 0;
+    // Handlers may defer more completions, which are handled in order too
+    for (unsigned i = 0; i < loop->num_deferred; i++) {
+        struct io_uring_cqe cqe = loop->deferred[i];
+        complete(loop, &cqe);
+        handled++;
+    }
+    loop->num_deferred = 0;
+    struct io_uring_cqe cqe;
+    while (uring_next_cqe(&loop->ring, &cqe)) {
+        complete(loop, &cqe);
+        handled++;
+    }
+    // Handlers queue new requests, which go in with the next wait
+    return handled;
+}
+
+static int run_epoll(event_loop_t *loop, int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    int n =
+        epoll_wait(loop->epoll_fd, events, MAX_EVENTS, loop->num_immediate > 0 ? 0 : timeout_ms);
+    if (n == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        perror("epoll_wait");
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        event_source_t *source = events[i].data.ptr;
+        if (source->is_removed) {
+            // Removed by an earlier handler in this batch
+            continue;
+        }
+        switch (source->kind) {
+            case SOURCE_SIGNAL:
+                on_signal(loop);
+                break;
+            case SOURCE_CHILD:
+                poll_child(loop, source, WEXITED | WSTOPPED | WCONTINUED);
+                break;
+            case SOURCE_READ: {
+                ssize_t len;
+                do {
+                    len = read(source->fd, source->buf, source->len);
+                } while (len == -1 && errno == EINTR);
+                if (len != -1 || errno != EAGAIN) {
+                    finish_read(loop, source, len == -1 ? -errno : len);
+                }
+                break;
+        }
+        case SOURCE_TIMER: {
+            uint64_t expirations;
+            if (read(source->fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+                source->handler(source->id, source->arg);
+            }
+            break;
+        }
+        case SOURCE_FD:
+            dispatch_ready(source, events[i].events);
+            break;
+        }
+    }
+
+    // Reads from regular files. Handlers may start or cancel others, so work
+    // from a snapshot of the ones started before this run
+    unsigned num_immediate = loop->num_immediate;
+    if (num_immediate == 0) {
+        return n;
+    }
+    event_source_t **reads = malloc(num_immediate * sizeof(event_source_t *));
+    if (reads == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    unsigned i = 0;
+    for (event_source_t *source = loop->sources; source != NULL; source = source->next) {
+        if (source->kind == SOURCE_READ && source->is_immediate) {
+            reads[i++] = source;
+        }
+    }
+    for (i = 0; i < num_immediate; i++) {
+        if (!reads[i]->is_removed) {
+            ssize_t len = read(reads[i]->fd, reads[i]->buf, reads[i]->len);
+            finish_read(loop, reads[i], len == -1 ? -errno : len);
+            n++;
+        }
+    }
+    free(reads);
+    return n;
+}
+
+int event_loop_run_once(event_loop_t *loop, int timeout_ms) {
+    int ret = loop->backend == EVENT_LOOP_URING ? run_uring(loop, timeout_ms)
+                                                : run_epoll(loop, timeout_ms);
+    free_retired(loop);
+    return ret;
+}
@@ -0,0 +1,212 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <sys/types.h>
+
+#include "uring.h"
+
+/*
+ * Called when a registered file descriptor becomes readable (or writable), or
+ * when a timer expires
+ * fd: The ready file descriptor, or the timer's ID
+ * arg: The argument given when the descriptor or timer was registered
+ */
+typedef void (*event_handler_t)(int fd, void *arg);
+
+/*
+ * Called when a watched child process stops, continues or ends
+ * pid: The child
+ * status: Its wait status, as from waitpid(), or -1 if it was collected by
+ *         someone else (it has ended, but how is unknown)
+ * arg: The argument given to event_loop_watch_child()
+ */
+typedef void (*child_handler_t)(pid_t pid, int status, void *arg);
+
+/*
+ * Called when a read started with event_loop_read() completes
+ * fd: The descriptor read from
+ * len: Number of bytes read, 0 at end of input, or -1 on error (with errno set)
+ * arg: The argument given to event_loop_read()
+ */
+typedef void (*read_handler_t)(int fd, ssize_t len, void *arg);
+
+typedef enum {
+    EVENT_LOOP_URING,    // io_uring, if the kernel supports everything needed
+    EVENT_LOOP_EPOLL,    // epoll, with a pidfd per child
+} event_backend_t;
+
+struct event_source;
+
+typedef struct {
+    event_backend_t backend;
+    int epoll_fd;    // -1 with io_uring
+    uring_t ring;    // Only with io_uring
+    int signal_fd;
+    struct event_source *signal_source;
+    struct event_source *sources;
+    // Sources removed while their events may still be pending (in a dispatch
+    // batch, or as io_uring requests in flight) are parked here and freed
+    // once nothing refers to them any more
+    struct event_source *retired;
+    // Completions set aside while waiting for a cancelled read, handled on
+    // the next run of the loop
+    struct io_uring_cqe *deferred;
+    unsigned num_deferred;
+    unsigned cap_deferred;
+    // Reads from regular files, which epoll can't wait on but never block
+    unsigned num_immediate;
+    int next_timer_id;
+    // Called after every batch of SIGCHLDs, NULL if not set
+    event_handler_t child_handler;
+    void *child_arg;
+} event_loop_t;
+
+/*
+ * Initialize a new event loop
+ * SIGCHLD is blocked in the calling process and delivered through the loop
+ * instead, so child state changes wake the loop up
+ * loop: Pointer to the loop to initialize
+ * backend: The backend to use. io_uring falls back to epoll if the kernel
+ *          doesn't support it (or the waitid operation, Linux 6.7 and later);
+ *          loop->backend tells which one is in use
+ * Returns 0 on success or -1 on error
+ */
+int event_loop_init(event_loop_t *loop, event_backend_t backend);
+
+/*
+ * Close an event loop and free all of its sources
+ * Requests still in flight are cancelled, registered descriptors are left open
+ * loop: Pointer to the loop to free
+ */
+void event_loop_free(event_loop_t *loop);
+
+/*
+ * Register a file descriptor with an event loop
+ * loop: The loop to register with
+ * fd: The descriptor to watch for readability
+ * handler: Function to call each time the descriptor is readable
+ * arg: Passed through to the handler
+ * Returns 0 on success or -1 on error
+ */
+int event_loop_add(event_loop_t *loop, int fd, event_handler_t handler, void *arg);
+
+/*
+ * Unregister a file descriptor from an event loop
+ * The descriptor itself is not closed
+ * loop: The loop to remove from
+ * fd: The descriptor to stop watching
+ * Returns 0 on success or -1 if the descriptor was not registered
+ */
+int event_loop_remove(event_loop_t *loop, int fd);
+
+/*
+ * Also call a handler whenever a registered descriptor is writable, e.g. to
+ * finish a non-blocking write that the descriptor couldn't take all at once
+ * loop: The loop the descriptor is registered with
+ * fd: The descriptor, registered with event_loop_add()
+ * handler: Function to call each time the descriptor is writable, or NULL to
+ *          stop watching for writability
+ * Returns 0 on success or -1 on error
+ */
+int event_loop_on_writable(event_loop_t *loop, int fd, event_handler_t handler);
+
+/*
+ * Change the handler called when a registered descriptor is readable, e.g. to
+ * stop reading from a socket whose peer has shut down its end while replies
+ * are still being written to it
+ * Hangups and errors on a descriptor that is only watched for writability go
+ * to its write handler
+ * loop: The loop the descriptor is registered with
+ * fd: The descriptor, registered with event_loop_add()
+ * handler: Function to call each time the descriptor is readable, or NULL to
+ *          stop watching for readability
+ * Returns 0 on success or -1 on error
+ */
+int event_loop_on_readable(event_loop_t *loop, int fd, event_handler_t handler);
+
+/*
+ * Create a timer that calls a handler after a delay, and then periodically
+ * loop: The loop to register the timer with
+ * delay_ms: Milliseconds until the first expiration
+ * interval_ms: Milliseconds between later expirations, or 0 for a one-shot timer
+ * handler: Function to call on each expiration, receives the timer's ID
+ * arg: Passed through to the handler
+ * Returns the timer's ID (to pass to event_loop_remove_timer()) or -1 on error
+ */
+int event_loop_add_timer(event_loop_t *loop, unsigned delay_ms, unsigned interval_ms,
+                         event_handler_t handler, void *arg);
+
+/*
+ * Cancel a timer and free it, whether or not it has expired yet
+ * loop: The loop the timer belongs to
+ * id: The timer's ID
+ * Returns 0 on success or -1 if there is no such timer
+ */
+int event_loop_remove_timer(event_loop_t *loop, int id);
+
+/*
+ * Watch a child process, collecting it when it ends
+ * The handler is called every time the child stops, continues or ends. The
+ * watch ends with the child (the handler has been given its exit status)
+ * loop: The loop to watch the child from
+ * pid: The child, which must not be waited for elsewhere
+ * handler: Function to call on each change of state
+ * arg: Passed through to the handler
+ * Returns 0 on success or -1 on error
+ */
+int event_loop_watch_child(event_loop_t *loop, pid_t pid, child_handler_t handler, void *arg);
+
+/*
+ * Stop watching a child process, leaving it to be waited for by someone else
+ * loop: The loop the child is watched from
+ * pid: The child
+ * Returns 0 on success or -1 if the child isn't watched
+ */
+int event_loop_unwatch_child(event_loop_t *loop, pid_t pid);
+
+/*
+ * Start reading from a file descriptor, without blocking the loop
+ * Only one read per descriptor may be in progress, and the descriptor must
+ * not be registered with event_loop_add()
+ * loop: The loop to run the read on
+ * fd: The descriptor to read from
+ * buf: Where to store the data, which must stay valid until the read completes
+ * len: Most bytes to read
+ * handler: Function to call once the read completes
+ * arg: Passed through to the handler
+ * Returns 0 on success or -1 on error
+ */
+int event_loop_read(event_loop_t *loop, int fd, void *buf, size_t len, read_handler_t handler,
+                    void *arg);
+
+/*
+ * Cancel the read in progress on a descriptor, so it can be left to another
+ * process (e.g. a foreground job reading the terminal). If the read had
+ * already taken data its handler is called before this returns, so no input
+ * is lost
+ * loop: The loop the read runs on
+ * fd: The descriptor
+ * Returns 0 once no read is in progress, or -1 on error
+ */
+int event_loop_cancel_read(event_loop_t *loop, int fd);
+
+/*
+ * Set a function to call whenever SIGCHLD is received, e.g. to find children
+ * that nobody watches, such as adopted orphans
+ * loop: The loop to set the handler for
+ * handler: Function to call, receives the signal descriptor, or NULL for none
+ * arg: Passed through to the handler
+ */
+void event_loop_on_child(event_loop_t *loop, event_handler_t handler, void *arg);
+
+/*
+ * Wait for events and dispatch their handlers
+ * loop: The loop to run
+ * timeout_ms: Maximum time to wait in milliseconds, or -1 to wait indefinitely
+ * Returns the number of events handled (0 on timeout) or -1 on error
+ */
+int event_loop_run_once(event_loop_t *loop, int timeout_ms);
+
+#endif    // EVENT_LOOP_H
@@ -0,0 +1,36 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+/*
+ * Continue a 64-bit FNV-1a hash over more data
+ * Start with FNV_OFFSET_BASIS, then feed data in as many pieces as needed
+ * hash: The hash so far
+ * data: Bytes to add
+ * len: Number of bytes to add
+ * Returns the updated hash
+ */
+static inline uint64_t fnv1a_update(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/*
+ * 64-bit FNV-1a hash of a block of data
+ */
+static inline uint64_t fnv1a(const void *data, size_t len) {
+    return fnv1a_update(FNV_OFFSET_BASIS, data, len);
+}
+
+#endif    // HASH_H
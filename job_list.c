@@ -7,6 +7,17 @@
 #include <string.h>
 #include <sys/types.h>
 
+#include "capture.h"
+#include "deadline.h"
+#include "share.h"
+
+static void job_free(job_t *job) {
+    capture_free(job->capture);
+    deadline_free(job->deadline);
+    share_free(job->share);
+    free(job);
+}
+
 void job_list_init(job_list_t *list) {
     list->head = NULL;
     list->length = 0;
@@ -17,7 +28,7 @@ void job_list_free(job_list_t *list) {
     while (current != NULL) {
         job_t *temp = current;
         current = current->next;
-        free(temp);
+        job_free(temp);
     }
     list->head = NULL;
     list->length = 0;
@@ -33,6 +44,11 @@ int job_list_add(job_list_t *list, pid_t pid, const char *name, job_status_t sta
         list->head->status = status;
         list->head->next = NULL;
         list->head->pid = pid;
+        list->head->is_done = 0;
+        list->head->wait_status = 0;
+        list->head->capture = NULL;
+        list->head->deadline = NULL;
+        list->head->share = NULL;
         list->length = 1;
         return 0;
     }
@@ -49,6 +65,11 @@ int job_list_add(job_list_t *list, pid_t pid, const char *name, job_status_t sta
     current->next->status = status;
     current->next->next = NULL;
     current->next->pid = pid;
+    current->next->is_done = 0;
+    current->next->wait_status = 0;
+    current->next->capture = NULL;
+    current->next->deadline = NULL;
+    current->next->share = NULL;
     list->length++;
     return 0;
 }
@@ -68,6 +89,26 @@ job_t *job_list_get(job_list_t *list, unsigned idx) {
     return current;
 }
 
+job_t *job_list_find(job_list_t *list, pid_t pid) {
+    for (job_t *current = list->head; current != NULL; current = current->next) {
+        if (current->pid == pid) {
+            return current;
+        }
+    }
+    return NULL;
+}
+
+int job_list_index(const job_list_t *list, const job_t *job) {
+    int idx = 0;
+    for (const job_t *current = list->head; current != NULL; current = current->next) {
+        if (current == job) {
+            return idx;
+        }
+        idx++;
+    }
+    return -1;
+}
+
 int job_list_remove(job_list_t *list, unsigned idx) {
     if (idx >= list->length) {
         return -1;
@@ -76,7 +117,7 @@ int job_list_remove(job_list_t *list, unsigned idx) {
     if (idx == 0) {
         job_t *temp = list->head;
         list->head = list->head->next;
-        free(temp);
+        job_free(temp);
         list->length--;
         return 0;
     }
@@ -87,7 +128,7 @@ int job_list_remove(job_list_t *list, unsigned idx) {
     }
     job_t *temp = current->next;
     current->next = current->next->next;
-    free(temp);
+    job_free(temp);
     list->length--;
     return 0;
 }
@@ -97,7 +138,7 @@ void job_list_remove_by_status(job_list_t *list, job_status_t status) {
         job_t *temp = list->head;
         list->head = list->head->next;
         list->length--;
-        free(temp);
+        job_free(temp);
     }
 
     if (list->head != NULL) {    // Could have removed all nodes in loop above
@@ -107,7 +148,7 @@ void job_list_remove_by_status(job_list_t *list, job_status_t status) {
                 job_t *temp = current->next;
                 current->next = current->next->next;
                 list->length--;
-                free(temp);
+                job_free(temp);
             } else {
                 current = current->next;
             }
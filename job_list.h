@@ -14,10 +14,19 @@ typedef enum {
     BACKGROUND,
 } job_status_t;
 
+struct capture;
+struct deadline;
+struct share;
+
 typedef struct job {
     char name[NAME_LEN];
     int status;
     pid_t pid;
+    int is_done;        // Exited, but not collected by wait-for or wait-all yet
+    int wait_status;    // How it exited (see waitpid()), once it is done
+    struct capture *capture;      // Captured output (see capture.h), or NULL
+    struct deadline *deadline;    // Time limit (see deadline.h), or NULL
+    struct share *share;          // CPU budget (see share.h), or NULL
     struct job *next;
 } job_t;
 
@@ -34,7 +43,8 @@ void job_list_init(job_list_t *list);
 
 /*
  * Removes all entries from a jobs list
- * The underlying memory for the entries is also freed
+ * The underlying memory for the entries (and their captured output, deadlines
+ * and CPU budgets) is also freed
  * list: Pointer to the job list to clear
  */
 void job_list_free(job_list_t *list);
@@ -57,9 +67,25 @@ int job_list_add(job_list_t *list, pid_t pid, const char *name, job_status_t sta
  */
 job_t *job_list_get(job_list_t *list, unsigned idx);
 
+/*
+ * Find the job of a process in a jobs list
+ * list: Pointer to the jobs list to search
+ * pid: The process ID of the job's underlying process
+ * Returns a pointer to the job_t (not a copy) or NULL if there is none
+ */
+job_t *job_list_find(job_list_t *list, pid_t pid);
+
+/*
+ * Find the position of a job in a jobs list
+ * list: Pointer to the jobs list to search
+ * job: The job to look for
+ * Returns the job's index or -1 if it isn't in the list
+ */
+int job_list_index(const job_list_t *list, const job_t *job);
+
 /*
  * Removes an element at a specific index from a jobs list
- * The memory for this element is freed
+ * The memory for this element (and its captured output, deadline and CPU budget) is freed
  * list: Pointer to the jobs list to remove from
  * idx: Index of the element to remove
  * Returns 0 on success or -1 on error
@@ -0,0 +1,75 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "line_reader.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "scan.h"
+
+void line_reader_init(line_reader_t *reader, int fd) {
+    reader->fd = fd;
+    reader->eof = 0;
+    reader->start = 0;
+    reader->end = 0;
+}
+
+int line_reader_next(line_reader_t *reader, char *line, size_t size) {
+    size_t avail = reader->end - reader->start;
+    if (avail == 0) {
+        return reader->eof ? -1 : 0;
+    }
+
+    char *begin = reader->buf + reader->start;
+    size_t len = scan_line_end(begin, avail);
+    int has_newline = len < avail;
+    // Without a newline, only the last line or a line that doesn't fit is complete
+    if (!has_newline && !reader->eof && avail < size - 1 && avail != LINE_READER_BUF) {
+        return 0;
+    }
+
+    size_t consumed = len + has_newline;
+    if (len > size - 1) {
+        len = size - 1;
+        consumed = len;
+    }
+    memcpy(line, begin, len);
+    line[len] = '\0';
+    reader->start += consumed;
+    return 1;
+}
+
+char *line_reader_space(line_reader_t *reader, size_t *len) {
+    // Move any partial line to the front to make room
+    if (reader->start > 0) {
+        memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    *len = LINE_READER_BUF - reader->end;
+    return reader->buf + reader->end;
+}
+
+void line_reader_commit(line_reader_t *reader, size_t n) {
+    if (n == 0) {
+        reader->eof = 1;
+    }
+    reader->end += n;
+}
+
+int line_reader_fill(line_reader_t *reader) {
+    size_t len;
+    char *space = line_reader_space(reader, &len);
+    ssize_t n;
+    do {
+        n = read(reader->fd, space, len);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) {
+        perror("read");
+        return -1;
+    }
+    line_reader_commit(reader, n);
+    return n;
+}
@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef LINE_READER_H
+#define LINE_READER_H
+
+#include <stddef.h>
+
+#define LINE_READER_BUF 4096
+
+typedef struct {
+    int fd;
+    int eof;
+    size_t start;
+    size_t end;
+    char buf[LINE_READER_BUF];
+} line_reader_t;
+
+/*
+ * Initialize a line reader on top of a file descriptor
+ * reader: Pointer to the reader to initialize
+ * fd: Descriptor to read lines from
+ */
+void line_reader_init(line_reader_t *reader, int fd);
+
+/*
+ * Take the next line out of the reader's buffer, without reading more input
+ * Like fgets(), a line longer than 'size - 1' characters is returned in pieces
+ * reader: The reader to take a line from
+ * line: Where to store the line, without its trailing newline
+ * size: Size of the 'line' buffer
+ * Returns 1 if a line was stored, 0 if more input is needed (see
+ * line_reader_fill()), or -1 if the input is exhausted
+ */
+int line_reader_next(line_reader_t *reader, char *line, size_t size);
+
+/*
+ * Read more input into the reader's buffer with a single read() call
+ * Only call this when line_reader_next() returned 0, as it may otherwise block
+ * reader: The reader to fill
+ * Returns the number of bytes read (0 at end of input) or -1 on error
+ */
+int line_reader_fill(line_reader_t *reader);
+
+/*
+ * Make room for more input, for callers that read it themselves (e.g. without
+ * blocking, through an event loop). Lines may still be taken out while the
+ * read is in progress, but the reader must not be filled again until the
+ * read is passed to line_reader_commit()
+ * reader: The reader to make room in
+ * len: Where to store the most bytes that fit
+ * Returns where to read the input to (nothing fits if 'len' is 0)
+ */
+char *line_reader_space(line_reader_t *reader, size_t *len);
+
+/*
+ * Add input read into the space given by line_reader_space()
+ * reader: The reader the input was read for
+ * n: Number of bytes read, 0 at end of input
+ */
+void line_reader_commit(line_reader_t *reader, size_t n);
+
+#endif    // LINE_READER_H
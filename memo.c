@@ -0,0 +1,508 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+
+#include "memo.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hash.h"
+
+#define ENTRY_MAGIC "SWISHME"
+#define ENTRY_VERSION 1
+#define DEFAULT_ENV "PATH:LANG:LC_ALL:LC_CTYPE:LC_COLLATE:LC_MESSAGES:LC_NUMERIC:TZ"
+#define NAME_LEN 16
+
+/*
+ * Start of an entry file, followed by the key and then the output
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    int32_t status;
+    uint64_t key_len;
+    uint64_t output_len;
+} entry_header_t;
+
+/*
+ * Identity of a file as recorded in a key
+ */
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t size;
+} file_id_t;
+
+int memo_init(memo_t *memo, const char *dir, size_t max_size) {
+    memo->max_size = max_size;
+    memo->hits = 0;
+    memo->misses = 0;
+    memo->evictions = 0;
+    memo->dir = NULL;
+    char cwd[PATH_MAX];
+    if (dir != NULL && dir[0] != '/' && getcwd(cwd, sizeof(cwd)) != NULL) {
+        // Stay in the same place when the shell changes directory
+        if (asprintf(&memo->dir, "%s/%s", cwd, dir) == -1) {
+            memo->dir = NULL;
+        }
+    } else if (dir != NULL) {
+        memo->dir = strdup(dir);
+    } else if (getenv("XDG_CACHE_HOME") != NULL) {
+        if (asprintf(&memo->dir, "%s/swish/memo", getenv("XDG_CACHE_HOME")) == -1) {
+            memo->dir = NULL;
+        }
+    } else if (getenv("HOME") != NULL) {
+        if (asprintf(&memo->dir, "%s/.cache/swish/memo", getenv("HOME")) == -1) {
+            memo->dir = NULL;
+        }
+    }
+    return memo->dir == NULL ? -1 : 0;
+}
+
+void memo_free(memo_t *memo) {
+    free(memo->dir);
+    memo->dir = NULL;
+}
+
+static int key_add(memo_key_t *key, const void *data, size_t len) {
+    if (key->len + len > key->cap) {
+        size_t cap = key->cap == 0 ? 256 : key->cap;
+        while (cap < key->len + len) {
+            cap *= 2;
+        }
+        char *data = realloc(key->data, cap);
+        if (data == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        key->data = data;
+        key->cap = cap;
+    }
+    memcpy(key->data + key->len, data, len);
+    key->len += len;
+    return 0;
+}
+
+static int key_add_str(memo_key_t *key, const char *s) {
+    return key_add(key, s, strlen(s) + 1);
+}
+
+/*
+ * Add a labelled path and the identity of the file it names
+ * Returns 0 on success or -1 on error (e.g. the file doesn't exist)
+ */
+static int key_add_file(memo_key_t *key, const char *label, const char *path) {
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        return -1;
+    }
+    file_id_t id = {
+        .dev = st.st_dev,
+        .ino = st.st_ino,
+        .mtime_sec = st.st_mtim.tv_sec,
+        .mtime_nsec = st.st_mtim.tv_nsec,
+        .size = st.st_size,
+    };
+    if (key_add_str(key, label) == -1 || key_add_str(key, path) == -1 ||
+        key_add(key, &id, sizeof(id)) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Add a labelled directory path and which directory it is, but not its
+ * mtime, which changes whenever anything in it is created or removed
+ * Returns 0 on success or -1 on error
+ */
+static int key_add_dir(memo_key_t *key, const char *label, const char *path) {
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        return -1;
+    }
+    file_id_t id = {
+        .dev = st.st_dev,
+        .ino = st.st_ino,
+    };
+    if (key_add_str(key, label) == -1 || key_add_str(key, path) == -1 ||
+        key_add(key, &id, sizeof(id)) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Find a program the way execvp() would
+ * Returns 0 and stores the program's path on success, or -1 if not found
+ */
+static int find_program(const char *name, char *path, size_t size) {
+    if (strchr(name, '/') != NULL) {
+        snprintf(path, size, "%s", name);
+        return access(path, X_OK);
+    }
+    const char *dirs = getenv("PATH");
+    if (dirs == NULL) {
+        dirs = "/bin:/usr/bin";
+    }
+    while (*dirs != '\0') {
+        size_t dir_len = strcspn(dirs, ":");
+        // An empty entry means the working directory
+        if (dir_len == 0) {
+            snprintf(path, size, "%s", name);
+        } else {
+            snprintf(path, size, "%.*s/%s", (int) dir_len, dirs, name);
+        }
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0) {
+            return 0;
+        }
+        dirs += dir_len + (dirs[dir_len] == ':');
+    }
+    return -1;
+}
+
+int memo_key_build(memo_key_t *key, const strvec_t *cmd) {
+    key->data = NULL;
+    key->len = 0;
+    key->cap = 0;
+
+    char path[PATH_MAX];
+    if (key_add_str(key, "argv") == -1) {
+        goto fail;
+    }
+    for (unsigned i = 0; i < cmd->length; i++) {
+        if (key_add_str(key, strvec_get(cmd, i)) == -1) {
+            goto fail;
+        }
+    }
+
+    // Relative paths depend on it; the files they name are added as inputs
+    if (getcwd(path, sizeof(path)) == NULL || key_add_dir(key, "cwd", path) == -1) {
+        goto fail;
+    }
+
+    for (unsigned i = 0; i < cmd->length; i++) {
+        const char *token = strvec_get(cmd, i);
+        int is_program = i == 0 || strcmp(strvec_get(cmd, i - 1), "|") == 0;
+        if (is_program) {
+            if (find_program(token, path, sizeof(path)) == -1 ||
+                key_add_file(key, "exe", path) == -1) {
+                goto fail;
+            }
+        } else if (strcmp(token, "|") != 0 && access(token, F_OK) == 0) {
+            // Any argument naming a file or directory may be an input
+            if (key_add_file(key, "in", token) == -1) {
+                goto fail;
+            }
+        }
+    }
+
+    const char *names = getenv("SWISH_MEMO_ENV");
+    if (names == NULL) {
+        names = DEFAULT_ENV;
+    }
+    while (*names != '\0') {
+        size_t name_len = strcspn(names, ":");
+        char name[256];
+        snprintf(name, sizeof(name), "%.*s", (int) name_len, names);
+        const char *value = getenv(name);
+        if (value != NULL && (key_add_str(key, "env") == -1 || key_add_str(key, name) == -1 ||
+                              key_add_str(key, value) == -1)) {
+            goto fail;
+        }
+        names += name_len + (names[name_len] == ':');
+    }
+
+    key->hash = fnv1a(key->data, key->len);
+    return 0;
+
+fail:
+    memo_key_free(key);
+    return -1;
+}
+
+void memo_key_free(memo_key_t *key) {
+    free(key->data);
+    key->data = NULL;
+    key->len = 0;
+    key->cap = 0;
+}
+
+static void entry_path(const memo_t *memo, const memo_key_t *key, char *path, size_t size) {
+    snprintf(path, size, "%s/%016llx", memo->dir, (unsigned long long) key->hash);
+}
+
+/*
+ * Read exactly len bytes at an offset
+ * Returns 0 on success or -1 on error or end of file
+ */
+static int read_at(int fd, void *buf, size_t len, off_t offset) {
+    char *bytes = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, bytes, len, offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return -1;
+        }
+        bytes += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+int memo_lookup(memo_t *memo, const memo_key_t *key, memo_entry_t *entry) {
+    entry_path(memo, key, entry->path, sizeof(entry->path));
+    entry->fd = open(entry->path, O_RDONLY | O_CLOEXEC);
+    if (entry->fd == -1) {
+        memo->misses++;
+        return 0;
+    }
+
+    // The name is only a hash, so the key inside must match too
+    entry_header_t header;
+    char *stored_key = malloc(key->len);
+    struct stat st;
+    int is_hit = stored_key != NULL && read_at(entry->fd, &header, sizeof(header), 0) == 0 &&
+                 memcmp(header.magic, ENTRY_MAGIC, sizeof(header.magic)) == 0 &&
+                 header.version == ENTRY_VERSION && header.key_len == key->len &&
+                 read_at(entry->fd, stored_key, key->len, sizeof(header)) == 0 &&
+                 memcmp(stored_key, key->data, key->len) == 0 && fstat(entry->fd, &st) == 0 &&
+                 (uint64_t) st.st_size == sizeof(header) + key->len + header.output_len;
+    free(stored_key);
+    if (!is_hit) {
+        memo_entry_close(entry);
+        memo->misses++;
+        return 0;
+    }
+
+    entry->offset = sizeof(header) + key->len;
+    entry->status = header.status;
+    // Mark as recently used for eviction
+    utimensat(AT_FDCWD, entry->path, NULL, 0);
+    memo->hits++;
+    return 1;
+}
+
+/*
+ * Create a directory and any missing parents
+ * Returns 0 on success or -1 on error
+ */
+static int make_dirs(const char *dir) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", dir);
+    for (char *p = path + 1; *p != '\0'; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+                return -1;
+            }
+            *p = '/';
+        }
+    }
+    if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
+
+int memo_begin(memo_t *memo, const memo_key_t *key, memo_entry_t *entry) {
+    if (make_dirs(memo->dir) == -1) {
+        perror("mkdir");
+        return -1;
+    }
+    snprintf(entry->path, sizeof(entry->path), "%s/.tmp-XXXXXX", memo->dir);
+    if ((entry->fd = mkostemp(entry->path, O_CLOEXEC)) == -1) {
+        perror("mkstemp");
+        return -1;
+    }
+
+    // The header is filled in once the output's length is known
+    entry_header_t header;
+    memset(&header, 0, sizeof(header));
+    if (write(entry->fd, &header, sizeof(header)) != sizeof(header) ||
+        write(entry->fd, key->data, key->len) != (ssize_t) key->len) {
+        perror("write");
+        memo_abort(entry);
+        return -1;
+    }
+    entry->offset = sizeof(header) + key->len;
+    entry->status = 0;
+    return 0;
+}
+
+typedef struct {
+    char name[NAME_LEN + 1];
+    off_t size;
+    struct timespec mtime;
+} entry_info_t;
+
+static int by_mtime(const void *a, const void *b) {
+    const struct timespec *x = &((const entry_info_t *) a)->mtime;
+    const struct timespec *y = &((const entry_info_t *) b)->mtime;
+    if (x->tv_sec != y->tv_sec) {
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+    }
+    return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec;
+}
+
+/*
+ * List the cache's entries (not temporary files)
+ * Returns the entries, which the caller must free, or NULL on error
+ */
+static entry_info_t *list_entries(const memo_t *memo, unsigned *num_entries, off_t *total) {
+    DIR *dir = opendir(memo->dir);
+    *num_entries = 0;
+    *total = 0;
+    if (dir == NULL) {
+        return errno == ENOENT ? calloc(1, sizeof(entry_info_t)) : NULL;
+    }
+    unsigned cap = 64;
+    entry_info_t *entries = malloc(cap * sizeof(entry_info_t));
+    struct dirent *ent;
+    while (entries != NULL && (ent = readdir(dir)) != NULL) {
+        struct stat st;
+        if (strlen(ent->d_name) != NAME_LEN ||
+            strspn(ent->d_name, "0123456789abcdef") != NAME_LEN ||
+            fstatat(dirfd(dir), ent->d_name, &st, 0) == -1) {
+            continue;
+        }
+        if (*num_entries == cap) {
+            entry_info_t *bigger = realloc(entries, 2 * cap * sizeof(entry_info_t));
+            if (bigger == NULL) {
+                free(entries);
+                entries = NULL;
+                break;
+            }
+            entries = bigger;
+            cap *= 2;
+        }
+        entry_info_t *info = &entries[(*num_entries)++];
+        memcpy(info->name, ent->d_name, NAME_LEN + 1);
+        info->size = st.st_size;
+        info->mtime = st.st_mtim;
+        *total += st.st_size;
+    }
+    closedir(dir);
+    return entries;
+}
+
+/*
+ * Remove the least recently used entries until the cache fits its limit
+ */
+static void evict(memo_t *memo) {
+    unsigned num_entries;
+    off_t total;
+    entry_info_t *entries = list_entries(memo, &num_entries, &total);
+    if (entries == NULL) {
+        return;
+    }
+    if ((size_t) total > memo->max_size) {
+        qsort(entries, num_entries, sizeof(entry_info_t), by_mtime);
+        for (unsigned i = 0; i < num_entries && (size_t) total > memo->max_size; i++) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", memo->dir, entries[i].name);
+            if (unlink(path) == 0) {
+                total -= entries[i].size;
+                memo->evictions++;
+            }
+        }
+    }
+    free(entries);
+}
+
+int memo_commit(memo_t *memo, const memo_key_t *key, memo_entry_t *entry, int status) {
+    off_t end = lseek(entry->fd, 0, SEEK_END);
+    if (end == -1) {
+        perror("lseek");
+        return -1;
+    }
+    entry_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ENTRY_MAGIC, sizeof(header.magic));
+    header.version = ENTRY_VERSION;
+    header.status = status;
+    header.key_len = key->len;
+    header.output_len = end - entry->offset;
+    entry->status = status;
+    if (pwrite(entry->fd, &header, sizeof(header), 0) != sizeof(header)) {
+        perror("write");
+        return -1;
+    }
+
+    char path[sizeof(entry->path)];
+    entry_path(memo, key, path, sizeof(path));
+    if (rename(entry->path, path) == -1) {
+        perror("rename");
+        return -1;
+    }
+    memcpy(entry->path, path, sizeof(path));
+    evict(memo);
+    return 0;
+}
+
+void memo_abort(memo_entry_t *entry) {
+    unlink(entry->path);
+    memo_entry_close(entry);
+}
+
+void memo_entry_close(memo_entry_t *entry) {
+    if (entry->fd != -1) {
+        close(entry->fd);
+        entry->fd = -1;
+    }
+}
+
+int memo_replay(const memo_entry_t *entry, int fd) {
+    struct stat st;
+    if (fstat(entry->fd, &st) == -1) {
+        perror("fstat");
+        return -1;
+    }
+    off_t offset = entry->offset;
+    while (offset < st.st_size) {
+        ssize_t n = sendfile(fd, entry->fd, &offset, st.st_size - offset);
+        if (n == -1 && errno == EINVAL) {
+            // sendfile() can't write to every file (e.g. one opened for appending)
+            char buf[16384];
+            size_t len = st.st_size - offset < (off_t) sizeof(buf) ? st.st_size - offset
+                                                                   : sizeof(buf);
+            if ((n = pread(entry->fd, buf, len, offset)) > 0 && write(fd, buf, n) != n) {
+                n = -1;
+            }
+            offset += n > 0 ? n : 0;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            perror("write");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void memo_print_stats(const memo_t *memo) {
+    unsigned num_entries;
+    off_t total;
+    entry_info_t *entries = list_entries(memo, &num_entries, &total);
+    free(entries);
+    unsigned long lookups = memo->hits + memo->misses;
+    printf("hits: %lu\n", memo->hits);
+    printf("misses: %lu\n", memo->misses);
+    printf("hit rate: %.1f%%\n", lookups == 0 ? 0.0 : 100.0 * memo->hits / lookups);
+    printf("evictions: %lu\n", memo->evictions);
+    printf("entries: %u\n", num_entries);
+    printf("size: %lld of %zu bytes\n", (long long) total, memo->max_size);
+}
@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef MEMO_H
+#define MEMO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "string_vector.h"
+
+#define MEMO_DEFAULT_SIZE (64 * 1024 * 1024)
+
+/*
+ * On-disk cache of the output of deterministic commands
+ * Every entry is one file in the cache directory, named after the hash of its
+ * key and holding the key itself, the exit status and everything the command
+ * wrote to standard output. When the directory grows past its size limit the
+ * least recently used entries (by modification time, which a hit refreshes)
+ * are removed
+ */
+typedef struct {
+    char *dir;
+    size_t max_size;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+} memo_t;
+
+/*
+ * Everything a command's output may depend on: its arguments, the working
+ * directory, the identity (device, inode, modification time and size) of the
+ * programs it runs and of the files and directories it names, and the
+ * environment variables listed in SWISH_MEMO_ENV (by default PATH and the
+ * locale and time zone variables)
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    uint64_t hash;
+} memo_key_t;
+
+/*
+ * A cache entry being read (after a hit) or written (after a miss)
+ */
+typedef struct {
+    int fd;
+    off_t offset;    // Start of the output, which runs to the end of the file
+    int status;      // Exit status of the command
+    char path[4096];
+} memo_entry_t;
+
+/*
+ * Initialize a cache, without touching the directory yet
+ * memo: The cache to initialize
+ * dir: Cache directory, created when the first entry is stored, or NULL for
+ *      $XDG_CACHE_HOME/swish/memo (or ~/.cache/swish/memo)
+ * max_size: Most bytes the entries may take up together
+ * Returns 0 on success or -1 if there is no directory to use
+ */
+int memo_init(memo_t *memo, const char *dir, size_t max_size);
+
+/*
+ * Free a cache's state (the entries stay on disk)
+ * memo: The cache to free
+ */
+void memo_free(memo_t *memo);
+
+/*
+ * Build the key of a command
+ * key: Where to store the key, freed with memo_key_free()
+ * cmd: The command's tokens, without output redirections. May be a pipeline
+ * Returns 0 on success or -1 if the command can't be cached (e.g. one of its
+ * programs can't be found)
+ */
+int memo_key_build(memo_key_t *key, const strvec_t *cmd);
+
+/*
+ * Free a key built with memo_key_build()
+ * key: The key to free
+ */
+void memo_key_free(memo_key_t *key);
+
+/*
+ * Look a command up in the cache, marking the entry as recently used
+ * memo: The cache
+ * key: The command's key
+ * entry: Where to store the entry found, closed with memo_entry_close()
+ * Returns 1 on a hit or 0 on a miss
+ */
+int memo_lookup(memo_t *memo, const memo_key_t *key, memo_entry_t *entry);
+
+/*
+ * Start a new entry after a miss: the command's standard output should be
+ * written to entry->fd
+ * memo: The cache
+ * key: The command's key
+ * entry: Where to store the new entry
+ * Returns 0 on success or -1 on error
+ */
+int memo_begin(memo_t *memo, const memo_key_t *key, memo_entry_t *entry);
+
+/*
+ * Add a finished entry to the cache, evicting old entries if it's too big
+ * memo: The cache
+ * key: The key given to memo_begin()
+ * entry: An entry from memo_begin(), which stays open for replaying
+ * status: The command's exit status
+ * Returns 0 on success or -1 on error
+ */
+int memo_commit(memo_t *memo, const memo_key_t *key, memo_entry_t *entry, int status);
+
+/*
+ * Drop an entry from memo_begin() without adding it to the cache
+ * entry: The entry to drop, which is closed
+ */
+void memo_abort(memo_entry_t *entry);
+
+/*
+ * Close an entry once it is no longer needed
+ * entry: The entry to close
+ */
+void memo_entry_close(memo_entry_t *entry);
+
+/*
+ * Copy an entry's output to a file
+ * entry: The entry to copy
+ * fd: Where to write the output
+ * Returns 0 on success or -1 on error
+ */
+int memo_replay(const memo_entry_t *entry, int fd);
+
+/*
+ * Print hit and miss counts and the size of the cache
+ * memo: The cache
+ */
+void memo_print_stats(const memo_t *memo);
+
+#endif    // MEMO_H
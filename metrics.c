@@ -0,0 +1,269 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+
+#include "metrics.h"
+
+#include <dirent.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "deadline.h"
+
+#define MAX_BOUNDS 16
+
+typedef struct {
+    const char *name;
+    const char *help;
+    unsigned num_bounds;
+    uint64_t bounds_ns[MAX_BOUNDS];    // Upper bounds, the last bucket is +Inf
+    _Atomic uint64_t counts[MAX_BOUNDS + 1];
+    _Atomic uint64_t sum_ns;
+} histogram_t;
+
+static histogram_t spawn_hist = {
+    .name = "swish_spawn_duration_seconds",
+    .help = "Time taken to start a program, by fork or zygote hand-off",
+    .num_bounds = 10,
+    .bounds_ns = {25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
+                  50000000},
+};
+
+static histogram_t wait_hist = {
+    .name = "swish_wait_duration_seconds",
+    .help = "Time the shell spent waiting for a job to exit or stop",
+    .num_bounds = 10,
+    .bounds_ns = {1000000, 5000000, 10000000, 50000000, 100000000, 500000000, 1000000000,
+                  5000000000, 30000000000, 300000000000},
+};
+
+static _Atomic uint64_t background_completions;
+static _Atomic uint64_t background_failures;
+
+uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void histogram_record(histogram_t *h, uint64_t ns) {
+    unsigned i = 0;
+    while (i < h->num_bounds && ns > h->bounds_ns[i]) {
+        i++;
+    }
+    atomic_fetch_add_explicit(&h->counts[i], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum_ns, ns, memory_order_relaxed);
+}
+
+void metrics_record_spawn(uint64_t ns) {
+    histogram_record(&spawn_hist, ns);
+}
+
+void metrics_record_wait(uint64_t ns) {
+    histogram_record(&wait_hist, ns);
+}
+
+void metrics_record_background_exit(int status) {
+    atomic_fetch_add_explicit(&background_completions, 1, memory_order_relaxed);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        atomic_fetch_add_explicit(&background_failures, 1, memory_order_relaxed);
+    }
+}
+
+static void write_histogram(FILE *out, histogram_t *h) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", h->name, h->help, h->name);
+    // Prometheus buckets are cumulative, the recorded ones aren't
+    uint64_t total = 0;
+    for (unsigned i = 0; i <= h->num_bounds; i++) {
+        total += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+        if (i < h->num_bounds) {
+            fprintf(out, "%s_bucket{le=\"%g\"} %llu\n", h->name, h->bounds_ns[i] / 1e9,
+                    (unsigned long long) total);
+        } else {
+            fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", h->name, (unsigned long long) total);
+        }
+    }
+    fprintf(out, "%s_sum %.9f\n", h->name,
+            atomic_load_explicit(&h->sum_ns, memory_order_relaxed) / 1e9);
+    fprintf(out, "%s_count %llu\n", h->name, (unsigned long long) total);
+}
+
+static void write_counter(FILE *out, const char *name, const char *help, uint64_t value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name,
+            (unsigned long long) value);
+}
+
+static void write_gauge(FILE *out, const char *name, const char *help, long long value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", name, help, name, name, value);
+}
+
+/*
+ * Read the shell's resident set size from /proc
+ * Returns the size in bytes, or -1 if it can't be read
+ */
+static long long resident_bytes(void) {
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL) {
+        return -1;
+    }
+    long long pages;
+    int ok = fscanf(statm, "%*s %lld", &pages) == 1;
+    fclose(statm);
+    return ok ? pages * sysconf(_SC_PAGESIZE) : -1;
+}
+
+/*
+ * Count the shell's open file descriptors, not including the one used to count
+ * Returns the count, or -1 if it can't be read
+ */
+static long long open_fds(void) {
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir == NULL) {
+        return -1;
+    }
+    long long count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            count++;
+        }
+    }
+    closedir(dir);
+    return count - 1;
+}
+
+/*
+ * Write every metric
+ * fds: The shell's open descriptors, counted before the output file was opened
+ */
+static void write_metrics(FILE *out, const job_list_t *jobs, long long fds) {
+    unsigned background = 0;
+    unsigned stopped = 0;
+    unsigned timed_out = 0;
+    for (const job_t *job = jobs->head; job != NULL; job = job->next) {
+        if (job->deadline != NULL && job->deadline->timed_out) {
+            timed_out++;
+        } else if (job->status == BACKGROUND) {
+            background++;
+        } else {
+            stopped++;
+        }
+    }
+    fprintf(out,
+            "# HELP swish_jobs Jobs in the shell's job list, by status\n"
+            "# TYPE swish_jobs gauge\n"
+            "swish_jobs{status=\"background\"} %u\n"
+            "swish_jobs{status=\"stopped\"} %u\n"
+            "swish_jobs{status=\"timed_out\"} %u\n",
+            background, stopped, timed_out);
+
+    uint64_t spawns = 0;
+    for (unsigned i = 0; i <= spawn_hist.num_bounds; i++) {
+        spawns += atomic_load_explicit(&spawn_hist.counts[i], memory_order_relaxed);
+    }
+    write_counter(out, "swish_spawns_total", "Programs started by the shell", spawns);
+    write_histogram(out, &spawn_hist);
+    write_histogram(out, &wait_hist);
+    write_counter(out, "swish_background_completions_total",
+                  "Background jobs seen to end, successfully or not",
+                  atomic_load_explicit(&background_completions, memory_order_relaxed));
+    write_counter(out, "swish_background_failures_total",
+                  "Background jobs that exited with a non-zero status or were killed",
+                  atomic_load_explicit(&background_failures, memory_order_relaxed));
+
+    long long rss = resident_bytes();
+    if (rss != -1) {
+        write_gauge(out, "process_resident_memory_bytes", "Resident memory size in bytes", rss);
+    }
+    if (fds != -1) {
+        write_gauge(out, "process_open_fds", "Number of open file descriptors", fds);
+    }
+}
+
+int metrics_export_write(metrics_export_t *exp) {
+    // Counted before the temporary file adds one of its own
+    long long fds = open_fds();
+    char *tmp_path;
+    if (asprintf(&tmp_path, "%s.tmp.XXXXXX", exp->path) == -1) {
+        perror("asprintf");
+        return -1;
+    }
+    int fd = mkstemp(tmp_path);
+    FILE *out = fd == -1 ? NULL : fdopen(fd, "w");
+    if (out == NULL) {
+        if (!exp->is_failing) {
+            perror("Failed to write metrics");
+        }
+        if (fd != -1) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        exp->is_failing = 1;
+        free(tmp_path);
+        return -1;
+    }
+    // mkstemp() only gives the owner access, but collectors may run as anyone
+    fchmod(fd, 0644);
+
+    write_metrics(out, exp->jobs, fds);
+    int failed = ferror(out);
+    failed |= fclose(out) == EOF;
+    if (failed || rename(tmp_path, exp->path) == -1) {
+        if (!exp->is_failing) {
+            perror("Failed to write metrics");
+        }
+        unlink(tmp_path);
+        exp->is_failing = 1;
+        free(tmp_path);
+        return -1;
+    }
+    exp->is_failing = 0;
+    free(tmp_path);
+    return 0;
+}
+
+static void on_interval(int fd, void *arg) {
+    metrics_export_write(arg);
+}
+
+int metrics_export_start(metrics_export_t *exp, event_loop_t *loop, const job_list_t *jobs,
+                         const char *path, unsigned interval_ms) {
+    exp->loop = loop;
+    exp->jobs = jobs;
+    exp->timer = -1;
+    exp->is_failing = 0;
+    // keep writing to the same file after a cd
+    if (path[0] == '/') {
+        exp->path = strdup(path);
+    } else {
+        char *cwd = getcwd(NULL, 0);
+        if (cwd == NULL || asprintf(&exp->path, "%s/%s", cwd, path) == -1) {
+            exp->path = NULL;
+        }
+        free(cwd);
+    }
+    if (exp->path == NULL) {
+        perror("Failed to start metrics export");
+        return -1;
+    }
+
+    metrics_export_write(exp);
+    exp->timer = event_loop_add_timer(loop, interval_ms, interval_ms, on_interval, exp);
+    if (exp->timer == -1) {
+        free(exp->path);
+        return -1;
+    }
+    return 0;
+}
+
+void metrics_export_stop(metrics_export_t *exp) {
+    if (exp->timer != -1) {
+        event_loop_remove_timer(exp->loop, exp->timer);
+    }
+    free(exp->path);
+}
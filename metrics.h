@@ -0,0 +1,83 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#include "event_loop.h"
+#include "job_list.h"
+
+#define METRICS_DEFAULT_INTERVAL_MS 15000
+
+/*
+ * Counters and latency histograms of the shell, exported in the Prometheus
+ * text format for a node exporter's textfile collector
+ * Recording is always on and lock-free: every histogram has a fixed set of
+ * buckets, each a relaxed atomic counter, so the fork and wait paths only pay
+ * for a short bucket search and two atomic adds (the bucket and the sum)
+ */
+
+/*
+ * Read the monotonic clock
+ * Returns the time in nanoseconds
+ */
+uint64_t metrics_now_ns(void);
+
+/*
+ * Record how long it took to start a program (fork or zygote hand-off)
+ * ns: The time taken
+ */
+void metrics_record_spawn(uint64_t ns);
+
+/*
+ * Record how long the shell waited for a job to exit or stop
+ * ns: The time taken
+ */
+void metrics_record_wait(uint64_t ns);
+
+/*
+ * Record the end of a background job
+ * status: The job's wait status, a failure unless it exited with status 0
+ */
+void metrics_record_background_exit(int status);
+
+/*
+ * Periodic export of the metrics to a file, which is replaced atomically
+ * (written under a temporary name, then renamed) so readers never see part
+ * of an update
+ */
+typedef struct {
+    event_loop_t *loop;
+    const job_list_t *jobs;
+    char *path;
+    int timer;
+    int is_failing;    // Whether the last write failed, to report errors once
+} metrics_export_t;
+
+/*
+ * Write the metrics now and then every interval
+ * exp: The exporter to start
+ * loop: The shell's event loop, which runs the timer
+ * jobs: The shell's job list, for job counts by status
+ * path: File to write, e.g. "/var/lib/node_exporter/swish.prom"
+ * interval_ms: Milliseconds between writes
+ * Returns 0 on success or -1 on error
+ */
+int metrics_export_start(metrics_export_t *exp, event_loop_t *loop, const job_list_t *jobs,
+                         const char *path, unsigned interval_ms);
+
+/*
+ * Write the metrics now
+ * exp: The exporter
+ * Returns 0 on success or -1 on error
+ */
+int metrics_export_write(metrics_export_t *exp);
+
+/*
+ * Stop the periodic writes and free the exporter (the file stays)
+ * exp: The exporter to stop
+ */
+void metrics_export_stop(metrics_export_t *exp);
+
+#endif    // METRICS_H
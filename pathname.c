@@ -0,0 +1,182 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+
+#include "pathname.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "string_vector.h"
+
+// Read directories in large batches, a single call covers thousands of entries
+#define GETDENTS_BUF (256 * 1024)
+#define INITIAL_NAMES 4096
+#define INITIAL_ENTRIES 256
+
+void dirent_cache_init(dirent_cache_t *cache) {
+    cache->head = NULL;
+}
+
+static void dir_listing_free(dir_listing_t *listing) {
+    free(listing->path);
+    free(listing->names);
+    free(listing->offsets);
+    free(listing);
+}
+
+void dirent_cache_free(dirent_cache_t *cache) {
+    dir_listing_t *current = cache->head;
+    while (current != NULL) {
+        dir_listing_t *temp = current;
+        current = current->next;
+        dir_listing_free(temp);
+    }
+    cache->head = NULL;
+}
+
+int has_glob_chars(const char *s) {
+    return strpbrk(s, "*?[") != NULL;
+}
+
+static int compare_names(const void *a, const void *b, void *names) {
+    return strcmp((char *) names + *(const unsigned *) a, (char *) names + *(const unsigned *) b);
+}
+
+/*
+ * Append every entry of an open directory to a listing
+ * Returns 0 on success or -1 on error
+ */
+static int read_entries(int fd, dir_listing_t *listing) {
+    size_t names_len = 0;
+    size_t names_cap = INITIAL_NAMES;
+    unsigned entries_cap = INITIAL_ENTRIES;
+    char *buf = malloc(GETDENTS_BUF);
+    listing->names = malloc(names_cap);
+    listing->offsets = malloc(entries_cap * sizeof(unsigned));
+    if (buf == NULL || listing->names == NULL || listing->offsets == NULL) {
+        free(buf);
+        return -1;
+    }
+
+    ssize_t n;
+    while ((n = getdents64(fd, buf, GETDENTS_BUF)) > 0) {
+        for (ssize_t pos = 0; pos < n;) {
+            struct dirent64 *entry = (struct dirent64 *) (buf + pos);
+            pos += entry->d_reclen;
+            const char *name = entry->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                continue;
+            }
+
+            // Grow geometrically, never once per entry
+            size_t len = strlen(name) + 1;
+            if (names_len + len > names_cap) {
+                while (names_len + len > names_cap) {
+                    names_cap *= 2;
+                }
+                char *new_names = realloc(listing->names, names_cap);
+                if (new_names == NULL) {
+                    free(buf);
+                    return -1;
+                }
+                listing->names = new_names;
+            }
+            if (listing->count == entries_cap) {
+                entries_cap *= 2;
+                unsigned *new_offsets = realloc(listing->offsets, entries_cap * sizeof(unsigned));
+                if (new_offsets == NULL) {
+                    free(buf);
+                    return -1;
+                }
+                listing->offsets = new_offsets;
+            }
+            memcpy(listing->names + names_len, name, len);
+            listing->offsets[listing->count++] = names_len;
+            names_len += len;
+        }
+    }
+    free(buf);
+    if (n == -1) {
+        perror("getdents64");
+        return -1;
+    }
+
+    // Sort once here, every pattern matched against this listing is then in order
+    qsort_r(listing->offsets, listing->count, sizeof(unsigned), compare_names, listing->names);
+    return 0;
+}
+
+/*
+ * Find the listing for a directory, reading it if it isn't cached yet
+ * A directory that can't be opened gets an empty listing
+ * Returns the listing or NULL on error
+ */
+static dir_listing_t *get_listing(dirent_cache_t *cache, const char *path) {
+    for (dir_listing_t *current = cache->head; current != NULL; current = current->next) {
+        if (strcmp(current->path, path) == 0) {
+            return current;
+        }
+    }
+
+    dir_listing_t *listing = calloc(1, sizeof(dir_listing_t));
+    if (listing == NULL || (listing->path = strdup(path)) == NULL) {
+        free(listing);
+        return NULL;
+    }
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd != -1) {
+        int ret = read_entries(fd, listing);
+        close(fd);
+        if (ret == -1) {
+            dir_listing_free(listing);
+            return NULL;
+        }
+    }
+    listing->next = cache->head;
+    cache->head = listing;
+    return listing;
+}
+
+int expand_pathname(dirent_cache_t *cache, const char *pattern, strvec_t *matches) {
+    // Split into a literal directory part and the pattern for the last component
+    const char *slash = strrchr(pattern, '/');
+    size_t prefix_len = slash == NULL ? 0 : slash - pattern + 1;
+    const char *name_pattern = pattern + prefix_len;
+    if (prefix_len >= PATH_MAX - NAME_MAX - 1 || *name_pattern == '\0') {
+        return 0;
+    }
+
+    char path[PATH_MAX];
+    memcpy(path, pattern, prefix_len);
+    path[prefix_len] = '\0';
+    if (has_glob_chars(path)) {
+        // Patterns in directory components are not supported, leave the word alone
+        return 0;
+    }
+
+    dir_listing_t *listing = get_listing(cache, prefix_len == 0 ? "." : path);
+    if (listing == NULL) {
+        return -1;
+    }
+
+    int num_matches = 0;
+    for (unsigned i = 0; i < listing->count; i++) {
+        const char *name = listing->names + listing->offsets[i];
+        if (fnmatch(name_pattern, name, FNM_PERIOD) != 0) {
+            continue;
+        }
+        strncpy(path + prefix_len, name, PATH_MAX - prefix_len - 1);
+        path[PATH_MAX - 1] = '\0';
+        if (strvec_add(matches, path) == -1) {
+            return -1;
+        }
+        num_matches++;
+    }
+    return num_matches;
+}
@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef PATHNAME_H
+#define PATHNAME_H
+
+#include "string_vector.h"
+
+/*
+ * The sorted entries of one directory
+ * Names are stored back to back in a single buffer, so a listing costs a
+ * handful of allocations no matter how many entries the directory has
+ */
+typedef struct dir_listing {
+    char *path;
+    char *names;
+    unsigned *offsets;
+    unsigned count;
+    struct dir_listing *next;
+} dir_listing_t;
+
+/*
+ * Directory listings read while expanding one command line
+ * Each directory is read at most once, however many patterns refer to it
+ */
+typedef struct {
+    dir_listing_t *head;
+} dirent_cache_t;
+
+/*
+ * Initialize a new, empty directory cache
+ * cache: Pointer to the cache to initialize
+ */
+void dirent_cache_init(dirent_cache_t *cache);
+
+/*
+ * Free all listings held by a directory cache
+ * cache: Pointer to the cache to clear
+ */
+void dirent_cache_free(dirent_cache_t *cache);
+
+/*
+ * Check if a word contains any pathname expansion characters ('*', '?' or '[')
+ * s: The word to check
+ * Returns 1 if it does, 0 otherwise
+ */
+int has_glob_chars(const char *s);
+
+/*
+ * Expand a pattern into the sorted list of paths matching it
+ * Only the last path component may contain pattern characters, and names
+ * starting with '.' only match a pattern that starts with '.'
+ * cache: Cache of directory listings to read from (and add to)
+ * pattern: The pattern to expand, e.g. "*.txt" or "test_cases/input/?.txt"
+ * matches: Vector to add matching paths to
+ * Returns the number of matches added (0 if nothing matched) or -1 on error
+ */
+int expand_pathname(dirent_cache_t *cache, const char *pattern, strvec_t *matches);
+
+#endif    // PATHNAME_H
@@ -0,0 +1,682 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#define _GNU_SOURCE
+
+#include "pipeline.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "scan.h"
+#include "spsc_ring.h"
+#include "swish_funcs.h"
+
+#define BUF_SIZE 16384
+
+// Set before the shell forks the pipeline's process, and seen by it
+static int fusion_enabled = 0;
+
+/*
+ * One end of a builtin filter's input or output: a ring shared with the
+ * neighbouring filter, or a file descriptor at the edge of the fused run
+ */
+typedef struct {
+    int fd;
+    spsc_ring_t *ring;
+} stream_t;
+
+/*
+ * Buffers small writes (e.g. single lines) into larger ones
+ */
+typedef struct {
+    stream_t *stream;
+    size_t len;
+    char buf[BUF_SIZE];
+} writer_t;
+
+typedef struct {
+    const char *name;
+    // Returns 1 if the filter supports these arguments
+    int (*accepts)(const strvec_t *args);
+    // Returns the exit status
+    int (*run)(const strvec_t *args, stream_t *in, stream_t *out);
+} filter_t;
+
+/*
+ * A builtin filter running as one thread of a fused run
+ */
+typedef struct {
+    const filter_t *filter;
+    const strvec_t *args;
+    stream_t in;
+    stream_t out;
+    int status;
+} stage_t;
+
+static ssize_t stream_read(stream_t *s, char *buf, size_t len) {
+    if (s->ring != NULL) {
+        return spsc_ring_read(s->ring, buf, len);
+    }
+    ssize_t n;
+    do {
+        n = read(s->fd, buf, len);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) {
+        perror("read");
+    }
+    return n;
+}
+
+static int stream_write(stream_t *s, const char *buf, size_t len) {
+    if (s->ring != NULL) {
+        return spsc_ring_write(s->ring, buf, len);
+    }
+    while (len > 0) {
+        ssize_t n = write(s->fd, buf, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1) {
+            perror("write");
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int writer_flush(writer_t *w) {
+    int ret = stream_write(w->stream, w->buf, w->len);
+    w->len = 0;
+    return ret;
+}
+
+static int writer_put(writer_t *w, const char *data, size_t len) {
+    if (w->len + len > BUF_SIZE && writer_flush(w) == -1) {
+        return -1;
+    }
+    if (len > BUF_SIZE) {
+        return stream_write(w->stream, data, len);
+    }
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+    return 0;
+}
+
+/*
+ * Copy everything from one stream to another
+ * Returns 0 on success or -1 on error
+ */
+static int copy_stream(stream_t *in, stream_t *out) {
+    char buf[BUF_SIZE];
+    ssize_t n;
+    while ((n = stream_read(in, buf, sizeof(buf))) > 0) {
+        if (stream_write(out, buf, n) == -1) {
+            return -1;
+        }
+    }
+    return n;
+}
+
+static int cat_accepts(const strvec_t *args) {
+    for (unsigned i = 1; i < args->length; i++) {
+        if (strvec_get(args, i)[0] == '-') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int cat_run(const strvec_t *args, stream_t *in, stream_t *out) {
+    if (args->length == 1) {
+        return copy_stream(in, out) == -1;
+    }
+    int status = 0;
+    for (unsigned i = 1; i < args->length; i++) {
+        const char *path = strvec_get(args, i);
+        stream_t file = {.fd = open(path, O_RDONLY), .ring = NULL};
+        if (file.fd == -1) {
+            fprintf(stderr, "cat: %s: %s\n", path, strerror(errno));
+            status = 1;
+            continue;
+        }
+        int ret = copy_stream(&file, out);
+        close(file.fd);
+        if (ret == -1) {
+            return 1;
+        }
+    }
+    return status;
+}
+
+/*
+ * Parse wc's options, e.g. "-l" or "-lw"
+ * Returns 0 on success or -1 if there are other arguments
+ */
+static int parse_wc_options(const strvec_t *args, int *lines, int *words, int *bytes) {
+    *lines = *words = *bytes = 0;
+    for (unsigned i = 1; i < args->length; i++) {
+        const char *arg = strvec_get(args, i);
+        if (arg[0] != '-' || arg[1] == '\0') {
+            return -1;
+        }
+        for (const char *c = arg + 1; *c != '\0'; c++) {
+            if (*c == 'l') {
+                *lines = 1;
+            } else if (*c == 'w') {
+                *words = 1;
+            } else if (*c == 'c') {
+                *bytes = 1;
+            } else {
+                return -1;
+            }
+        }
+    }
+    if (!*lines && !*words && !*bytes) {
+        *lines = *words = *bytes = 1;
+    }
+    return 0;
+}
+
+static int wc_accepts(const strvec_t *args) {
+    int lines, words, bytes;
+    return parse_wc_options(args, &lines, &words, &bytes) == 0;
+}
+
+static int wc_run(const strvec_t *args, stream_t *in, stream_t *out) {
+    int show_lines, show_words, show_bytes;
+    parse_wc_options(args, &show_lines, &show_words, &show_bytes);
+
+    unsigned long counts[3] = {0, 0, 0};
+    int in_word = 0;
+    char buf[BUF_SIZE];
+    ssize_t n;
+    while ((n = stream_read(in, buf, sizeof(buf))) > 0) {
+        counts[2] += n;
+        if (!show_words) {
+            // Lines alone can be counted a lot faster than words
+            for (char *p = buf; (p = memchr(p, '\n', buf + n - p)) != NULL; p++) {
+                counts[0]++;
+            }
+            continue;
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            unsigned char c = buf[i];
+            counts[0] += c == '\n';
+            if (isspace(c)) {
+                in_word = 0;
+            } else if (!in_word) {
+                in_word = 1;
+                counts[1]++;
+            }
+        }
+    }
+    if (n == -1) {
+        return 1;
+    }
+
+    // Like wc reading standard input: a single count is printed as is, several
+    // are right-aligned in columns
+    int show[3] = {show_lines, show_words, show_bytes};
+    int num_shown = show_lines + show_words + show_bytes;
+    char line[64];
+    size_t len = 0;
+    for (int i = 0; i < 3; i++) {
+        if (show[i]) {
+            len += snprintf(line + len, sizeof(line) - len, "%s%*lu", len > 0 ? " " : "",
+                            num_shown > 1 ? 7 : 0, counts[i]);
+        }
+    }
+    line[len++] = '\n';
+    return stream_write(out, line, len) == -1;
+}
+
+/*
+ * Parse grep's options and pattern, e.g. "-v PATTERN" or "-ci PATTERN"
+ * Returns 0 on success or -1 for any other arguments
+ */
+static int parse_grep_options(const strvec_t *args, int *invert, int *count, int *icase,
+                              const char **pattern) {
+    *invert = *count = *icase = 0;
+    *pattern = NULL;
+    for (unsigned i = 1; i < args->length; i++) {
+        const char *arg = strvec_get(args, i);
+        if (*pattern != NULL) {
+            return -1;
+        } else if (arg[0] != '-' || arg[1] == '\0') {
+            *pattern = arg;
+            continue;
+        }
+        for (const char *c = arg + 1; *c != '\0'; c++) {
+            if (*c == 'v') {
+                *invert = 1;
+            } else if (*c == 'c') {
+                *count = 1;
+            } else if (*c == 'i') {
+                *icase = 1;
+            } else {
+                return -1;
+            }
+        }
+    }
+    return *pattern == NULL ? -1 : 0;
+}
+
+static int grep_accepts(const strvec_t *args) {
+    int invert, count, icase;
+    const char *pattern;
+    return parse_grep_options(args, &invert, &count, &icase, &pattern) == 0;
+}
+
+/*
+ * Output or count lines that grep selected
+ * lines: Complete lines, each ending in '\n' except maybe the last one
+ * len: Length of 'lines'
+ * Returns 0 on success or -1 on error
+ */
+static int grep_select(writer_t *w, int count_only, unsigned long *num_selected,
+                       const char *lines, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    int has_newline = lines[len - 1] == '\n';
+    for (const char *p = lines; (p = memchr(p, '\n', lines + len - p)) != NULL; p++) {
+        (*num_selected)++;
+    }
+    *num_selected += !has_newline;
+    if (count_only) {
+        return 0;
+    }
+    if (writer_put(w, lines, len) == -1 || (!has_newline && writer_put(w, "\n", 1) == -1)) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Run grep over a run of complete lines
+ * Rather than trying the pattern on one line at a time, search the whole run
+ * (REG_NEWLINE keeps matches within a line) and jump to the line of each match
+ * literal: The pattern if it has no special characters (so memmem() can find
+ *          it), or NULL to use the regular expression
+ * lines: The lines, followed by a '\0'
+ * len: Length of 'lines'
+ * Returns 0 on success or -1 on error
+ */
+static int grep_lines(regex_t *re, const char *literal, writer_t *w, int invert, int count_only,
+                      unsigned long *num_selected, const char *lines, size_t len) {
+    size_t literal_len = literal == NULL ? 0 : strlen(literal);
+    size_t pos = 0;
+    while (pos < len) {
+        regmatch_t match;
+        const char *found = NULL;
+        if (literal != NULL) {
+            found = memmem(lines + pos, len - pos, literal, literal_len);
+        } else if (regexec(re, lines + pos, 1, &match, 0) == 0) {
+            found = lines + pos + match.rm_so;
+        }
+        size_t line_start = len;
+        size_t line_end = len;
+        if (found != NULL) {
+            size_t match_start = found - lines;
+            // An empty match after the final newline isn't on any line
+            if (match_start < len || lines[len - 1] != '\n') {
+                const char *prev = memrchr(lines + pos, '\n', match_start - pos);
+                line_start = prev == NULL ? pos : (size_t) (prev - lines) + 1;
+                line_end = match_start + scan_line_end(lines + match_start, len - match_start);
+            }
+        }
+
+        // Everything up to the matching line doesn't match
+        if (invert && grep_select(w, count_only, num_selected, lines + pos,
+                                  line_start - pos) == -1) {
+            return -1;
+        }
+        if (line_start == len) {
+            break;
+        }
+        size_t next = line_end < len ? line_end + 1 : len;
+        if (!invert && grep_select(w, count_only, num_selected, lines + line_start,
+                                   next - line_start) == -1) {
+            return -1;
+        }
+        pos = next;
+    }
+    return 0;
+}
+
+static int grep_run(const strvec_t *args, stream_t *in, stream_t *out) {
+    int invert, count_only, icase;
+    const char *pattern;
+    parse_grep_options(args, &invert, &count_only, &icase, &pattern);
+    regex_t re;
+    if (regcomp(&re, pattern, REG_NEWLINE | (icase ? REG_ICASE : 0)) != 0) {
+        fprintf(stderr, "grep: Invalid regular expression\n");
+        return 2;
+    }
+
+    const char *literal = NULL;
+    if (!icase && strpbrk(pattern, ".[]*^$\\") == NULL) {
+        literal = pattern;
+    }
+
+    writer_t *w = malloc(sizeof(writer_t));
+    size_t cap = 2 * BUF_SIZE;
+    char *pending = malloc(cap);
+    if (w == NULL || pending == NULL) {
+        perror("malloc");
+        free(w);
+        free(pending);
+        regfree(&re);
+        return 2;
+    }
+    w->stream = out;
+    w->len = 0;
+
+    unsigned long num_selected = 0;
+    size_t len = 0;
+    int failed = 0;
+    int at_eof = 0;
+    while (!at_eof && !failed) {
+        // Room for another read, plus a terminator after the lines to search
+        if (cap - len < BUF_SIZE + 1) {
+            char *bigger = realloc(pending, 2 * cap);
+            if (bigger == NULL) {
+                perror("realloc");
+                failed = 1;
+                break;
+            }
+            pending = bigger;
+            cap *= 2;
+        }
+        ssize_t n = stream_read(in, pending + len, BUF_SIZE);
+        if (n == -1) {
+            failed = 1;
+            break;
+        }
+        at_eof = n == 0;
+        len += n;
+
+        // Search every complete line, and the unfinished one at the end of input
+        size_t complete = len;
+        if (!at_eof) {
+            char *last_newline = memrchr(pending, '\n', len);
+            complete = last_newline == NULL ? 0 : (size_t) (last_newline - pending) + 1;
+        }
+        if (complete > 0) {
+            char saved = pending[complete];
+            pending[complete] = '\0';
+            failed = grep_lines(&re, literal, w, invert, count_only, &num_selected, pending,
+                                complete) == -1;
+            pending[complete] = saved;
+        }
+        memmove(pending, pending + complete, len - complete);
+        len -= complete;
+    }
+
+    if (!failed && count_only) {
+        char line[32];
+        int n = snprintf(line, sizeof(line), "%lu\n", num_selected);
+        failed = writer_put(w, line, n) == -1;
+    }
+    if (!failed) {
+        failed = writer_flush(w) == -1;
+    }
+    free(w);
+    free(pending);
+    regfree(&re);
+    if (failed) {
+        return 2;
+    }
+    return num_selected > 0 ? 0 : 1;
+}
+
+static const filter_t filters[] = {
+    {"cat", cat_accepts, cat_run},
+    {"wc", wc_accepts, wc_run},
+    {"grep", grep_accepts, grep_run},
+};
+
+/*
+ * Find the builtin filter that can run a stage
+ * Returns the filter, or NULL if the stage must run as an external program
+ */
+static const filter_t *find_filter(const strvec_t *stage) {
+    for (unsigned i = 1; i < stage->length; i++) {
+        const char *token = strvec_get(stage, i);
+        if (strcmp(token, "<") == 0 || strcmp(token, ">") == 0 || strcmp(token, ">>") == 0 ||
+            strcmp(token, "<<") == 0 || strcmp(token, "<<<") == 0) {
+            return NULL;
+        }
+    }
+    for (unsigned i = 0; i < sizeof(filters) / sizeof(filters[0]); i++) {
+        if (strcmp(strvec_get(stage, 0), filters[i].name) == 0) {
+            return filters[i].accepts(stage) ? &filters[i] : NULL;
+        }
+    }
+    return NULL;
+}
+
+static void *run_stage(void *arg) {
+    stage_t *stage = arg;
+    stage->status = stage->filter->run(stage->args, &stage->in, &stage->out);
+    // Let the neighbours finish too, even if this filter stopped early
+    if (stage->in.ring != NULL) {
+        spsc_ring_close_read(stage->in.ring);
+    }
+    if (stage->out.ring != NULL) {
+        spsc_ring_close_write(stage->out.ring);
+    }
+    return NULL;
+}
+
+/*
+ * Run consecutive builtin filters as threads of the calling process, from
+ * standard input to standard output
+ * Returns the exit status of the last filter
+ */
+static int run_fused(const strvec_t *args, unsigned num_stages) {
+    stage_t *stages = calloc(num_stages, sizeof(stage_t));
+    spsc_ring_t *rings = calloc(num_stages, sizeof(spsc_ring_t));
+    pthread_t *threads = calloc(num_stages, sizeof(pthread_t));
+    if (stages == NULL || rings == NULL || threads == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (unsigned i = 0; i < num_stages; i++) {
+        stages[i].filter = find_filter(&args[i]);
+        stages[i].args = &args[i];
+        stages[i].in = (stream_t){.fd = STDIN_FILENO, .ring = NULL};
+        stages[i].out = (stream_t){.fd = STDOUT_FILENO, .ring = NULL};
+        if (i > 0) {
+            if (spsc_ring_init(&rings[i], SPSC_RING_DEFAULT_SIZE) == -1) {
+                perror("malloc");
+                return 1;
+            }
+            stages[i - 1].out.ring = &rings[i];
+            stages[i].in.ring = &rings[i];
+        }
+    }
+
+    // The last filter runs on this thread
+    for (unsigned i = 0; i + 1 < num_stages; i++) {
+        int err = pthread_create(&threads[i], NULL, run_stage, &stages[i]);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            return 1;
+        }
+    }
+    run_stage(&stages[num_stages - 1]);
+    for (unsigned i = 0; i + 1 < num_stages; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    int status = stages[num_stages - 1].status;
+    for (unsigned i = 1; i < num_stages; i++) {
+        spsc_ring_free(&rings[i]);
+    }
+    free(threads);
+    free(rings);
+    free(stages);
+    return status;
+}
+
+void pipeline_enable_fusion(void) {
+    fusion_enabled = 1;
+}
+
+int pipeline_is_pipeline(const strvec_t *tokens) {
+    return strvec_find(tokens, "|") != -1;
+}
+
+/*
+ * Split a command line into its stages at each "|"
+ * Returns the stages (which the caller must free) or NULL on error
+ */
+static strvec_t *split_stages(const strvec_t *tokens, unsigned *num_stages) {
+    unsigned n = 1;
+    for (unsigned i = 0; i < tokens->length; i++) {
+        n += strcmp(strvec_get(tokens, i), "|") == 0;
+    }
+    strvec_t *stages = malloc(n * sizeof(strvec_t));
+    if (stages == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    for (unsigned i = 0; i < n; i++) {
+        strvec_init(&stages[i]);
+    }
+
+    unsigned stage = 0;
+    for (unsigned i = 0; i < tokens->length; i++) {
+        const char *token = strvec_get(tokens, i);
+        if (strcmp(token, "|") == 0) {
+            stage++;
+        } else if (strvec_add(&stages[stage], token) == -1) {
+            break;
+        }
+    }
+    for (unsigned i = 0; i < n; i++) {
+        if (stages[i].length == 0) {
+            fprintf(stderr, "Missing command in pipeline\n");
+            for (unsigned j = 0; j < n; j++) {
+                strvec_clear(&stages[j]);
+            }
+            free(stages);
+            return NULL;
+        }
+    }
+    *num_stages = n;
+    return stages;
+}
+
+int pipeline_run(strvec_t *tokens) {
+    unsigned num_stages;
+    strvec_t *stages = split_stages(tokens, &num_stages);
+    if (stages == NULL) {
+        return -1;
+    }
+
+    // Builtin filters all the way through: no child is needed at all, the job
+    // process runs them itself
+    unsigned num_fused = 0;
+    while (fusion_enabled && num_fused < num_stages && find_filter(&stages[num_fused]) != NULL) {
+        num_fused++;
+    }
+    if (num_fused == num_stages) {
+        int fused_status = run_fused(stages, num_stages);
+        for (unsigned i = 0; i < num_stages; i++) {
+            strvec_clear(&stages[i]);
+        }
+        free(stages);
+        _exit(fused_status);
+    }
+
+    // Start each run of builtin filters, or each external command, in a child
+    pid_t last_pid = -1;
+    int prev_read = -1;
+    int failed = 0;
+    for (unsigned i = 0, end; i < num_stages; i = end) {
+        int is_fused = fusion_enabled && find_filter(&stages[i]) != NULL;
+        end = i + 1;
+        while (is_fused && end < num_stages && find_filter(&stages[end]) != NULL) {
+            end++;
+        }
+
+        int pipe_fds[2] = {-1, -1};
+        if (end < num_stages && pipe(pipe_fds) == -1) {
+            perror("pipe");
+            failed = 1;
+            break;
+        }
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            failed = 1;
+        } else if (pid == 0) {
+            if ((prev_read != -1 && dup2(prev_read, STDIN_FILENO) == -1) ||
+                (pipe_fds[1] != -1 && dup2(pipe_fds[1], STDOUT_FILENO) == -1)) {
+                perror("dup2");
+                _exit(1);
+            }
+            if (prev_read != -1) {
+                close(prev_read);
+            }
+            if (pipe_fds[1] != -1) {
+                close(pipe_fds[0]);
+                close(pipe_fds[1]);
+            }
+            if (is_fused) {
+                _exit(run_fused(stages + i, end - i));
+            }
+            exec_command(&stages[i]);
+            _exit(1);
+        }
+
+        if (prev_read != -1) {
+            close(prev_read);
+        }
+        if (pipe_fds[1] != -1) {
+            close(pipe_fds[1]);
+        }
+        prev_read = pipe_fds[0];
+        if (failed) {
+            break;
+        }
+        last_pid = pid;
+    }
+    if (prev_read != -1) {
+        close(prev_read);
+    }
+
+    // Exit the way the last stage did, once every stage is done
+    int status = 0;
+    int last_status = 0;
+    pid_t pid;
+    while ((pid = wait(&status)) != -1 || errno == EINTR) {
+        if (pid == last_pid) {
+            last_status = status;
+        }
+    }
+    for (unsigned i = 0; i < num_stages; i++) {
+        strvec_clear(&stages[i]);
+    }
+    free(stages);
+    if (failed) {
+        _exit(1);
+    }
+    if (WIFSIGNALED(last_status)) {
+        signal(WTERMSIG(last_status), SIG_DFL);
+        raise(WTERMSIG(last_status));
+    }
+    _exit(WEXITSTATUS(last_status));
+}
@@ -0,0 +1,38 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "string_vector.h"
+
+/*
+ * Run consecutive cat, wc and grep stages of later pipelines as threads of a
+ * single process, connected by in-memory rings instead of pipes (see
+ * pipeline_run()). Only affects processes forked after this is called
+ */
+void pipeline_enable_fusion(void);
+
+/*
+ * Check whether a command line is a pipeline ("cmd | cmd ...")
+ * tokens: Tokens of the command line
+ * Returns 1 if it is or 0 if not
+ */
+int pipeline_is_pipeline(const strvec_t *tokens);
+
+/*
+ * Run a pipeline, from a child of the shell (like run_command())
+ * Each stage runs in its own child, all in the caller's process group, and
+ * the caller waits for them and exits the way the last stage did. With fusion
+ * enabled, a run of stages that are builtin filters shares one child instead,
+ * where each filter is a thread. Pipes are only used between that child and
+ * external commands. A pipeline made only of builtin filters runs in the
+ * caller itself, without any child
+ * Builtin filters: "cat [FILE...]", "wc [-lwc]" and "grep [-vci] PATTERN"
+ * (a basic regular expression). A stage with any other arguments or with a
+ * redirection runs the external program instead
+ * tokens: Tokens of the command line
+ * Doesn't return on success (similar to exec) or returns -1 on error
+ */
+int pipeline_run(strvec_t *tokens);
+
+#endif    // PIPELINE_H
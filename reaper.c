@@ -0,0 +1,309 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+
+#include "reaper.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define PATH_LEN 64
+#define STAT_LEN 512
+#define JOB_ENV "SWISH_JOB"
+
+// Set once the shell is a subreaper, and seen by children forked after that
+static int is_enabled = 0;
+
+int reaper_enable(void) {
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) == -1) {
+        perror("prctl");
+        return -1;
+    }
+    is_enabled = 1;
+    return 0;
+}
+
+int reaper_tag_job(void) {
+    if (!is_enabled) {
+        return 0;
+    }
+    char value[PATH_LEN];
+    snprintf(value, sizeof(value), "%d", getpgrp());
+    return setenv(JOB_ENV, value, 1);
+}
+
+void reaper_init(reaper_t *reaper) {
+    reaper->head = NULL;
+    reaper->length = 0;
+    reaper->seen = NULL;
+    reaper->seen_cap = 0;
+}
+
+void reaper_free(reaper_t *reaper) {
+    orphan_t *current = reaper->head;
+    while (current != NULL) {
+        orphan_t *temp = current;
+        current = current->next;
+        free(temp);
+    }
+    reaper->head = NULL;
+    reaper->length = 0;
+    free(reaper->seen);
+    reaper->seen = NULL;
+    reaper->seen_cap = 0;
+}
+
+/*
+ * Find a process ID's slot in an open-addressing hash set (cap is a power of two)
+ * Returns the slot holding the ID, or the free slot where it would go
+ */
+static pid_t *pid_slot(pid_t *set, unsigned cap, pid_t pid) {
+    unsigned i = ((unsigned) pid * 2654435761u) & (cap - 1);
+    while (set[i] != 0 && set[i] != pid) {
+        i = (i + 1) & (cap - 1);
+    }
+    return &set[i];
+}
+
+static int pid_set_has(pid_t *set, unsigned cap, pid_t pid) {
+    return cap > 0 && *pid_slot(set, cap, pid) == pid;
+}
+
+/*
+ * Fill a hash set with process IDs, growing it to keep it at most half full
+ * Returns 0 on success or -1 on error
+ */
+static int pid_set_fill(pid_t **set, unsigned *cap, const pid_t *pids, unsigned num_pids) {
+    unsigned needed = 16;
+    while (needed < 2 * num_pids) {
+        needed *= 2;
+    }
+    if (needed > *cap) {
+        pid_t *new_set = realloc(*set, needed * sizeof(pid_t));
+        if (new_set == NULL) {
+            return -1;
+        }
+        *set = new_set;
+        *cap = needed;
+    }
+    memset(*set, 0, *cap * sizeof(pid_t));
+    for (unsigned i = 0; i < num_pids; i++) {
+        *pid_slot(*set, *cap, pids[i]) = pids[i];
+    }
+    return 0;
+}
+
+/*
+ * Read the process group of a process from /proc
+ * Returns the process group ID or -1 on error
+ */
+static pid_t read_pgid(pid_t pid) {
+    char path[PATH_LEN];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "re");
+    if (f == NULL) {
+        return -1;
+    }
+    char stat[STAT_LEN];
+    char *line = fgets(stat, sizeof(stat), f);
+    fclose(f);
+    // The command name may contain anything, so start after its last ')'
+    char *fields = line == NULL ? NULL : strrchr(stat, ')');
+    pid_t pgid;
+    if (fields == NULL || sscanf(fields + 1, " %*c %*d %d", &pgid) != 1) {
+        return -1;
+    }
+    return pgid;
+}
+
+/*
+ * Read the job a process was started by from its environment (see reaper_tag_job())
+ * Returns the job's process ID, or 0 if the process carries no tag
+ */
+static pid_t read_job_tag(pid_t pid) {
+    char path[PATH_LEN];
+    snprintf(path, sizeof(path), "/proc/%d/environ", pid);
+    FILE *f = fopen(path, "re");
+    if (f == NULL) {
+        return 0;
+    }
+    pid_t job = 0;
+    char *entry = NULL;
+    size_t capacity = 0;
+    size_t prefix_len = strlen(JOB_ENV "=");
+    while (getdelim(&entry, &capacity, '\0', f) != -1) {
+        if (strncmp(entry, JOB_ENV "=", prefix_len) == 0) {
+            job = atoi(entry + prefix_len);
+            break;
+        }
+    }
+    free(entry);
+    fclose(f);
+    return job;
+}
+
+/*
+ * Find the job an adopted process belongs to
+ * Returns the job's process ID, or 0 if it can't be attributed to any job
+ */
+static pid_t job_of(const reaper_t *reaper, const job_list_t *jobs, pid_t pid, pid_t pgid) {
+    // The tag survives setsid(), so it is the most reliable clue
+    pid_t tag = read_job_tag(pid);
+    for (const job_t *job = jobs->head; job != NULL; job = job->next) {
+        if (job->pid == tag || job->pid == pgid) {
+            return job->pid;
+        }
+    }
+    if (pgid == -1) {
+        return 0;
+    }
+    for (const orphan_t *orphan = reaper->head; orphan != NULL; orphan = orphan->next) {
+        if (orphan->job != 0 && (orphan->pid == pgid || orphan->pgid == pgid)) {
+            return orphan->job;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Read the process IDs of the shell's children
+ * Returns the IDs (which the caller must free), or NULL on error
+ */
+static pid_t *read_children(unsigned *num_children) {
+    char path[PATH_LEN];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/children", getpid());
+    FILE *f = fopen(path, "re");
+    if (f == NULL) {
+        return NULL;
+    }
+    unsigned len = 0;
+    unsigned cap = 64;
+    pid_t *children = malloc(cap * sizeof(pid_t));
+    pid_t pid;
+    while (children != NULL && fscanf(f, "%d", &pid) == 1) {
+        if (len == cap) {
+            cap *= 2;
+            pid_t *new_children = realloc(children, cap * sizeof(pid_t));
+            if (new_children == NULL) {
+                free(children);
+                children = NULL;
+                break;
+            }
+            children = new_children;
+        }
+        children[len++] = pid;
+    }
+    fclose(f);
+    *num_children = len;
+    return children;
+}
+
+/*
+ * Build a hash set of the children already accounted for: jobs, orphans and
+ * the other known children
+ * Returns 0 on success or -1 on error
+ */
+static int fill_accounted(const reaper_t *reaper, const job_list_t *jobs, const pid_t *known,
+                          unsigned num_known, pid_t **set, unsigned *cap) {
+    pid_t *pids = malloc((jobs->length + reaper->length + num_known + 1) * sizeof(pid_t));
+    if (pids == NULL) {
+        return -1;
+    }
+    unsigned num_pids = 0;
+    for (const job_t *job = jobs->head; job != NULL; job = job->next) {
+        pids[num_pids++] = job->pid;
+    }
+    for (const orphan_t *orphan = reaper->head; orphan != NULL; orphan = orphan->next) {
+        pids[num_pids++] = orphan->pid;
+    }
+    for (unsigned i = 0; i < num_known; i++) {
+        pids[num_pids++] = known[i];
+    }
+    int ret = pid_set_fill(set, cap, pids, num_pids);
+    free(pids);
+    return ret;
+}
+
+/*
+ * Add every child of the shell that appeared since the last collection and
+ * isn't a job or otherwise known
+ */
+static void adopt_new_children(reaper_t *reaper, const job_list_t *jobs, const pid_t *known,
+                               unsigned num_known) {
+    unsigned num_children;
+    pid_t *children = read_children(&num_children);
+    int is_complete = children != NULL;
+
+    // Everything accounted for is only looked up if there is anything new
+    pid_t *accounted = NULL;
+    unsigned accounted_cap = 0;
+    for (unsigned i = 0; is_complete && i < num_children; i++) {
+        pid_t pid = children[i];
+        if (pid_set_has(reaper->seen, reaper->seen_cap, pid)) {
+            continue;
+        }
+        if (accounted == NULL &&
+            fill_accounted(reaper, jobs, known, num_known, &accounted, &accounted_cap) == -1) {
+            is_complete = 0;
+            break;
+        }
+        if (pid_set_has(accounted, accounted_cap, pid)) {
+            continue;
+        }
+
+        orphan_t *orphan = malloc(sizeof(orphan_t));
+        if (orphan == NULL) {
+            is_complete = 0;
+            break;
+        }
+        orphan->pid = pid;
+        orphan->pgid = read_pgid(pid);
+        orphan->job = job_of(reaper, jobs, pid, orphan->pgid);
+        orphan->next = reaper->head;
+        reaper->head = orphan;
+        reaper->length++;
+    }
+    free(accounted);
+
+    // Without a complete snapshot, every child is checked again next time
+    if (!is_complete ||
+        pid_set_fill(&reaper->seen, &reaper->seen_cap, children, num_children) == -1) {
+        free(reaper->seen);
+        reaper->seen = NULL;
+        reaper->seen_cap = 0;
+    }
+    free(children);
+}
+
+void reaper_collect(reaper_t *reaper, const job_list_t *jobs, const pid_t *known,
+                    unsigned num_known) {
+    adopt_new_children(reaper, jobs, known, num_known);
+
+    orphan_t **link = &reaper->head;
+    while (*link != NULL) {
+        orphan_t *orphan = *link;
+        // Stops are of no interest here, only exits
+        pid_t ret = waitpid(orphan->pid, NULL, WNOHANG);
+        if (ret == 0) {
+            link = &orphan->next;
+            continue;
+        }
+        *link = orphan->next;
+        reaper->length--;
+        free(orphan);
+    }
+}
+
+unsigned reaper_count(const reaper_t *reaper, pid_t job) {
+    unsigned count = 0;
+    for (const orphan_t *orphan = reaper->head; orphan != NULL; orphan = orphan->next) {
+        if (orphan->job == job) {
+            count++;
+        }
+    }
+    return count;
+}
@@ -0,0 +1,82 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef REAPER_H
+#define REAPER_H
+
+#include <sys/types.h>
+
+#include "job_list.h"
+
+/*
+ * A process the shell adopted as a child subreaper: it was started by a job
+ * (directly or further down the tree), and its parent exited before it did
+ */
+typedef struct orphan {
+    pid_t pid;
+    pid_t pgid;    // Process group when it was adopted
+    pid_t job;     // Process ID of the job it belongs to, or 0 if unknown
+    struct orphan *next;
+} orphan_t;
+
+typedef struct {
+    orphan_t *head;
+    unsigned length;
+    // Children of the shell at the last collection, as an open-addressing
+    // hash set (0 marks a free slot), so only new ones need to be looked at
+    pid_t *seen;
+    unsigned seen_cap;
+} reaper_t;
+
+/*
+ * Make the calling process a child subreaper (PR_SET_CHILD_SUBREAPER), so
+ * orphaned descendants are reparented to it rather than to init
+ * Returns 0 on success or -1 on error
+ */
+int reaper_enable(void);
+
+/*
+ * Record the calling process's group in its environment (as SWISH_JOB), so
+ * that processes it leaves behind can be traced back to their job even after
+ * they move to another process group. Does nothing unless reaper_enable()
+ * was called before this process was forked
+ * Returns 0 on success or -1 on error
+ */
+int reaper_tag_job(void);
+
+/*
+ * Initialize a new, empty set of adopted processes
+ * reaper: Pointer to the set to initialize
+ */
+void reaper_init(reaper_t *reaper);
+
+/*
+ * Forget all adopted processes, without waiting for them
+ * reaper: Pointer to the set to free
+ */
+void reaper_free(reaper_t *reaper);
+
+/*
+ * Pick up newly adopted processes and reap those that have exited
+ * Call this after every SIGCHLD. Any child of the shell that wasn't there at
+ * the last call and is neither a job nor listed in 'known' is a new orphan.
+ * It belongs to the job named by its tag (see reaper_tag_job()) or whose
+ * process group it is in, or else to the job of the adopted process whose
+ * group it is in (a daemon that called setsid() before forking again)
+ * Each call takes time linear in the number of children, jobs and orphans
+ * reaper: The set of adopted processes
+ * jobs: The shell's jobs
+ * known: Other children of the shell (e.g. the foreground command)
+ * num_known: Number of entries in 'known'
+ */
+void reaper_collect(reaper_t *reaper, const job_list_t *jobs, const pid_t *known,
+                    unsigned num_known);
+
+/*
+ * Count the adopted processes of a job that are still running
+ * reaper: The set of adopted processes
+ * job: Process ID of the job
+ * Returns the number of processes
+ */
+unsigned reaper_count(const reaper_t *reaper, pid_t job);
+
+#endif    // REAPER_H
@@ -0,0 +1,274 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "scan.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#define BLOCK 64
+
+/*
+ * Classes of characters in a 64-byte block, one bit per byte
+ */
+typedef struct {
+    uint64_t newline;
+    uint64_t space;
+    uint64_t ops;    // Operator and quoting characters
+    uint64_t pattern;
+} block_masks_t;
+
+typedef struct {
+    uint64_t (*newlines)(const char *block);
+    void (*classify)(const char *block, block_masks_t *masks);
+} scanner_t;
+
+static int is_operator(unsigned char c) {
+    return c == '<' || c == '>' || c == '&' || c == '|' || c == ';' || c == '"' || c == '\'' ||
+           c == '\\';
+}
+
+static int is_pattern(unsigned char c) {
+    return c == '*' || c == '?' || c == '[';
+}
+
+static uint64_t newlines_scalar(const char *block) {
+    uint64_t mask = 0;
+    for (int i = 0; i < BLOCK; i++) {
+        mask |= (uint64_t) (block[i] == '\n') << i;
+    }
+    return mask;
+}
+
+static void classify_scalar(const char *block, block_masks_t *masks) {
+    memset(masks, 0, sizeof(block_masks_t));
+    for (int i = 0; i < BLOCK; i++) {
+        unsigned char c = block[i];
+        masks->newline |= (uint64_t) (c == '\n') << i;
+        masks->space |= (uint64_t) (c == ' ') << i;
+        masks->ops |= (uint64_t) is_operator(c) << i;
+        masks->pattern |= (uint64_t) is_pattern(c) << i;
+    }
+}
+
+static const scanner_t scalar_scanner = {newlines_scalar, classify_scalar};
+
+#ifdef HAVE_X86
+__attribute__((target("sse2"))) static uint64_t newlines_sse2(const char *block) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    uint64_t mask = 0;
+    for (int i = 0; i < BLOCK; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (block + i));
+        mask |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)) << i;
+    }
+    return mask;
+}
+
+__attribute__((target("sse2"))) static void classify_sse2(const char *block,
+                                                          block_masks_t *masks) {
+    memset(masks, 0, sizeof(block_masks_t));
+    for (int i = 0; i < BLOCK; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (block + i));
+        __m128i op = _mm_or_si128(
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('<')),
+                                      _mm_cmpeq_epi8(v, _mm_set1_epi8('>'))),
+                         _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('&')),
+                                      _mm_cmpeq_epi8(v, _mm_set1_epi8('|')))),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(';')),
+                                      _mm_cmpeq_epi8(v, _mm_set1_epi8('"'))),
+                         _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\'')),
+                                      _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')))));
+        __m128i pat = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('*')),
+                                                _mm_cmpeq_epi8(v, _mm_set1_epi8('?'))),
+                                   _mm_cmpeq_epi8(v, _mm_set1_epi8('[')));
+        masks->newline |=
+            (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))) << i;
+        masks->space |=
+            (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(' '))) << i;
+        masks->ops |= (uint64_t) (uint16_t) _mm_movemask_epi8(op) << i;
+        masks->pattern |= (uint64_t) (uint16_t) _mm_movemask_epi8(pat) << i;
+    }
+}
+
+__attribute__((target("avx2"))) static uint64_t newlines_avx2(const char *block) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    __m256i lo = _mm256_loadu_si256((const __m256i *) block);
+    __m256i hi = _mm256_loadu_si256((const __m256i *) (block + 32));
+    return (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, nl)) |
+           (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, nl)) << 32;
+}
+
+__attribute__((target("avx2"))) static void classify_avx2(const char *block,
+                                                          block_masks_t *masks) {
+    memset(masks, 0, sizeof(block_masks_t));
+    for (int i = 0; i < BLOCK; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (block + i));
+        __m256i op = _mm256_or_si256(
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')),
+                                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('>'))),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')),
+                                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('|')))),
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(';')),
+                                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')),
+                                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')))));
+        __m256i pat =
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('*')),
+                                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('?'))),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('[')));
+        masks->newline |= (uint64_t) (uint32_t) _mm256_movemask_epi8(
+                              _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')))
+                          << i;
+        masks->space |= (uint64_t) (uint32_t) _mm256_movemask_epi8(
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')))
+                        << i;
+        masks->ops |= (uint64_t) (uint32_t) _mm256_movemask_epi8(op) << i;
+        masks->pattern |= (uint64_t) (uint32_t) _mm256_movemask_epi8(pat) << i;
+    }
+}
+
+static const scanner_t sse2_scanner = {newlines_sse2, classify_sse2};
+static const scanner_t avx2_scanner = {newlines_avx2, classify_avx2};
+#endif
+
+static scan_impl_t impl;
+static const scanner_t *scanner = NULL;
+
+/*
+ * Pick the scanner on first use: the one named by SWISH_SCAN if the CPU
+ * supports it, otherwise the fastest one available
+ */
+static const scanner_t *get_scanner(void) {
+    if (scanner != NULL) {
+        return scanner;
+    }
+    impl = SCAN_SCALAR;
+    scanner = &scalar_scanner;
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    int has_sse2 = __builtin_cpu_supports("sse2");
+    int has_avx2 = __builtin_cpu_supports("avx2");
+    const char *requested = getenv("SWISH_SCAN");
+    if (requested != NULL && strcmp(requested, "scalar") == 0) {
+        has_sse2 = 0;
+        has_avx2 = 0;
+    } else if (requested != NULL && strcmp(requested, "sse2") == 0) {
+        has_avx2 = 0;
+    }
+    if (has_avx2) {
+        impl = SCAN_AVX2;
+        scanner = &avx2_scanner;
+    } else if (has_sse2) {
+        impl = SCAN_SSE2;
+        scanner = &sse2_scanner;
+    }
+#endif
+    return scanner;
+}
+
+scan_impl_t scan_impl(void) {
+    get_scanner();
+    return impl;
+}
+
+size_t scan_line_end(const char *s, size_t len) {
+    const scanner_t *sc = get_scanner();
+    size_t pos = 0;
+    for (; pos + BLOCK <= len; pos += BLOCK) {
+        uint64_t mask = sc->newlines(s + pos);
+        if (mask != 0) {
+            return pos + __builtin_ctzll(mask);
+        }
+    }
+    // A partial block at the end is copied so the scanner never reads past the buffer
+    if (pos < len) {
+        char block[BLOCK] = {0};
+        memcpy(block, s + pos, len - pos);
+        uint64_t mask = sc->newlines(block);
+        if (mask != 0) {
+            return pos + __builtin_ctzll(mask);
+        }
+    }
+    return len;
+}
+
+/*
+ * Bits from..to-1 of a block mask
+ */
+static uint64_t bit_range(unsigned from, unsigned to) {
+    uint64_t below_to = to >= BLOCK ? ~0ULL : (1ULL << to) - 1;
+    return below_to & ~((1ULL << from) - 1);
+}
+
+unsigned scan_tokens(const char *s, size_t len, scan_token_t *tokens, unsigned max_tokens) {
+    const scanner_t *sc = get_scanner();
+    unsigned num_tokens = 0;
+    int in_token = 0;
+    size_t start = 0;
+    unsigned flags = 0;
+
+    for (size_t base = 0; base < len; base += BLOCK) {
+        block_masks_t masks;
+        size_t block_len = len - base < BLOCK ? len - base : BLOCK;
+        if (block_len == BLOCK) {
+            sc->classify(s + base, &masks);
+        } else {
+            char block[BLOCK] = {0};
+            memcpy(block, s + base, block_len);
+            sc->classify(block, &masks);
+            // Past the end of the line counts as a separator
+            masks.space |= ~bit_range(0, block_len);
+        }
+
+        unsigned pos = 0;
+        while (pos < BLOCK) {
+            if (!in_token) {
+                uint64_t rest = ~masks.space >> pos;
+                if (rest == 0) {
+                    break;
+                }
+                pos += __builtin_ctzll(rest);
+                in_token = 1;
+                start = base + pos;
+                flags = 0;
+            }
+
+            uint64_t rest = masks.space >> pos;
+            unsigned end = rest == 0 ? BLOCK : pos + __builtin_ctzll(rest);
+            uint64_t range = bit_range(pos, end);
+            if (masks.ops & range) {
+                flags |= SCAN_OPERATOR;
+            }
+            if (masks.pattern & range) {
+                flags |= SCAN_PATTERN;
+            }
+            if (end == BLOCK) {
+                // The token continues into the next block
+                break;
+            }
+            if (num_tokens < max_tokens) {
+                tokens[num_tokens].start = start;
+                tokens[num_tokens].len = base + end - start;
+                tokens[num_tokens].flags = flags;
+            }
+            num_tokens++;
+            in_token = 0;
+            pos = end;
+        }
+    }
+
+    if (in_token) {
+        if (num_tokens < max_tokens) {
+            tokens[num_tokens].start = start;
+            tokens[num_tokens].len = len - start;
+            tokens[num_tokens].flags = flags;
+        }
+        num_tokens++;
+    }
+    return num_tokens;
+}
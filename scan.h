@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+// Token contains an operator or quoting character: < > & | ; " ' or backslash
+#define SCAN_OPERATOR 0x1
+// Token contains a pathname pattern character: * ? or [
+#define SCAN_PATTERN 0x2
+
+/*
+ * Position of one token (a run of characters other than ' ') in a line
+ */
+typedef struct {
+    unsigned start;
+    unsigned len;
+    unsigned flags;
+} scan_token_t;
+
+/*
+ * Scanners for 64-byte blocks. The fastest one the CPU supports is used,
+ * unless the SWISH_SCAN environment variable asks for a specific one
+ * ("scalar", "sse2" or "avx2"). All of them give identical results
+ */
+typedef enum {
+    SCAN_SCALAR,
+    SCAN_SSE2,
+    SCAN_AVX2,
+} scan_impl_t;
+
+/*
+ * Get the scanner in use, choosing it on the first call
+ * Returns the scanner
+ */
+scan_impl_t scan_impl(void);
+
+/*
+ * Find the end of the first line in a buffer
+ * s: The buffer to search
+ * len: Number of bytes in the buffer
+ * Returns the offset of the first '\n', or len if there is none
+ */
+size_t scan_line_end(const char *s, size_t len);
+
+/*
+ * Split a line into tokens separated by one or more spaces, exactly as
+ * strtok(s, " ") would, and classify the characters in each token
+ * s: The line to split
+ * len: Length of the line
+ * tokens: Where to store the tokens found
+ * max_tokens: Number of entries available in 'tokens'
+ * Returns the number of tokens in the line. If this is more than max_tokens,
+ * only the first max_tokens were stored
+ */
+unsigned scan_tokens(const char *s, size_t len, scan_token_t *tokens, unsigned max_tokens);
+
+#endif    // SCAN_H
@@ -0,0 +1,528 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+
+#include "script_cache.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "scan.h"
+#include "swish_funcs.h"
+
+#define CACHE_SUFFIX ".swc"
+#define CACHE_MAGIC "SWISHSC"
+#define CACHE_VERSION 1
+#define LINE_LEN 512
+#define INITIAL_CAPACITY 64
+#define NO_STRING UINT32_MAX
+
+/*
+ * Layout of the start of a cache file, followed directly by the tables
+ * Every table's position follows from the counts, so no offsets are stored
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_cmds;
+    uint64_t source_hash;
+    uint64_t source_len;
+    uint32_t num_tokens;
+    uint32_t num_strings;
+    uint32_t strings_len;
+    uint32_t reserved;
+} cache_header_t;
+
+/*
+ * Tables built up while compiling a script
+ */
+typedef struct {
+    script_cmd_t *cmds;
+    unsigned num_cmds;
+    unsigned cmds_cap;
+    uint32_t *token_ids;
+    unsigned num_tokens;
+    unsigned tokens_cap;
+    uint32_t *string_offsets;
+    unsigned num_strings;
+    unsigned strings_cap;
+    char *strings;
+    size_t strings_len;
+    size_t strings_size;
+    // Open addressing table of string ids, for interning
+    uint32_t *slots;
+    unsigned num_slots;
+    // Word boundaries of the line being compiled
+    scan_token_t *spans;
+    unsigned spans_cap;
+} compiler_t;
+
+/*
+ * Remaining (not yet compiled) part of a script's text
+ */
+typedef struct {
+    const char *pos;
+    const char *end;
+} script_text_t;
+
+static int grow(void **array, unsigned *capacity, unsigned needed, size_t elem_size) {
+    if (needed <= *capacity) {
+        return 0;
+    }
+    unsigned new_capacity = *capacity == 0 ? INITIAL_CAPACITY : *capacity;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    void *new_array = realloc(*array, new_capacity * elem_size);
+    if (new_array == NULL) {
+        return -1;
+    }
+    *array = new_array;
+    *capacity = new_capacity;
+    return 0;
+}
+
+/*
+ * Rebuild the interning table with twice as many slots
+ * Returns 0 on success or -1 on error
+ */
+static int rehash(compiler_t *c) {
+    unsigned num_slots = c->num_slots == 0 ? INITIAL_CAPACITY : 2 * c->num_slots;
+    uint32_t *slots = malloc(num_slots * sizeof(uint32_t));
+    if (slots == NULL) {
+        return -1;
+    }
+    memset(slots, 0xff, num_slots * sizeof(uint32_t));
+    for (unsigned id = 0; id < c->num_strings; id++) {
+        const char *s = c->strings + c->string_offsets[id];
+        unsigned slot = fnv1a(s, strlen(s)) & (num_slots - 1);
+        while (slots[slot] != NO_STRING) {
+            slot = (slot + 1) & (num_slots - 1);
+        }
+        slots[slot] = id;
+    }
+    free(c->slots);
+    c->slots = slots;
+    c->num_slots = num_slots;
+    return 0;
+}
+
+/*
+ * Find the id of a string, adding it to the string table if it is new
+ * Returns the id or NO_STRING on error
+ */
+static uint32_t intern(compiler_t *c, const char *s) {
+    if (2 * (c->num_strings + 1) > c->num_slots && rehash(c) == -1) {
+        return NO_STRING;
+    }
+    size_t len = strlen(s);
+    unsigned slot = fnv1a(s, len) & (c->num_slots - 1);
+    while (c->slots[slot] != NO_STRING) {
+        uint32_t id = c->slots[slot];
+        if (strcmp(c->strings + c->string_offsets[id], s) == 0) {
+            return id;
+        }
+        slot = (slot + 1) & (c->num_slots - 1);
+    }
+
+    if (c->strings_len + len + 1 > UINT32_MAX ||
+        grow((void **) &c->string_offsets, &c->strings_cap, c->num_strings + 1,
+             sizeof(uint32_t)) == -1) {
+        return NO_STRING;
+    }
+    if (c->strings_len + len + 1 > c->strings_size) {
+        size_t new_size = c->strings_size == 0 ? LINE_LEN : c->strings_size;
+        while (c->strings_len + len + 1 > new_size) {
+            new_size *= 2;
+        }
+        char *new_strings = realloc(c->strings, new_size);
+        if (new_strings == NULL) {
+            return NO_STRING;
+        }
+        c->strings = new_strings;
+        c->strings_size = new_size;
+    }
+    memcpy(c->strings + c->strings_len, s, len + 1);
+    c->string_offsets[c->num_strings] = c->strings_len;
+    c->strings_len += len + 1;
+    c->slots[slot] = c->num_strings;
+    return c->num_strings++;
+}
+
+static void compiler_free(compiler_t *c) {
+    free(c->cmds);
+    free(c->token_ids);
+    free(c->string_offsets);
+    free(c->strings);
+    free(c->slots);
+    free(c->spans);
+}
+
+/*
+ * Line source over the script's text, for here-document bodies
+ * Lines too long for the buffer are split, as fgets() would
+ */
+static int next_script_line(void *source, char *line, size_t size) {
+    script_text_t *text = source;
+    if (text->pos >= text->end) {
+        return -1;
+    }
+    size_t avail = text->end - text->pos;
+    size_t len = scan_line_end(text->pos, avail);
+    int has_newline = len < avail;
+    if (len > size - 1) {
+        len = size - 1;
+        has_newline = 0;
+    }
+    memcpy(line, text->pos, len);
+    line[len] = '\0';
+    text->pos += len + has_newline;
+    return 1;
+}
+
+/*
+ * Split one command line into words, read any here-document bodies that follow
+ * it and add the command to the tables
+ * Returns 0 on success or -1 on error
+ */
+static int compile_line(compiler_t *c, char *line, size_t len, script_text_t *text) {
+    strvec_t words;
+    if (strvec_init(&words) == -1) {
+        return -1;
+    }
+    unsigned num_spans = scan_tokens(line, len, c->spans, c->spans_cap);
+    if (num_spans > c->spans_cap) {
+        if (grow((void **) &c->spans, &c->spans_cap, num_spans, sizeof(scan_token_t)) == -1) {
+            strvec_clear(&words);
+            return -1;
+        }
+        scan_tokens(line, len, c->spans, c->spans_cap);
+    }
+    unsigned line_flags = 0;
+    for (unsigned i = 0; i < num_spans; i++) {
+        char *word = line + c->spans[i].start;
+        word[c->spans[i].len] = '\0';
+        line_flags |= c->spans[i].flags;
+        if (strvec_add(&words, word) == -1) {
+            strvec_clear(&words);
+            return -1;
+        }
+    }
+    if (words.length == 0) {
+        strvec_clear(&words);
+        return 0;
+    }
+    if (read_heredocs(&words, next_script_line, text) == -1) {
+        strvec_clear(&words);
+        return -1;
+    }
+
+    script_cmd_t cmd = {.first_token = c->num_tokens, .num_tokens = words.length, .flags = 0};
+    // Patterns are only expanded in the words written on the line itself
+    if (line_flags & SCAN_PATTERN) {
+        cmd.flags |= SCRIPT_PATTERNS;
+    }
+    if (strcmp(strvec_get(&words, words.length - 1), "&") == 0) {
+        cmd.flags |= SCRIPT_BACKGROUND;
+        cmd.num_tokens--;
+    }
+    if (words.length > UINT16_MAX ||
+        grow((void **) &c->token_ids, &c->tokens_cap, c->num_tokens + cmd.num_tokens,
+             sizeof(uint32_t)) == -1 ||
+        grow((void **) &c->cmds, &c->cmds_cap, c->num_cmds + 1, sizeof(script_cmd_t)) == -1) {
+        strvec_clear(&words);
+        return -1;
+    }
+    for (unsigned i = 0; i < cmd.num_tokens; i++) {
+        const char *word = strvec_get(&words, i);
+        uint32_t id = intern(c, word);
+        if (id == NO_STRING) {
+            strvec_clear(&words);
+            return -1;
+        }
+        c->token_ids[c->num_tokens++] = id;
+    }
+    strvec_clear(&words);
+    if (cmd.num_tokens > 0) {
+        c->cmds[c->num_cmds++] = cmd;
+    }
+    return 0;
+}
+
+/*
+ * Compile a script's text into a single image (see script_t)
+ * Returns the image, which the caller must free, or NULL on error
+ */
+static void *compile_script(const char *src, size_t src_len, uint64_t hash, size_t *image_len) {
+    compiler_t c;
+    memset(&c, 0, sizeof(c));
+    script_text_t text = {.pos = src, .end = src + src_len};
+    char *line = NULL;
+    size_t line_size = 0;
+
+    // An interpreter line ("#!/path/to/swish") isn't a command
+    if (src_len >= 2 && src[0] == '#' && src[1] == '!') {
+        size_t len = scan_line_end(src, src_len);
+        text.pos = len == src_len ? text.end : src + len + 1;
+    }
+    while (text.pos < text.end) {
+        size_t avail = text.end - text.pos;
+        size_t len = scan_line_end(text.pos, avail);
+        if (len + 1 > line_size) {
+            char *new_line = realloc(line, len + 1);
+            if (new_line == NULL) {
+                goto fail;
+            }
+            line = new_line;
+            line_size = len + 1;
+        }
+        memcpy(line, text.pos, len);
+        line[len] = '\0';
+        text.pos += len + (len < avail);
+        if (compile_line(&c, line, len, &text) == -1) {
+            fprintf(stderr, "Failed to compile script line: %s\n", line);
+            goto fail;
+        }
+    }
+
+    size_t len = sizeof(cache_header_t) + c.num_cmds * sizeof(script_cmd_t) +
+                 (c.num_tokens + c.num_strings) * sizeof(uint32_t) + c.strings_len;
+    char *image = malloc(len);
+    if (image == NULL) {
+        goto fail;
+    }
+    cache_header_t header = {
+        .magic = CACHE_MAGIC,
+        .version = CACHE_VERSION,
+        .num_cmds = c.num_cmds,
+        .source_hash = hash,
+        .source_len = src_len,
+        .num_tokens = c.num_tokens,
+        .num_strings = c.num_strings,
+        .strings_len = c.strings_len,
+        .reserved = 0,
+    };
+    char *pos = image;
+    memcpy(pos, &header, sizeof(header));
+    pos += sizeof(header);
+    memcpy(pos, c.cmds, c.num_cmds * sizeof(script_cmd_t));
+    pos += c.num_cmds * sizeof(script_cmd_t);
+    memcpy(pos, c.token_ids, c.num_tokens * sizeof(uint32_t));
+    pos += c.num_tokens * sizeof(uint32_t);
+    memcpy(pos, c.string_offsets, c.num_strings * sizeof(uint32_t));
+    pos += c.num_strings * sizeof(uint32_t);
+    memcpy(pos, c.strings, c.strings_len);
+
+    free(line);
+    compiler_free(&c);
+    *image_len = len;
+    return image;
+
+fail:
+    free(line);
+    compiler_free(&c);
+    return NULL;
+}
+
+/*
+ * Check that an image was compiled from the given script contents and that
+ * every index in it is in bounds, then set up the script's table pointers
+ * Returns 0 if the image can be used or -1 otherwise
+ */
+static int decode_image(script_t *script, uint64_t hash, size_t src_len) {
+    const cache_header_t *header = script->image;
+    if (script->image_len < sizeof(cache_header_t) ||
+        memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != CACHE_VERSION || header->source_hash != hash ||
+        header->source_len != src_len) {
+        return -1;
+    }
+    uint64_t expected_len = sizeof(cache_header_t) +
+                            (uint64_t) header->num_cmds * sizeof(script_cmd_t) +
+                            ((uint64_t) header->num_tokens + header->num_strings) * sizeof(uint32_t) +
+                            header->strings_len;
+    if (expected_len != script->image_len) {
+        return -1;
+    }
+
+    const char *pos = (const char *) (header + 1);
+    script->num_cmds = header->num_cmds;
+    script->cmds = (const script_cmd_t *) pos;
+    pos += header->num_cmds * sizeof(script_cmd_t);
+    script->token_ids = (const uint32_t *) pos;
+    pos += header->num_tokens * sizeof(uint32_t);
+    script->num_strings = header->num_strings;
+    script->string_offsets = (const uint32_t *) pos;
+    pos += header->num_strings * sizeof(uint32_t);
+    script->strings = pos;
+
+    for (unsigned i = 0; i < script->num_cmds; i++) {
+        if ((uint64_t) script->cmds[i].first_token + script->cmds[i].num_tokens >
+            header->num_tokens) {
+            return -1;
+        }
+    }
+    for (unsigned i = 0; i < header->num_tokens; i++) {
+        if (script->token_ids[i] >= script->num_strings) {
+            return -1;
+        }
+    }
+    for (unsigned i = 0; i < script->num_strings; i++) {
+        if (script->string_offsets[i] >= header->strings_len) {
+            return -1;
+        }
+    }
+    if (header->strings_len > 0 && script->strings[header->strings_len - 1] != '\0') {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Map an existing cache file, if there is one
+ * Returns 0 if the cache was mapped and matches the script or -1 otherwise
+ */
+static int map_cache(const char *cache_path, script_t *script, uint64_t hash, size_t src_len) {
+    int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(cache_header_t)) {
+        close(fd);
+        return -1;
+    }
+    void *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        return -1;
+    }
+    script->image = image;
+    script->image_len = st.st_size;
+    script->is_mapped = 1;
+    if (decode_image(script, hash, src_len) == -1) {
+        munmap(image, st.st_size);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Write a freshly compiled image next to the script
+ * A temporary file is renamed into place, so other shells never map a
+ * partially written cache
+ */
+static void write_cache(const char *cache_path, const void *image, size_t len) {
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", cache_path, getpid()) >=
+        (int) sizeof(tmp_path)) {
+        return;
+    }
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return;
+    }
+    const char *pos = image;
+    while (len > 0) {
+        ssize_t n = write(fd, pos, len);
+        if (n == -1) {
+            break;
+        }
+        pos += n;
+        len -= n;
+    }
+    if (close(fd) == -1 || len > 0 || rename(tmp_path, cache_path) == -1) {
+        unlink(tmp_path);
+    }
+}
+
+int script_load(const char *path, script_t *script) {
+    memset(script, 0, sizeof(script_t));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        close(fd);
+        return -1;
+    }
+    size_t src_len = st.st_size;
+    const char *src = "";
+    if (src_len > 0) {
+        src = mmap(NULL, src_len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (src == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    uint64_t hash = fnv1a(src, src_len);
+
+    char cache_path[PATH_MAX];
+    int have_cache_path = snprintf(cache_path, sizeof(cache_path), "%s" CACHE_SUFFIX, path) <
+                          (int) sizeof(cache_path);
+    int ret = 0;
+    if (!have_cache_path || map_cache(cache_path, script, hash, src_len) == -1) {
+        script->image = compile_script(src, src_len, hash, &script->image_len);
+        script->is_mapped = 0;
+        if (script->image == NULL || decode_image(script, hash, src_len) == -1) {
+            free(script->image);
+            script->image = NULL;
+            ret = -1;
+        } else if (have_cache_path) {
+            write_cache(cache_path, script->image, script->image_len);
+        }
+    }
+    if (src_len > 0) {
+        munmap((void *) src, src_len);
+    }
+    return ret;
+}
+
+int script_command(const script_t *script, unsigned index, strvec_t *tokens, int *flags) {
+    const script_cmd_t *cmd = &script->cmds[index];
+    const uint32_t *ids = script->token_ids + cmd->first_token;
+    *flags = cmd->flags;
+
+    if (!(cmd->flags & SCRIPT_PATTERNS)) {
+        for (unsigned i = 0; i < cmd->num_tokens; i++) {
+            if (strvec_add(tokens, script->strings + script->string_offsets[ids[i]]) == -1) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    const char **words = malloc(cmd->num_tokens * sizeof(char *));
+    if (words == NULL) {
+        return -1;
+    }
+    for (unsigned i = 0; i < cmd->num_tokens; i++) {
+        words[i] = script->strings + script->string_offsets[ids[i]];
+    }
+    int ret = expand_words(words, cmd->num_tokens, tokens);
+    free(words);
+    return ret;
+}
+
+void script_free(script_t *script) {
+    if (script->image == NULL) {
+        return;
+    }
+    if (script->is_mapped) {
+        munmap(script->image, script->image_len);
+    } else {
+        free(script->image);
+    }
+    script->image = NULL;
+}
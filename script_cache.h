@@ -0,0 +1,72 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SCRIPT_CACHE_H
+#define SCRIPT_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "string_vector.h"
+
+// Command ended with "&"
+#define SCRIPT_BACKGROUND 0x1
+// Command has words that may need pathname expansion when it runs
+#define SCRIPT_PATTERNS 0x2
+
+/*
+ * One command of a compiled script: a run of entries in the token table
+ */
+typedef struct {
+    uint32_t first_token;
+    uint16_t num_tokens;
+    uint16_t flags;
+} script_cmd_t;
+
+/*
+ * A compiled script
+ * The image holds a header, the command table, the token table (indices of
+ * interned strings), the string offset table and finally the strings
+ * themselves. It contains no pointers, so the cache file can be mapped
+ * anywhere and used as is
+ */
+typedef struct {
+    void *image;
+    size_t image_len;
+    int is_mapped;
+    unsigned num_cmds;
+    const script_cmd_t *cmds;
+    const uint32_t *token_ids;
+    unsigned num_strings;
+    const uint32_t *string_offsets;
+    const char *strings;
+} script_t;
+
+/*
+ * Load a script, using its cache file ("<path>.swc") if it matches the
+ * script's current contents, or compiling the script and (re)writing the
+ * cache otherwise. Failing to write the cache is not an error
+ * path: Path of the script
+ * script: Where to store the loaded script
+ * Returns 0 on success or -1 on error
+ */
+int script_load(const char *path, script_t *script);
+
+/*
+ * Get the tokens of one command of a loaded script
+ * Patterns are expanded here, since their matches depend on the directory
+ * contents when the command runs
+ * script: The loaded script
+ * index: Index of the command, less than script->num_cmds
+ * tokens: Vector to add the command's tokens to
+ * flags: Where to store the command's SCRIPT_* flags
+ * Returns 0 on success or -1 on error
+ */
+int script_command(const script_t *script, unsigned index, strvec_t *tokens, int *flags);
+
+/*
+ * Release a loaded script
+ * script: The script to free
+ */
+void script_free(script_t *script);
+
+#endif    // SCRIPT_CACHE_H
@@ -0,0 +1,643 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+
+#include "server.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "deadline.h"
+#include "metrics.h"
+#include "share.h"
+#include "swish_funcs.h"
+
+// Longest single-line reply (everything but the jobs listing)
+#define REPLY_LEN 128
+
+static int grow(char **buf, size_t *cap, size_t needed) {
+    if (needed <= *cap) {
+        return 0;
+    }
+    size_t new_cap = *cap > 0 ? *cap : 4096;
+    while (new_cap < needed) {
+        new_cap *= 2;
+    }
+    char *new_buf = realloc(*buf, new_cap);
+    if (new_buf == NULL) {
+        perror("realloc");
+        return -1;
+    }
+    *buf = new_buf;
+    *cap = new_cap;
+    return 0;
+}
+
+/*
+ * Queue a reply frame for a client
+ * Returns 0 on success or -1 on error
+ */
+static int add_reply(server_client_t *c, const char *text, size_t len) {
+    if (grow(&c->out, &c->out_cap, c->out_len + 4 + len) == -1) {
+        return -1;
+    }
+    unsigned char *header = (unsigned char *) c->out + c->out_len;
+    header[0] = len >> 24;
+    header[1] = len >> 16;
+    header[2] = len >> 8;
+    header[3] = len;
+    memcpy(c->out + c->out_len + 4, text, len);
+    c->out_len += 4 + len;
+    return 0;
+}
+
+static void reply(server_client_t *c, const char *text) {
+    if (add_reply(c, text, strlen(text)) == -1) {
+        c->is_closing = 1;
+    }
+}
+
+static void close_client(server_t *srv, server_client_t *c) {
+    event_loop_remove(srv->loop, c->fd);
+    close(c->fd);
+    server_client_t **link = &srv->clients;
+    while (*link != c) {
+        link = &(*link)->next;
+    }
+    *link = c->next;
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+static void on_client_writable(int fd, void *arg);
+
+/*
+ * Send as much of a client's queued replies as its socket takes, watching for
+ * writability if some are left over
+ * Returns 0 on success or -1 if the client was closed
+ */
+static int flush_client(server_t *srv, server_client_t *c) {
+    size_t sent = 0;
+    while (sent < c->out_len) {
+        ssize_t n = send(c->fd, c->out + sent, c->out_len - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            // the client went away, its replies have nowhere to go
+            close_client(srv, c);
+            return -1;
+        }
+        sent += n;
+    }
+    memmove(c->out, c->out + sent, c->out_len - sent);
+    c->out_len -= sent;
+
+    if (c->out_len > 0) {
+        event_loop_on_writable(srv->loop, c->fd, on_client_writable);
+        return 0;
+    }
+    event_loop_on_writable(srv->loop, c->fd, NULL);
+    if (c->is_closing) {
+        close_client(srv, c);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Find a submitted job by its ID (the array is sorted by ID)
+ * Returns the job or NULL if it is unknown or long finished
+ */
+static server_job_t *find_job(server_t *srv, unsigned long id) {
+    unsigned low = 0;
+    unsigned high = srv->num_submitted;
+    while (low < high) {
+        unsigned mid = low + (high - low) / 2;
+        if (srv->submitted[mid].id < id) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low < srv->num_submitted && srv->submitted[low].id == id ? &srv->submitted[low] : NULL;
+}
+
+/*
+ * Describe the state of a submitted job, e.g. "running" or "exited 0"
+ * job: The job's entry in the job list, NULL once it has finished
+ */
+static void describe_job(const server_job_t *sj, const job_t *job, char *buf, size_t size) {
+    if (sj->is_finished) {
+        if (WIFEXITED(sj->status)) {
+            snprintf(buf, size, "exited %d", WEXITSTATUS(sj->status));
+        } else if (WIFSIGNALED(sj->status)) {
+            snprintf(buf, size, "killed %d", WTERMSIG(sj->status));
+        } else {
+            snprintf(buf, size, "lost");
+        }
+        return;
+    }
+    if (job != NULL && job->deadline != NULL && job->deadline->timed_out) {
+        snprintf(buf, size, "timed out");
+    } else if (job != NULL && job->status == STOPPED) {
+        snprintf(buf, size, "stopped");
+    } else {
+        snprintf(buf, size, "running");
+    }
+}
+
+static void reply_job(server_t *srv, server_client_t *c, const server_job_t *sj) {
+    char buf[REPLY_LEN] = "ok ";
+    job_t *job = sj->is_finished ? NULL : job_list_find(srv->jobs, sj->pid);
+    describe_job(sj, job, buf + 3, sizeof(buf) - 3);
+    reply(c, buf);
+}
+
+static int serve_client(server_t *srv, server_client_t *c);
+
+/*
+ * Record that a submitted job has ended and answer the clients waiting for it
+ * sj: The job, which must not be finished yet
+ * status: Its wait status, or -1 if it was lost
+ */
+static void finish_job(server_t *srv, server_job_t *sj, int status) {
+    sj->is_finished = 1;
+    sj->status = status;
+    srv->num_finished++;
+    metrics_record_background_exit(status);
+
+    // the clients' later requests may submit more jobs, moving the array
+    server_job_t done = *sj;
+    server_client_t *next;
+    for (server_client_t *c = srv->clients; c != NULL; c = next) {
+        next = c->next;
+        if (c->waiting_id == done.id) {
+            c->waiting_id = 0;
+            reply_job(srv, c, &done);
+            serve_client(srv, c);
+        }
+    }
+
+    // forget the oldest finished jobs, keeping the array sorted by ID
+    unsigned kept = 0;
+    for (unsigned i = 0; i < srv->num_submitted; i++) {
+        if (srv->submitted[i].is_finished && srv->num_finished > SERVER_MAX_FINISHED) {
+            srv->num_finished--;
+        } else {
+            srv->submitted[kept++] = srv->submitted[i];
+        }
+    }
+    srv->num_submitted = kept;
+}
+
+/*
+ * Handle a change of state of a submitted job's process, from the event loop
+ */
+static void on_job_status(pid_t pid, int status, void *arg) {
+    server_watch_t *watch = arg;
+    server_t *srv = watch->srv;
+    job_t *job = job_list_find(srv->jobs, pid);
+    if (status != -1 && !WIFEXITED(status) && !WIFSIGNALED(status)) {
+        if (job == NULL) {
+            return;
+        }
+        if (WIFSTOPPED(status) && !share_take_stop(job->share)) {
+            job->status = STOPPED;
+            share_set_active(job->share, 0);
+        } else if (WIFCONTINUED(status) && job->status == STOPPED) {
+            job->status = BACKGROUND;
+            share_set_active(job->share, 1);
+        }
+        return;
+    }
+
+    // ended, or collected by someone else (then its status is lost). It
+    // leaves the job list before any waiting client's later requests run
+    if (job != NULL) {
+        job_list_remove(srv->jobs, job_list_index(srv->jobs, job));
+    }
+    server_job_t *sj = find_job(srv, watch->id);
+    free(watch);
+    if (sj != NULL) {
+        sj->watch = NULL;
+        finish_job(srv, sj, status);
+    }
+}
+
+static void submit_job(server_t *srv, server_client_t *c, char *cmd) {
+    strvec_t tokens;
+    strvec_init(&tokens);
+    if (tokenize(cmd, &tokens) == -1) {
+        reply(c, "error failed to parse command");
+        strvec_clear(&tokens);
+        return;
+    }
+    // everything submitted runs in the background anyway
+    if (tokens.length > 0 && strcmp(strvec_get(&tokens, tokens.length - 1), "&") == 0) {
+        strvec_take(&tokens, tokens.length - 1);
+    }
+    if (tokens.length == 0) {
+        reply(c, "error missing command");
+        strvec_clear(&tokens);
+        return;
+    }
+
+    // make room first, so a started job is never left untracked
+    server_watch_t *watch = malloc(sizeof(server_watch_t));
+    if (watch == NULL) {
+        perror("malloc");
+        reply(c, "error failed to start job");
+        strvec_clear(&tokens);
+        return;
+    }
+    if (srv->num_submitted == srv->cap_submitted) {
+        unsigned new_cap = srv->cap_submitted > 0 ? srv->cap_submitted * 2 : 64;
+        server_job_t *new_submitted = realloc(srv->submitted, new_cap * sizeof(server_job_t));
+        if (new_submitted == NULL) {
+            perror("realloc");
+            reply(c, "error failed to start job");
+            free(watch);
+            strvec_clear(&tokens);
+            return;
+        }
+        srv->submitted = new_submitted;
+        srv->cap_submitted = new_cap;
+    }
+    pid_t pid = srv->submit(&tokens, srv->submit_arg);
+    strvec_clear(&tokens);
+    if (pid == -1) {
+        reply(c, "error failed to start job");
+        free(watch);
+        return;
+    }
+    server_job_t *sj = &srv->submitted[srv->num_submitted++];
+    sj->id = srv->next_id++;
+    sj->pid = pid;
+    sj->is_finished = 0;
+    sj->status = 0;
+    sj->watch = watch;
+    watch->srv = srv;
+    watch->id = sj->id;
+
+    char buf[REPLY_LEN];
+    snprintf(buf, sizeof(buf), "ok %lu", sj->id);
+    reply(c, buf);
+    // the job's stops and exit come straight from the event loop, so nothing
+    // is polled per job. A job that can't be watched is never heard from again
+    if (event_loop_watch_child(srv->loop, pid, on_job_status, watch) == -1) {
+        job_t *job = job_list_find(srv->jobs, pid);
+        if (job != NULL) {
+            job_list_remove(srv->jobs, job_list_index(srv->jobs, job));
+        }
+        sj->watch = NULL;
+        free(watch);
+        finish_job(srv, sj, -1);
+    }
+}
+
+/*
+ * Answer the wait-for requests still pending once the server shuts down, from
+ * the event loop (so no other client is being served meanwhile)
+ */
+static void on_shutdown(int timer, void *arg) {
+    server_t *srv = arg;
+    event_loop_remove_timer(srv->loop, timer);
+    server_client_t *next;
+    for (server_client_t *c = srv->clients; c != NULL; c = next) {
+        next = c->next;
+        if (c->waiting_id != 0) {
+            c->waiting_id = 0;
+            reply(c, "error shutting down");
+            serve_client(srv, c);
+        }
+    }
+}
+
+static void list_jobs(server_t *srv, server_client_t *c) {
+    char *text = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    int ok = grow(&text, &cap, 3) == 0;
+    if (ok) {
+        memcpy(text, "ok", 2);
+        len = 2;
+    }
+    // both the job list and the submitted jobs are in the order they started,
+    // so one pass over each matches them up
+    job_t *job = srv->jobs->head;
+    for (unsigned i = 0; ok && i < srv->num_submitted; i++) {
+        server_job_t *sj = &srv->submitted[i];
+        if (sj->is_finished) {
+            continue;
+        }
+        while (job != NULL && job->pid != sj->pid) {
+            job = job->next;
+        }
+        if (job == NULL) {
+            break;
+        }
+        char state[REPLY_LEN];
+        describe_job(sj, job, state, sizeof(state));
+        ok = grow(&text, &cap, len + REPLY_LEN + NAME_LEN) == 0;
+        if (ok) {
+            len += snprintf(text + len, cap - len, "\n%lu %s %s", sj->id, job->name, state);
+        }
+    }
+    if (!ok || add_reply(c, text, len) == -1) {
+        c->is_closing = 1;
+    }
+    free(text);
+}
+
+/*
+ * Handle one request from a client, queueing its reply unless it has to wait
+ */
+static void handle_request(server_t *srv, server_client_t *c, const char *data, size_t len) {
+    char *request = strndup(data, len);
+    if (request == NULL) {
+        perror("strndup");
+        c->is_closing = 1;
+        return;
+    }
+    char *args = request + strcspn(request, " ");
+    if (*args != '\0') {
+        *args++ = '\0';
+    }
+    char *end;
+    unsigned long id = strtoul(args, &end, 10);
+    int has_id = end != args && *end == '\0';
+    server_job_t *sj = has_id ? find_job(srv, id) : NULL;
+
+    char buf[REPLY_LEN];
+    if (srv->is_shutdown) {
+        reply(c, "error shutting down");
+    } else if (strcmp(request, "submit") == 0) {
+        submit_job(srv, c, args);
+    } else if (strcmp(request, "jobs") == 0 && *args == '\0') {
+        list_jobs(srv, c);
+    } else if (strcmp(request, "status") == 0 && *args == '\0') {
+        unsigned num_clients = 0;
+        for (server_client_t *other = srv->clients; other != NULL; other = other->next) {
+            num_clients++;
+        }
+        snprintf(buf, sizeof(buf), "ok jobs %u clients %u submitted %lu", srv->jobs->length,
+                 num_clients, srv->next_id - 1);
+        reply(c, buf);
+    } else if ((strcmp(request, "status") == 0 || strcmp(request, "wait-for") == 0) &&
+               !has_id) {
+        snprintf(buf, sizeof(buf), "error usage: %s ID", request);
+        reply(c, buf);
+    } else if (strcmp(request, "status") == 0 || strcmp(request, "wait-for") == 0) {
+        if (sj == NULL) {
+            snprintf(buf, sizeof(buf), "error unknown job %lu", id);
+            reply(c, buf);
+        } else if (strcmp(request, "wait-for") == 0 && !sj->is_finished) {
+            c->waiting_id = id;
+        } else {
+            reply_job(srv, c, sj);
+        }
+    } else if (strcmp(request, "shutdown") == 0 && *args == '\0') {
+        reply(c, "ok");
+        srv->is_shutdown = 1;
+        event_loop_remove(srv->loop, srv->listen_fd);
+        // answered waits only come through finish_job(), so the rest have to
+        // be released
+        if (event_loop_add_timer(srv->loop, 0, 0, on_shutdown, srv) == -1) {
+            perror("Failed to release waiting clients");
+        }
+    } else {
+        snprintf(buf, sizeof(buf), "error unknown request '%.64s'", request);
+        reply(c, buf);
+    }
+    free(request);
+}
+
+/*
+ * Handle the complete requests a client has sent, in order, up to the first
+ * one that has to wait. Then send the replies
+ * Returns 0 on success or -1 if the client was closed
+ */
+static int serve_client(server_t *srv, server_client_t *c) {
+    size_t pos = 0;
+    while (!c->is_closing && c->waiting_id == 0 && c->in_len - pos >= 4) {
+        const unsigned char *header = (const unsigned char *) c->in + pos;
+        size_t len = (size_t) header[0] << 24 | header[1] << 16 | header[2] << 8 | header[3];
+        if (len > SERVER_MAX_FRAME) {
+            reply(c, "error request too large");
+            c->is_closing = 1;
+            break;
+        }
+        if (c->in_len - pos - 4 < len) {
+            break;
+        }
+        handle_request(srv, c, c->in + pos + 4, len);
+        pos += 4 + len;
+    }
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+
+    // nothing more is coming: once every request read has been answered
+    // (a partial one left over never will be), the client is done
+    if ((c->is_eof || c->is_over_limit) && !c->is_closing && c->waiting_id == 0) {
+        if (c->is_over_limit) {
+            reply(c, "error too many queued requests");
+        }
+        c->is_closing = 1;
+    }
+    return flush_client(srv, c);
+}
+
+static void on_client_writable(int fd, void *arg) {
+    server_client_t *c = arg;
+    flush_client(c->srv, c);
+}
+
+static void on_client_readable(int fd, void *arg) {
+    server_client_t *c = arg;
+    server_t *srv = c->srv;
+    for (;;) {
+        if (c->in_len >= SERVER_MAX_QUEUED) {
+            // the requests already read are still answered, see serve_client()
+            c->is_over_limit = 1;
+            event_loop_on_readable(srv->loop, fd, NULL);
+            break;
+        }
+        if (grow(&c->in, &c->in_cap, c->in_len + 4096) == -1) {
+            close_client(srv, c);
+            return;
+        }
+        ssize_t n = read(fd, c->in + c->in_len, c->in_cap - c->in_len);
+        if (n > 0) {
+            c->in_len += n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n == -1) {
+            // reset by the client: whatever it still had coming is dropped
+            close_client(srv, c);
+            return;
+        }
+        // the client shut down its sending side, but may still be reading
+        // (if it closed the socket entirely, the first reply fails with EPIPE)
+        c->is_eof = 1;
+        event_loop_on_readable(srv->loop, fd, NULL);
+        break;
+    }
+    serve_client(srv, c);
+}
+
+static void on_accept(int fd, void *arg) {
+    server_t *srv = arg;
+    for (;;) {
+        int client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept4");
+            }
+            return;
+        }
+
+        server_client_t *c = calloc(1, sizeof(server_client_t));
+        if (c == NULL) {
+            perror("calloc");
+            close(client_fd);
+            continue;
+        }
+        c->srv = srv;
+        c->fd = client_fd;
+        if (event_loop_add(srv->loop, client_fd, on_client_readable, c) == -1) {
+            close(client_fd);
+            free(c);
+            continue;
+        }
+        c->next = srv->clients;
+        srv->clients = c;
+    }
+}
+
+/*
+ * Bind a listening socket, replacing the socket file of a server that is gone
+ * Returns 0 on success or -1 on error
+ */
+static int bind_socket(int fd, const struct sockaddr_un *addr) {
+    if (bind(fd, (const struct sockaddr *) addr, sizeof(*addr)) == 0) {
+        return 0;
+    }
+    if (errno != EADDRINUSE) {
+        perror("bind");
+        return -1;
+    }
+
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe == -1) {
+        perror("socket");
+        return -1;
+    }
+    int is_stale = connect(probe, (const struct sockaddr *) addr, sizeof(*addr)) == -1 &&
+                   errno == ECONNREFUSED;
+    close(probe);
+    if (!is_stale) {
+        fprintf(stderr, "Socket '%s' is already in use\n", addr->sun_path);
+        return -1;
+    }
+    if (unlink(addr->sun_path) == -1 ||
+        bind(fd, (const struct sockaddr *) addr, sizeof(*addr)) == -1) {
+        perror("bind");
+        return -1;
+    }
+    return 0;
+}
+
+int server_init(server_t *srv, const char *path, event_loop_t *loop, job_list_t *jobs,
+                server_submit_t submit, void *submit_arg) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path '%s' is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    srv->loop = loop;
+    srv->jobs = jobs;
+    srv->submit = submit;
+    srv->submit_arg = submit_arg;
+    srv->clients = NULL;
+    srv->submitted = NULL;
+    srv->num_submitted = 0;
+    srv->cap_submitted = 0;
+    srv->num_finished = 0;
+    srv->next_id = 1;
+    srv->is_shutdown = 0;
+    if ((srv->path = strdup(path)) == NULL) {
+        perror("strdup");
+        return -1;
+    }
+    if ((srv->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+        perror("socket");
+        free(srv->path);
+        return -1;
+    }
+    if (bind_socket(srv->listen_fd, &addr) == -1) {
+        close(srv->listen_fd);
+        free(srv->path);
+        return -1;
+    }
+    if (listen(srv->listen_fd, SOMAXCONN) == -1 ||
+        event_loop_add(loop, srv->listen_fd, on_accept, srv) == -1) {
+        perror("listen");
+        close(srv->listen_fd);
+        unlink(path);
+        free(srv->path);
+        return -1;
+    }
+    return 0;
+}
+
+int server_is_done(const server_t *srv) {
+    if (!srv->is_shutdown) {
+        return 0;
+    }
+    // waits still pending are answered on the next run of the loop
+    for (server_client_t *c = srv->clients; c != NULL; c = c->next) {
+        if (c->out_len > 0 || c->waiting_id != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void server_free(server_t *srv) {
+    // jobs keep running, but nobody is left to hear about them
+    for (unsigned i = 0; i < srv->num_submitted; i++) {
+        if (srv->submitted[i].watch != NULL) {
+            event_loop_unwatch_child(srv->loop, srv->submitted[i].pid);
+            free(srv->submitted[i].watch);
+        }
+    }
+    while (srv->clients != NULL) {
+        close_client(srv, srv->clients);
+    }
+    event_loop_remove(srv->loop, srv->listen_fd);
+    close(srv->listen_fd);
+    unlink(srv->path);
+    free(srv->path);
+    free(srv->submitted);
+}
@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "event_loop.h"
+#include "job_list.h"
+#include "string_vector.h"
+
+// Largest request, not counting its length prefix
+#define SERVER_MAX_FRAME (64 * 1024)
+// Most request bytes a client may have queued up behind a wait-for
+#define SERVER_MAX_QUEUED (1024 * 1024)
+// Finished jobs whose exit status is remembered for status and wait-for
+#define SERVER_MAX_FINISHED 256
+
+/*
+ * Job server, accepting requests from local clients over a Unix domain socket
+ *
+ * Every request and reply is a frame: a 4-byte big-endian length followed by
+ * that many bytes of text. A client may send any number of requests without
+ * waiting, and gets one reply per request, in the same order. Replies start
+ * with "ok" or "error". Requests:
+ *   submit COMMAND...  Start a command line as a background job, replies with
+ *                      its job ID, e.g. "ok 3"
+ *   jobs               List the jobs still running, one "ID NAME STATUS" line
+ *                      each after the first line of the reply
+ *   status [ID]        Report on a job ("ok running", "ok stopped",
+ *                      "ok timed out", "ok exited STATUS", "ok killed SIGNAL"),
+ *                      or without an ID on the server itself
+ *   wait-for ID        Reply like status once the job has ended. Later
+ *                      requests from the same client wait their turn
+ *   shutdown           Stop accepting requests and exit once every reply
+ *                      has been sent (jobs keep running)
+ * Job IDs count up from 1 and are never reused, unlike job list indices and
+ * process IDs. A client that shuts down only its sending side (e.g. after a
+ * batch of requests) still gets a reply to every complete request it sent
+ * before being disconnected. A client that closes its socket entirely drops
+ * any replies it still had coming. A client with SERVER_MAX_QUEUED bytes of
+ * requests waiting isn't read from any more: it gets the replies to those
+ * requests, then an error, and is disconnected
+ *
+ * Everything runs on the shell's event loop with non-blocking sockets: there
+ * is no thread per client. Each job is watched through the loop as well, so
+ * it costs nothing until it stops, continues or ends
+ */
+
+/*
+ * Start a submitted command line as a background job
+ * tokens: Tokens of the command line
+ * arg: The argument given to server_init()
+ * Returns the new job's process ID, or -1 if it couldn't be started
+ */
+typedef pid_t (*server_submit_t)(strvec_t *tokens, void *arg);
+
+struct server;
+
+// What a submitted job's child watch (see event_loop_watch_child()) refers to
+typedef struct server_watch {
+    struct server *srv;
+    unsigned long id;
+} server_watch_t;
+
+typedef struct server_job {
+    unsigned long id;
+    pid_t pid;
+    int is_finished;
+    int status;               // Wait status, once finished
+    server_watch_t *watch;    // NULL once finished
+} server_job_t;
+
+typedef struct server_client {
+    struct server *srv;
+    int fd;
+    char *in;     // Requests received but not handled yet
+    size_t in_len;
+    size_t in_cap;
+    char *out;    // Replies not sent yet
+    size_t out_len;
+    size_t out_cap;
+    unsigned long waiting_id;    // Job whose wait-for is pending, or 0
+    int is_closing;              // Close once the replies are sent
+    int is_eof;                  // The client has sent its last request
+    int is_over_limit;           // Stopped reading at SERVER_MAX_QUEUED bytes
+    struct server_client *next;
+} server_client_t;
+
+typedef struct server {
+    int listen_fd;
+    char *path;
+    event_loop_t *loop;
+    job_list_t *jobs;
+    server_submit_t submit;
+    void *submit_arg;
+    server_client_t *clients;
+    // Submitted jobs, oldest first, including the last few that finished
+    server_job_t *submitted;
+    unsigned num_submitted;
+    unsigned cap_submitted;
+    unsigned num_finished;
+    unsigned long next_id;
+    int is_shutdown;
+} server_t;
+
+/*
+ * Start listening on a Unix domain socket
+ * A stale socket file left behind by a server that is gone is replaced
+ * srv: The server to initialize
+ * path: Path of the socket
+ * loop: The shell's event loop, which must keep running to serve clients
+ * jobs: The shell's job list, which submitted jobs are added to
+ * submit: Function that starts submitted jobs, leaving them for the server
+ *         to watch
+ * submit_arg: Passed through to submit
+ * Returns 0 on success or -1 on error
+ */
+int server_init(server_t *srv, const char *path, event_loop_t *loop, job_list_t *jobs,
+                server_submit_t submit, void *submit_arg);
+
+/*
+ * Check whether a shutdown was requested and every reply has been sent
+ * Call after every run of the event loop
+ * srv: The server
+ * Returns 1 if the server is done or 0 if not
+ */
+int server_is_done(const server_t *srv);
+
+/*
+ * Disconnect every client, remove the socket and free the server's state
+ * srv: The server to free
+ */
+void server_free(server_t *srv);
+
+#endif    // SERVER_H
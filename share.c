@@ -0,0 +1,267 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "share.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Largest share accepted, 64 CPUs' worth
+#define MAX_PERCENT 6400
+// Most periods' worth of unused budget a job can save up, and of overuse it
+// has to pay back, so neither a long idle stretch nor a burst on many CPUs
+// skews the job for long afterwards
+#define MAX_CREDIT_PERIODS 1
+#define MAX_DEBT_PERIODS 20
+
+// Budgets being enforced, all measured by the same scan of /proc each period
+static share_t *active_shares = NULL;
+static int period_timer = -1;
+
+int share_parse(const char *s, unsigned *percent) {
+    char *end;
+    errno = 0;
+    long value = strtol(s, &end, 10);
+    if (end == s || *end != '\0' || errno != 0 || value < 0 || value > MAX_PERCENT) {
+        return -1;
+    }
+    *percent = value;
+    return 0;
+}
+
+/*
+ * Read the state, process group and CPU time (including waited-for children)
+ * of one process from /proc
+ * Returns 0 on success or -1 if the process is gone
+ */
+static int read_process(const char *pid, char *state, pid_t *pgid, unsigned long long *ticks) {
+    char path[64];
+    char buf[512];
+    snprintf(path, sizeof(path), "/proc/%s/stat", pid);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+
+    // The command name may contain anything, so parse from its closing paren
+    char *fields = strrchr(buf, ')');
+    int pgrp;
+    unsigned long utime, stime;
+    long cutime, cstime;
+    if (fields == NULL ||
+        sscanf(fields + 1, " %c %*d %d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %ld %ld", state,
+               &pgrp, &utime, &stime, &cutime, &cstime) != 6) {
+        return -1;
+    }
+    *pgid = pgrp;
+    *ticks = utime + stime + cutime + cstime;
+    return 0;
+}
+
+/*
+ * Add up the CPU time of every active budget's process group, with one pass
+ * over /proc however many jobs have a budget
+ */
+static void scan_groups(void) {
+    for (share_t *s = active_shares; s != NULL; s = s->next) {
+        s->ticks = 0;
+        s->leader_state = '?';
+    }
+    DIR *proc = opendir("/proc");
+    if (proc == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(proc)) != NULL) {
+        char state;
+        pid_t pgid;
+        unsigned long long ticks;
+        if (entry->d_name[0] < '1' || entry->d_name[0] > '9' ||
+            read_process(entry->d_name, &state, &pgid, &ticks) == -1) {
+            continue;
+        }
+        for (share_t *s = active_shares; s != NULL; s = s->next) {
+            if (s->pgid == pgid) {
+                s->ticks += ticks;
+                if (atoi(entry->d_name) == pgid) {
+                    s->leader_state = state;
+                }
+                break;
+            }
+        }
+    }
+    closedir(proc);
+}
+
+/*
+ * Check whether a stop signal is waiting for a job that is already stopped,
+ * i.e. someone else stopped it while the shell had it stopped
+ */
+static int is_stop_pending(pid_t pgid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", pgid);
+    FILE *status = fopen(path, "r");
+    if (status == NULL) {
+        return 0;
+    }
+    unsigned long long stop_mask = 1ULL << (SIGSTOP - 1) | 1ULL << (SIGTSTP - 1) |
+                                   1ULL << (SIGTTIN - 1) | 1ULL << (SIGTTOU - 1);
+    int is_pending = 0;
+    char line[128];
+    unsigned long long pending;
+    while (fgets(line, sizeof(line), status) != NULL) {
+        if ((sscanf(line, "SigPnd: %llx", &pending) == 1 ||
+             sscanf(line, "ShdPnd: %llx", &pending) == 1) &&
+            (pending & stop_mask) != 0) {
+            is_pending = 1;
+        }
+    }
+    fclose(status);
+    return is_pending;
+}
+
+static void signal_group(share_t *s, int sig) {
+    // The job may have exited since the last period
+    if (kill(-s->pgid, sig) == -1 && errno != ESRCH) {
+        perror("kill");
+    }
+}
+
+/*
+ * Continue a job the shell stopped
+ */
+static void release(share_t *s) {
+    s->throttled = 0;
+    // a stop is only reported while the job stays stopped, so one nobody
+    // collected by now never will be
+    s->stop_pending = 0;
+    // SIGCONT discards the stop signals sent while the job was stopped, so
+    // stop it again on behalf of whoever sent them, as a stop of their own
+    int is_stopped_by_other = is_stop_pending(s->pgid);
+    signal_group(s, SIGCONT);
+    if (is_stopped_by_other) {
+        signal_group(s, SIGSTOP);
+    }
+}
+
+static void update_share(share_t *s, long ticks_per_sec) {
+    // Processes leaving the group take their time with them
+    unsigned long long used = s->ticks > s->last_ticks ? s->ticks - s->last_ticks : 0;
+    s->last_ticks = s->ticks;
+    s->credit_ms += (long) SHARE_PERIOD_MS * s->percent / 100 - (long) (used * 1000 / ticks_per_sec);
+    if (s->credit_ms > (long) SHARE_PERIOD_MS * MAX_CREDIT_PERIODS) {
+        s->credit_ms = SHARE_PERIOD_MS * MAX_CREDIT_PERIODS;
+    } else if (s->credit_ms < -(long) SHARE_PERIOD_MS * MAX_DEBT_PERIODS) {
+        s->credit_ms = -(long) SHARE_PERIOD_MS * MAX_DEBT_PERIODS;
+    }
+
+    // a job someone else stopped isn't the shell's to stop, or to continue
+    if (!s->throttled && s->credit_ms < 0 && s->leader_state != 'T') {
+        s->throttled = 1;
+        s->stop_pending = 1;
+        signal_group(s, SIGSTOP);
+    } else if (s->throttled && s->credit_ms >= 0) {
+        release(s);
+    }
+}
+
+static void on_period(int fd, void *arg) {
+    static long ticks_per_sec = 0;
+    if (ticks_per_sec == 0 && (ticks_per_sec = sysconf(_SC_CLK_TCK)) <= 0) {
+        ticks_per_sec = 100;
+    }
+    scan_groups();
+    for (share_t *s = active_shares; s != NULL; s = s->next) {
+        update_share(s, ticks_per_sec);
+    }
+}
+
+share_t *share_new(event_loop_t *loop, pid_t pgid, unsigned percent) {
+    share_t *s = malloc(sizeof(share_t));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->loop = loop;
+    s->pgid = pgid;
+    s->percent = percent;
+    s->is_active = 0;
+    s->ticks = 0;
+    s->last_ticks = 0;
+    s->leader_state = '?';
+    s->credit_ms = 0;
+    s->throttled = 0;
+    s->stop_pending = 0;
+    s->next = NULL;
+    return s;
+}
+
+static void deactivate(share_t *s) {
+    share_t **link = &active_shares;
+    while (*link != s) {
+        link = &(*link)->next;
+    }
+    *link = s->next;
+    s->is_active = 0;
+    if (active_shares == NULL) {
+        event_loop_remove_timer(s->loop, period_timer);
+        period_timer = -1;
+    }
+}
+
+int share_set_active(share_t *s, int active) {
+    if (s == NULL || active == s->is_active) {
+        return 0;
+    }
+    if (!active) {
+        deactivate(s);
+        s->throttled = 0;
+        s->stop_pending = 0;
+        return 0;
+    }
+
+    if (period_timer == -1 &&
+        (period_timer = event_loop_add_timer(s->loop, SHARE_PERIOD_MS, SHARE_PERIOD_MS,
+                                             on_period, NULL)) == -1) {
+        return -1;
+    }
+    s->next = active_shares;
+    active_shares = s;
+    s->is_active = 1;
+    // Time used while the budget was suspended doesn't count against it
+    scan_groups();
+    s->last_ticks = s->ticks;
+    s->credit_ms = 0;
+    return 0;
+}
+
+int share_take_stop(share_t *s) {
+    if (s == NULL || !s->stop_pending) {
+        return 0;
+    }
+    s->stop_pending = 0;
+    return 1;
+}
+
+void share_free(share_t *s) {
+    if (s == NULL) {
+        return;
+    }
+    if (s->throttled) {
+        release(s);
+    }
+    if (s->is_active) {
+        deactivate(s);
+    }
+    free(s);
+}
@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SHARE_H
+#define SHARE_H
+
+#include <sys/types.h>
+
+#include "event_loop.h"
+
+// How often a job's CPU use is measured and its budget topped up
+#define SHARE_PERIOD_MS 100
+
+/*
+ * CPU budget for a background job, enforced without cgroups: every period the
+ * shell reads the CPU time of the job's process group from /proc and adds the
+ * difference between what the job was allowed and what it used to a credit.
+ * Once the credit runs out the group gets SIGSTOP, and it gets SIGCONT again
+ * when enough periods have passed to pay the debt back
+ * Only the shell's own stops are ever undone: a job stopped by the user stays
+ * stopped (even if that happened while the shell had it stopped too), and the
+ * budget is suspended while the job is not in the background
+ * All budgets share one timer and one scan of /proc per period
+ */
+typedef struct share {
+    event_loop_t *loop;
+    pid_t pgid;
+    unsigned percent;            // Of one CPU, may be over 100 for several
+    int is_active;               // 0 while the budget is suspended
+    unsigned long long ticks;    // CPU time of the group in the latest scan
+    unsigned long long last_ticks;
+    char leader_state;           // State of the group leader in the latest scan
+    long credit_ms;
+    int throttled;               // Whether the shell has stopped the job
+    int stop_pending;            // Whether that stop is still to be reported
+    struct share *next;          // Next active budget
+} share_t;
+
+/*
+ * Parse a CPU share, a whole number of percent of one CPU
+ * s: The string to parse
+ * percent: Where to store the share, 0 meaning no limit
+ * Returns 0 on success or -1 if the value is invalid
+ */
+int share_parse(const char *s, unsigned *percent);
+
+/*
+ * Create a budget for a job, suspended until share_set_active() is called
+ * loop: The shell's event loop, which must keep running for the budget to apply
+ * pgid: The job's process group
+ * percent: The job's share of one CPU, must not be 0
+ * Returns the new budget or NULL on error
+ */
+share_t *share_new(event_loop_t *loop, pid_t pgid, unsigned percent);
+
+/*
+ * Start or suspend enforcing a budget, e.g. as its job moves between the
+ * background and the foreground. Suspending forgets any stop the shell made,
+ * so the caller must continue the job itself
+ * s: The budget, may be NULL
+ * active: 1 to enforce the budget or 0 to suspend it
+ * Returns 0 on success or -1 on error
+ */
+int share_set_active(share_t *s, int active);
+
+/*
+ * Check whether a stop reported for a job (by waitpid() with WUNTRACED) is one
+ * the shell made to keep it within its budget, so it is not the user's doing
+ * Each of the shell's stops is reported once, so this consumes it
+ * s: The budget, may be NULL
+ * Returns 1 if it is or 0 if not
+ */
+int share_take_stop(share_t *s);
+
+/*
+ * Remove a budget, continuing its job if the shell had stopped it, and free it
+ * s: The budget to free, may be NULL
+ */
+void share_free(share_t *s);
+
+#endif    // SHARE_H
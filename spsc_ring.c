@@ -0,0 +1,134 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "spsc_ring.h"
+
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static void futex_wait(_Atomic uint32_t *word, uint32_t seen) {
+    syscall(SYS_futex, (uint32_t *) word, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *word) {
+    atomic_fetch_add(word, 1);
+    syscall(SYS_futex, (uint32_t *) word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+int spsc_ring_init(spsc_ring_t *ring, size_t size) {
+    uint32_t capacity = 4096;
+    while (capacity < size && capacity < (1U << 30)) {
+        capacity *= 2;
+    }
+    if ((ring->buf = malloc(capacity)) == NULL) {
+        return -1;
+    }
+    ring->size = capacity;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->write_closed, 0);
+    atomic_init(&ring->read_closed, 0);
+    atomic_init(&ring->reader_waiting, 0);
+    atomic_init(&ring->writer_waiting, 0);
+    atomic_init(&ring->reader_wake, 0);
+    atomic_init(&ring->writer_wake, 0);
+    return 0;
+}
+
+void spsc_ring_free(spsc_ring_t *ring) {
+    free(ring->buf);
+    ring->buf = NULL;
+}
+
+/*
+ * Copy between the ring's buffer and a flat one, splitting at the wrap point
+ */
+static void copy_in(spsc_ring_t *ring, uint32_t pos, const char *data, size_t len) {
+    uint32_t offset = pos & (ring->size - 1);
+    size_t first = ring->size - offset < len ? ring->size - offset : len;
+    memcpy(ring->buf + offset, data, first);
+    memcpy(ring->buf, data + first, len - first);
+}
+
+static void copy_out(spsc_ring_t *ring, uint32_t pos, char *data, size_t len) {
+    uint32_t offset = pos & (ring->size - 1);
+    size_t first = ring->size - offset < len ? ring->size - offset : len;
+    memcpy(data, ring->buf + offset, first);
+    memcpy(data + first, ring->buf, len - first);
+}
+
+int spsc_ring_write(spsc_ring_t *ring, const void *data, size_t len) {
+    const char *bytes = data;
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (len > 0) {
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        uint32_t room = ring->size - (head - tail);
+        if (atomic_load(&ring->read_closed)) {
+            return -1;
+        }
+        if (room == 0) {
+            // Announce the wait before checking again, so the consumer either
+            // sees the flag or we see the room it made
+            uint32_t seen = atomic_load(&ring->writer_wake);
+            atomic_store(&ring->writer_waiting, 1);
+            if (atomic_load(&ring->tail) == tail && !atomic_load(&ring->read_closed)) {
+                futex_wait(&ring->writer_wake, seen);
+            }
+            atomic_store(&ring->writer_waiting, 0);
+            continue;
+        }
+
+        size_t n = len < room ? len : room;
+        copy_in(ring, head, bytes, n);
+        head += n;
+        atomic_store_explicit(&ring->head, head, memory_order_seq_cst);
+        if (atomic_load(&ring->reader_waiting)) {
+            futex_wake(&ring->reader_wake);
+        }
+        bytes += n;
+        len -= n;
+    }
+    return 0;
+}
+
+ssize_t spsc_ring_read(spsc_ring_t *ring, void *data, size_t len) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    for (;;) {
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (head != tail) {
+            size_t n = head - tail < len ? head - tail : len;
+            copy_out(ring, tail, data, n);
+            atomic_store_explicit(&ring->tail, tail + n, memory_order_seq_cst);
+            if (atomic_load(&ring->writer_waiting)) {
+                futex_wake(&ring->writer_wake);
+            }
+            return n;
+        }
+        if (atomic_load(&ring->write_closed)) {
+            // Anything written before the close is visible by now
+            if (atomic_load(&ring->head) == tail) {
+                return 0;
+            }
+            continue;
+        }
+
+        uint32_t seen = atomic_load(&ring->reader_wake);
+        atomic_store(&ring->reader_waiting, 1);
+        if (atomic_load(&ring->head) == tail && !atomic_load(&ring->write_closed)) {
+            futex_wait(&ring->reader_wake, seen);
+        }
+        atomic_store(&ring->reader_waiting, 0);
+    }
+}
+
+void spsc_ring_close_write(spsc_ring_t *ring) {
+    atomic_store(&ring->write_closed, 1);
+    futex_wake(&ring->reader_wake);
+}
+
+void spsc_ring_close_read(spsc_ring_t *ring) {
+    atomic_store(&ring->read_closed, 1);
+    futex_wake(&ring->writer_wake);
+}
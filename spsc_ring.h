@@ -0,0 +1,76 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SPSC_RING_DEFAULT_SIZE (64 * 1024)
+
+/*
+ * Byte stream between exactly two threads of one process: a producer that
+ * only writes and a consumer that only reads. Neither side takes a lock. A
+ * side with nothing to do sleeps on a futex until the other wakes it
+ */
+typedef struct {
+    char *buf;
+    uint32_t size;                   // Power of two
+    _Atomic uint32_t head;           // Total bytes written, wrapping
+    _Atomic uint32_t tail;           // Total bytes read, wrapping
+    _Atomic int write_closed;        // Producer is done, set once
+    _Atomic int read_closed;         // Consumer has gone away, set once
+    _Atomic int reader_waiting;
+    _Atomic int writer_waiting;
+    _Atomic uint32_t reader_wake;    // Futex words, bumped to wake each side
+    _Atomic uint32_t writer_wake;
+} spsc_ring_t;
+
+/*
+ * Initialize an empty ring
+ * ring: The ring to initialize
+ * size: Capacity in bytes, rounded up to a power of two
+ * Returns 0 on success or -1 on error
+ */
+int spsc_ring_init(spsc_ring_t *ring, size_t size);
+
+/*
+ * Free a ring's buffer, once both threads are done with it
+ * ring: The ring to free
+ */
+void spsc_ring_free(spsc_ring_t *ring);
+
+/*
+ * Write bytes to the ring, waiting for room as needed (producer only)
+ * ring: The ring to write to
+ * data: The bytes to write
+ * len: Number of bytes to write
+ * Returns 0 once everything is written, or -1 if the consumer closed its end
+ */
+int spsc_ring_write(spsc_ring_t *ring, const void *data, size_t len);
+
+/*
+ * Read available bytes from the ring, waiting if there are none (consumer only)
+ * ring: The ring to read from
+ * data: Where to store the bytes
+ * len: Most bytes to read
+ * Returns the number of bytes read, or 0 once the producer has closed its end
+ * and everything has been read
+ */
+ssize_t spsc_ring_read(spsc_ring_t *ring, void *data, size_t len);
+
+/*
+ * Signal end of stream to the consumer (producer only)
+ * ring: The ring to close
+ */
+void spsc_ring_close_write(spsc_ring_t *ring);
+
+/*
+ * Stop reading, so the producer stops waiting for room (consumer only)
+ * ring: The ring to close
+ */
+void spsc_ring_close_read(spsc_ring_t *ring);
+
+#endif    // SPSC_RING_H
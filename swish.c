@@ -1,250 +1,1177 @@
 #define _GNU_SOURCE
 
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "capture.h"
+#include "deadline.h"
+#include "event_loop.h"
 #include "job_list.h"
+#include "line_reader.h"
+#include "memo.h"
+#include "metrics.h"
+#include "pipeline.h"
+#include "reaper.h"
+#include "script_cache.h"
+#include "server.h"
+#include "share.h"
 #include "string_vector.h"
 #include "swish_funcs.h"
+#include "zygote.h"
 
 #define CMD_LEN 512
 #define PROMPT "@> "
+#define HEREDOC_PROMPT "> "
 
-int main(int argc, char **argv) {
-    // Task 4: Set up shell to ignore SIGTTIN, SIGTTOU when put in background
-    // You should adapt this code for use in run_command().
-    struct sigaction sac;
-    sac.sa_handler = SIG_IGN;
-    if (sigfillset(&sac.sa_mask) == -1) {
-        perror("sigfillset");
-        return 1;
+/*
+ * What the shell waits for before it runs its next command. It never blocks
+ * otherwise, so the event loop keeps handling everything else meanwhile
+ */
+typedef enum {
+    SHELL_READY,         // Nothing, runs the next command
+    SHELL_FOREGROUND,    // The foreground job, to stop or end
+    SHELL_WAIT_JOB,      // wait-for: one background job, to stop or end
+    SHELL_WAIT_ALL,      // wait-all: every background job, to stop or end
+    SHELL_FOLLOW,        // output --follow: the end of a job's output, or Ctrl-C
+} shell_state_t;
+
+typedef struct {
+    job_list_t jobs;
+    event_loop_t loop;
+    shell_state_t state;
+    zygote_pool_t zygotes;
+    int use_zygote;
+    // One-shot timer that tops the pool back up, or -1 if none is pending
+    int refill_timer;
+    // 0 when input isn't a terminal (e.g. running a script from a pipe), so
+    // there is no foreground process group to hand over
+    int has_terminal;
+    // Bytes of output kept per background job, 0 if output isn't captured
+    size_t capture_size;
+    const char *spill_dir;
+    // Orphaned descendants of jobs, when the shell is a child subreaper
+    int use_subreaper;
+    reaper_t reaper;
+    pid_t foreground_pid;
+    // The job resumed with fg, or NULL for a new program, which becomes a job
+    // (with its name and deadline) if it is stopped
+    job_t *foreground_job;
+    char foreground_name[NAME_LEN];
+    deadline_t *foreground_deadline;
+    uint64_t wait_start;
+    job_t *waited_job;      // For wait-for
+    capture_t *followed;    // For output --follow
+    // Commands typed at the prompt, which are read ahead while the shell
+    // waits (except for a foreground job, which owns the terminal)
+    int use_input;
+    line_reader_t input;
+    int is_reading;
+    // The jobs of a job server are collected by the server (see server.h)
+    int is_server;
+    memo_t memo;
+    // A memo miss running in the foreground, whose output goes into the entry
+    // and is replayed once the command is done
+    int is_memoizing;
+    memo_key_t memo_key;
+    memo_entry_t memo_entry;
+    strvec_t memo_outputs;
+    // Periodic export of the shell's metrics, if a file was given
+    int use_metrics;
+    metrics_export_t metrics;
+} shell_t;
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-z|--zygote[=POOL_SIZE]] [-c|--capture[=SIZE]] [--capture-spill=DIR] "
+            "[--subreaper] [--fuse] [--memo-dir=DIR] [--memo-size=SIZE] "
+            "[--metrics=FILE] [--metrics-interval=SECS] [--event-loop=uring|epoll] "
+            "[--serve=SOCKET | SCRIPT]\n",
+            prog);
+}
+
+static void on_input(int fd, ssize_t len, void *arg) {
+    shell_t *sh = arg;
+    sh->is_reading = 0;
+    if (len == -1) {
+        perror("read");
+        len = 0;
     }
-    sac.sa_flags = 0;
-    if (sigaction(SIGTTIN, &sac, NULL) == -1 || sigaction(SIGTTOU, &sac, NULL) == -1) {
-        perror("sigaction");
-        return 1;
+    line_reader_commit(&sh->input, len);
+}
+
+/*
+ * Read more commands from the user through the event loop, unless a
+ * foreground job owns the terminal or nothing fits until commands are taken out
+ */
+static void start_reading(shell_t *sh) {
+    if (!sh->use_input || sh->is_reading || sh->input.eof || sh->state == SHELL_FOREGROUND) {
+        return;
+    }
+    size_t len;
+    char *space = line_reader_space(&sh->input, &len);
+    if (len == 0) {
+        return;
+    }
+    if (event_loop_read(&sh->loop, sh->input.fd, space, len, on_input, sh) == -1) {
+        // waiting for input that can't be read would hang the shell
+        line_reader_commit(&sh->input, 0);
+        return;
     }
+    sh->is_reading = 1;
+}
 
-    strvec_t tokens;
-    strvec_init(&tokens);
-    job_list_t jobs;
-    job_list_init(&jobs);
-    char cmd[CMD_LEN];
+/*
+ * Leave the terminal's input to a foreground job, keeping what was read already
+ */
+static void stop_reading(shell_t *sh) {
+    if (sh->is_reading) {
+        event_loop_cancel_read(&sh->loop, sh->input.fd);
+        sh->is_reading = 0;
+    }
+}
 
-    printf("%s", PROMPT);
-    while (fgets(cmd, CMD_LEN, stdin) != NULL) {
-        // Need to remove trailing '\n' from cmd. There are fancier ways.
-        int i = 0;
-        while (cmd[i] != '\n') {
-            i++;
+/*
+ * Wait for events and handle them, reading commands meanwhile
+ * Returns 0 on success or -1 on error
+ */
+static int run_events(shell_t *sh) {
+    start_reading(sh);
+    // Builtins print through stdio, and the prompt has no newline
+    fflush(stdout);
+    return event_loop_run_once(&sh->loop, -1) == -1 ? -1 : 0;
+}
+
+/*
+ * Lines following a command typed at the prompt, for here-document bodies
+ */
+static int next_prompt_line(void *source, char *line, size_t size) {
+    shell_t *sh = source;
+    printf("%s", HEREDOC_PROMPT);
+    int ret;
+    while ((ret = line_reader_next(&sh->input, line, size)) == 0) {
+        if (run_events(sh) == -1) {
+            return -1;
         }
-        cmd[i] = '\0';
+    }
+    return ret;
+}
 
-        if (tokenize(cmd, &tokens) != 0) {
-            printf("Failed to parse command\n");
-            strvec_clear(&tokens);
-            job_list_free(&jobs);
-            return 1;
+/*
+ * SIGCHLD handler for subreaper mode: adopt new orphans and reap exited ones
+ */
+static void on_child_event(int fd, void *arg) {
+    shell_t *sh = arg;
+    // Children that are neither jobs nor orphans: the foreground command and
+    // idle zygote helpers
+    pid_t known[ZYGOTE_MAX_POOL + 1];
+    unsigned num_known = 0;
+    if (sh->foreground_pid != 0) {
+        known[num_known++] = sh->foreground_pid;
+    }
+    for (unsigned i = 0; sh->use_zygote && i < sh->zygotes.length; i++) {
+        known[num_known++] = sh->zygotes.helpers[i].pid;
+    }
+    reaper_collect(&sh->reaper, &sh->jobs, known, num_known);
+}
+
+/*
+ * Top the zygote pool back up, once the shell next runs its event loop
+ */
+static void on_refill(int timer, void *arg) {
+    shell_t *sh = arg;
+    event_loop_remove_timer(&sh->loop, timer);
+    sh->refill_timer = -1;
+    zygote_pool_refill(&sh->zygotes);
+}
+
+/*
+ * Collect a background job's output from the read end of its pipe
+ * If the capture can't be set up the job's writes fail instead of going
+ * to the terminal, so it is reported
+ */
+static void start_capture(shell_t *sh, job_t *job, int fd) {
+    char spill_path[PATH_MAX];
+    const char *spill = NULL;
+    if (sh->spill_dir != NULL) {
+        if (snprintf(spill_path, sizeof(spill_path), "%s/job-%d.out", sh->spill_dir, job->pid) <
+            (int) sizeof(spill_path)) {
+            spill = spill_path;
+        } else {
+            fprintf(stderr, "Spill directory path too long\n");
         }
-        if (tokens.length == 0) {
-            printf("%s", PROMPT);
+    }
+    job->capture = capture_new(&sh->loop, fd, sh->capture_size, spill);
+    if (job->capture == NULL) {
+        fprintf(stderr, "Failed to capture output of job %s\n", job->name);
+    }
+}
+
+/*
+ * Send a cached command's output to its ">" and ">>" targets, or to standard
+ * output if there are none
+ * outputs: Pairs of redirection operator and file name
+ */
+static void replay_output(const memo_entry_t *entry, const strvec_t *outputs) {
+    // anything the shell printed itself goes first
+    fflush(stdout);
+    if (outputs->length == 0) {
+        memo_replay(entry, STDOUT_FILENO);
+    }
+    for (unsigned i = 0; i + 1 < outputs->length; i += 2) {
+        int is_append = strcmp(strvec_get(outputs, i), ">>") == 0;
+        int flags = O_WRONLY | O_CREAT | (is_append ? O_APPEND : O_TRUNC);
+        int fd = open(strvec_get(outputs, i + 1), flags, S_IRUSR | S_IWUSR);
+        if (fd == -1) {
+            perror("Failed to open output file");
             continue;
         }
-        const char *first_token = strvec_get(&tokens, 0);
-        // print current working directory
-        if (strcmp(first_token, "pwd") == 0) {
-            // TODO Task 1: Print the shell's current working directory
-            // Use the getcwd() system call
-            char buf[CMD_LEN];    // buffer to hold current path name
-            if (getcwd(buf, CMD_LEN) == NULL) {
-                perror("getcwd");
-                strvec_clear(&tokens);
+        memo_replay(entry, fd);
+        close(fd);
+    }
+}
 
-            } else {
-                // print the current path name
-                printf("%s\n", buf);
+/*
+ * Store the output of a memo miss whose command is done, and replay it
+ * is_stopped: 1 if the command was stopped instead, and became a job
+ * status: The command's wait status, or -1 if it ended in an unknown way
+ */
+static void finish_memoized(shell_t *sh, int is_stopped, int status) {
+    sh->is_memoizing = 0;
+    if (is_stopped) {
+        // a stopped command keeps writing into the entry, so it can't be cached
+        memo_abort(&sh->memo_entry);
+    } else if (status != -1 && WIFEXITED(status) &&
+               memo_commit(&sh->memo, &sh->memo_key, &sh->memo_entry, WEXITSTATUS(status)) == 0) {
+        replay_output(&sh->memo_entry, &sh->memo_outputs);
+        memo_entry_close(&sh->memo_entry);
+    } else {
+        // a killed command isn't cached, but what it wrote is still shown
+        replay_output(&sh->memo_entry, &sh->memo_outputs);
+        memo_abort(&sh->memo_entry);
+    }
+    memo_key_free(&sh->memo_key);
+    strvec_clear(&sh->memo_outputs);
+}
+
+/*
+ * Wait for a job in the foreground, which already has the terminal
+ * pid: The job's process
+ * job: The job resumed with fg, or NULL for a new program
+ * name: The new program's name
+ * deadline: The new program's time limit, or NULL
+ */
+static void start_foreground(shell_t *sh, pid_t pid, job_t *job, const char *name,
+                             deadline_t *deadline) {
+    sh->state = SHELL_FOREGROUND;
+    sh->foreground_pid = pid;
+    sh->foreground_job = job;
+    if (name != NULL) {
+        strncpy(sh->foreground_name, name, NAME_LEN);
+        sh->foreground_name[NAME_LEN - 1] = '\0';
+    }
+    sh->foreground_deadline = deadline;
+    sh->wait_start = metrics_now_ns();
+}
+
+/*
+ * Take the terminal back once the foreground job has stopped or ended
+ * status: The job's wait status, or -1 if it ended in an unknown way
+ */
+static void finish_foreground(shell_t *sh, int status) {
+    int is_stopped = status != -1 && WIFSTOPPED(status);
+    pid_t pid = sh->foreground_pid;
+    metrics_record_wait(metrics_now_ns() - sh->wait_start);
+    sh->state = SHELL_READY;
+    sh->foreground_pid = 0;
+    // restore keyboard input signals to parent process after execution
+    if (sh->has_terminal && tcsetpgrp(STDIN_FILENO, getpid()) == -1) {
+        perror("process group restore failed");
+    }
+
+    job_t *job = sh->foreground_job;
+    sh->foreground_job = NULL;
+    deadline_t *deadline = sh->foreground_deadline;
+    sh->foreground_deadline = NULL;
+    if (job != NULL) {
+        if (job->capture != NULL) {
+            capture_drain(job->capture);
+            job->capture->follow_fd = -1;
+        }
+        // stopped again, even if it was in the background before
+        if (is_stopped) {
+            job->status = STOPPED;
+        } else {
+            job_list_remove(&sh->jobs, job_list_index(&sh->jobs, job));
+        }
+    } else if (is_stopped) {
+        if (job_list_add(&sh->jobs, pid, sh->foreground_name, STOPPED) == -1) {
+            printf("job list add failed");
+        } else {
+            // the deadline keeps running while the job is stopped
+            job_list_get(&sh->jobs, sh->jobs.length - 1)->deadline = deadline;
+            deadline = NULL;
+        }
+    }
+    deadline_free(deadline);
+    if (sh->is_memoizing) {
+        finish_memoized(sh, is_stopped, status);
+    }
+}
+
+/*
+ * Handle a change of state of a child the shell started, from the event loop
+ */
+static void on_child_status(pid_t pid, int status, void *arg) {
+    shell_t *sh = arg;
+    if (status != -1 && WIFCONTINUED(status)) {
+        return;
+    }
+    if (pid == sh->foreground_pid) {
+        // the foreground job's CPU share is suspended, but a stop it made
+        // just before may only be reported now
+        if (status != -1 && WIFSTOPPED(status) && sh->foreground_job != NULL &&
+            share_take_stop(sh->foreground_job->share)) {
+            return;
+        }
+        finish_foreground(sh, status);
+        return;
+    }
+    job_t *job = job_list_find(&sh->jobs, pid);
+    if (job == NULL) {
+        return;
+    }
+    update_job(job, status);
+    // whatever the job left behind has been handed to the shell already, so
+    // take it in before anyone checks whether the job is done
+    if (job->is_done && sh->use_subreaper) {
+        on_child_event(-1, sh);
+    }
+}
+
+/*
+ * Start waiting for background jobs (see advance())
+ */
+static void start_wait(shell_t *sh, shell_state_t state) {
+    sh->state = state;
+    sh->wait_start = metrics_now_ns();
+}
+
+/*
+ * Check whether what the shell waits for is over, other than the foreground
+ * job (which is handled as soon as it stops or ends)
+ */
+static void advance(shell_t *sh) {
+    reaper_t *reaper = sh->use_subreaper ? &sh->reaper : NULL;
+    switch (sh->state) {
+        case SHELL_WAIT_JOB:
+            if (collect_background_job(&sh->jobs, sh->waited_job, reaper)) {
+                metrics_record_wait(metrics_now_ns() - sh->wait_start);
+                sh->waited_job = NULL;
+                sh->state = SHELL_READY;
+            }
+            break;
+        case SHELL_WAIT_ALL:
+            if (collect_all_background_jobs(&sh->jobs, reaper)) {
+                metrics_record_wait(metrics_now_ns() - sh->wait_start);
+                sh->state = SHELL_READY;
+            }
+            break;
+        case SHELL_FOLLOW:
+            if (!capture_is_following(sh->followed)) {
+                capture_unfollow(sh->followed);
+                sh->followed = NULL;
+                sh->state = SHELL_READY;
             }
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Keep the event loop running until the shell is ready for its next command
+ * Returns 0 on success or -1 on error
+ */
+static int wait_until_ready(shell_t *sh) {
+    advance(sh);
+    while (sh->state != SHELL_READY) {
+        if (run_events(sh) == -1) {
+            return -1;
         }
+        advance(sh);
+    }
+    return 0;
+}
 
-        else if (strcmp(first_token, "cd") == 0) {
-            // TODO Task 1: Change the shell's current working directory
-            // Use the chdir() system call
-            // If the user supplied an argument (token at index 1), change to that directory
-            // Otherwise, change to the home directory by default
-            // This is available in the HOME environment variable (use getenv())
-
-            char *new_env;
-            int len_args = tokens.length;
-
-            // too many input arguments
-            if (len_args > 2) {
-                printf("Invalid arguments");
-                strvec_clear(&tokens);
-
-                // Return to Home Dir
-            } else if (len_args == 1) {
-                // get the home directory
-                if ((new_env = getenv("HOME")) == NULL) {
-                    perror("chdir");
-                    strvec_clear(&tokens);
-
-                    // enter the home directory
-                } else if (chdir(new_env) == -1) {
-                    perror("chdir");
-                    strvec_clear(&tokens);
-                }
+/*
+ * Run a program in a child process, in the foreground or as a background job
+ * sh: The shell's state
+ * tokens: The program and its arguments
+ * is_background: 1 to run the program as a background job, 0 to wait for it
+ * timeout_ms: Time limit for the program in milliseconds, or 0 for none
+ * kill_after_ms: Grace period between SIGTERM and SIGKILL once the time limit
+ *                is reached
+ * out_fd: Descriptor to use as the program's standard output, or -1 for the shell's
+ * Returns 0 once the program runs, either as a background job or in the
+ * foreground until it stops or ends (see finish_foreground()), or -1 if it
+ * failed to start
+ */
+static int run_program(shell_t *sh, strvec_t *tokens, int is_background, unsigned timeout_ms,
+                       unsigned kill_after_ms, int out_fd) {
+    // TODO Task 2: If the user input does not match any built-in shell command,
+    // treat the input as a program name and command-line arguments
+    // USE THE run_command() FUNCTION DEFINED IN swish_funcs.c IN YOUR IMPLEMENTATION
+    // You should take the following steps:
+    //   1. Use fork() to spawn a child process
+    //   2. Call run_command() in the child process
+    //   2. In the parent, use waitpid() to wait for the program to exit
+
+    // with capture enabled, a background job writes into a pipe the shell drains
+    int capture_fds[2] = {-1, -1};
+    if (is_background && sh->capture_size > 0 && pipe2(capture_fds, O_CLOEXEC) == -1) {
+        perror("pipe");
+    }
+
+    // the program gets the terminal, and whatever the user types next
+    if (!is_background) {
+        stop_reading(sh);
+    }
+
+    // spawn the subprocess for non-built-in commands, preferring a pre-forked
+    // helper when the zygote pool has one ready (a burst of commands can empty
+    // the pool before the shell gets to refill it, the rest fork as usual)
+    int is_foreground = !is_background && sh->has_terminal;
+    pid_t pid = -1;
+    uint64_t spawn_start = metrics_now_ns();
+    if (sh->use_zygote && sh->zygotes.length > 0) {
+        int job_out = capture_fds[1] != -1 ? capture_fds[1] : out_fd;
+        pid = zygote_pool_spawn(&sh->zygotes, tokens, is_foreground, job_out, capture_fds[1]);
+        if (pid == -1) {
+            fprintf(stderr, "No zygote available, falling back to fork\n");
+        }
+    }
+    if (pid == -1) {
+        pid = fork();
+    }
 
-                // enter a new directory
-            } else if (len_args == 2) {
-                // get the directory to enter
-                new_env = strvec_get(&tokens, 1);
-                // enter the new directory
-                if (chdir(new_env) == -1) {
-                    perror("chdir");
-                    strvec_clear(&tokens);
+    int result = -1;
+    // the shell only keeps the read end, the job holds the write end
+    if (pid != 0 && capture_fds[1] != -1) {
+        close(capture_fds[1]);
+    }
+    // check if subprocess successfully initialized
+    if (pid < 0) {
+        perror("fork failed");
+        if (capture_fds[0] != -1) {
+            close(capture_fds[0]);
+        }
+
+        // parent process
+    } else if (pid > 0) {
+        metrics_record_spawn(metrics_now_ns() - spawn_start);
+        // replace used helpers from the event loop, so the fork happens while
+        // the shell is waiting (at the prompt or on a foreground job) rather
+        // than in front of the next command
+        if (sh->use_zygote && sh->refill_timer == -1 &&
+            sh->zygotes.length < sh->zygotes.target) {
+            sh->refill_timer = event_loop_add_timer(&sh->loop, 0, 0, on_refill, sh);
+        }
+        // every stop and exit comes through the event loop (the job server
+        // watches its own jobs)
+        if (!sh->is_server) {
+            event_loop_watch_child(&sh->loop, pid, on_child_status, sh);
+        }
+        deadline_t *deadline = NULL;
+        if (timeout_ms > 0 &&
+            (deadline = deadline_new(&sh->loop, pid, timeout_ms, kill_after_ms)) == NULL) {
+            fprintf(stderr, "Failed to set deadline\n");
+        }
+        if (!is_background) {
+            // put the child process in the foreground (keyboard signals redirect to this
+            // process)
+            if (sh->has_terminal && tcsetpgrp(STDIN_FILENO, pid) == -1) {
+                perror("process group change failed");
+            }
+            // wait for child to execute, from the event loop
+            start_foreground(sh, pid, NULL, strvec_get(tokens, 0), deadline);
+        } else {
+            // when & is last symbol -> this runs in background
+            if (job_list_add(&sh->jobs, pid, strvec_get(tokens, 0), BACKGROUND) == -1) {
+                printf("job list add failed");
+                deadline_free(deadline);
+            } else {
+                job_t *job = job_list_get(&sh->jobs, sh->jobs.length - 1);
+                job->deadline = deadline;
+                if (capture_fds[0] != -1) {
+                    start_capture(sh, job, capture_fds[0]);
+                    capture_fds[0] = -1;
                 }
             }
         }
+        result = 0;
+    } else {
+        // send a captured job's output (both streams) to the shell's pipe
+        if (capture_fds[1] != -1 &&
+            (dup2(capture_fds[1], STDOUT_FILENO) == -1 ||
+             dup2(capture_fds[1], STDERR_FILENO) == -1)) {
+            perror("dup2");
+            exit(1);
+        }
+        if (out_fd != -1 && dup2(out_fd, STDOUT_FILENO) == -1) {
+            perror("dup2");
+            exit(1);
+        }
+        // run the child process.
+        if (run_command(tokens) == -1) {
+            exit(1);
+        }
+    }
 
-        else if (strcmp(first_token, "exit") == 0) {
-            strvec_clear(&tokens);
-            break;
+    // TODO Task 4: Set the child process as the target of signals sent to the terminal
+    // via the keyboard.
+    // To do this, call 'tcsetpgrp(STDIN_FILENO, <child_pid>)', where child_pid is the
+    // child's process ID just returned by fork(). Do this in the parent process.
+
+    // TODO Task 5: Handle the issue of foreground/background terminal process groups.
+    // Do this by taking the following steps in the shell (parent) process:
+    // 1. Modify your call to waitpid(): Wait specifically for the child just forked, and
+    //    use WUNTRACED as your third argument to detect if it has stopped from a signal
+    // 2. After waitpid() has returned, call tcsetpgrp(STDIN_FILENO, <pid>) where pid is
+    //    the process ID of the shell process (use getpid() to obtain it)
+    // 3. If the child status was stopped by a signal, add it to 'jobs', the
+    //    the terminal's jobs list.
+    // You can detect if this has occurred using WIFSTOPPED on the status
+    // variable set by waitpid()
+
+    // TODO Task 6: If the last token input by the user is "&", start the current
+    // command in the background.
+    // 1. Determine if the last token is "&". If present, use strvec_take() to remove
+    //    the "&" from the token list.
+    // 2. Modify the code for the parent (shell) process: Don't use tcsetpgrp() or
+    //    use waitpid() to interact with the newly spawned child process.
+    // 3. Add a new entry to the jobs list with the child's pid, program name,
+    //    and status BACKGROUND.
+    return result;
+}
+
+/*
+ * Run a command through the output cache (see memo.h), for "memo COMMAND ..."
+ * A hit replays the cached output without starting anything. A miss runs the
+ * command in the foreground with its output going into a new cache entry,
+ * which is replayed once the command is done. "memo --stats" reports on the cache instead
+ * sh: The shell's state
+ * tokens: Tokens of the command line, starting with "memo"
+ * is_background: 1 if the command ended with "&", in which case it isn't cached
+ */
+static void run_memoized(shell_t *sh, strvec_t *tokens, int is_background) {
+    if (tokens->length == 2 && strcmp(strvec_get(tokens, 1), "--stats") == 0) {
+        memo_print_stats(&sh->memo);
+        return;
+    }
+    if (tokens->length < 2) {
+        fprintf(stderr, "Usage: memo COMMAND [ARGS...] or memo --stats\n");
+        return;
+    }
+
+    // the output redirections apply to the replayed output, not to the command
+    strvec_t full;
+    strvec_t cmd;
+    strvec_t *outputs = &sh->memo_outputs;
+    strvec_init(&full);
+    strvec_init(&cmd);
+    strvec_init(outputs);
+    for (unsigned i = 1; i < tokens->length; i++) {
+        const char *token = strvec_get(tokens, i);
+        strvec_add(&full, token);
+        if ((strcmp(token, ">") == 0 || strcmp(token, ">>") == 0) && i + 1 < tokens->length) {
+            strvec_add(outputs, token);
+            strvec_add(outputs, strvec_get(tokens, ++i));
+            strvec_add(&full, strvec_get(tokens, i));
+        } else {
+            strvec_add(&cmd, token);
         }
+    }
 
-        // Task 5: Print out current list of pending jobs
-        else if (strcmp(first_token, "jobs") == 0) {
-            int i = 0;
-            job_t *current = jobs.head;
-            while (current != NULL) {
-                char *status_desc;
-                if (current->status == BACKGROUND) {
-                    status_desc = "background";
-                } else {
-                    status_desc = "stopped";
-                }
-                printf("%d: %s (%s)\n", i, current->name, status_desc);
-                i++;
-                current = current->next;
+    memo_key_t *key = &sh->memo_key;
+    memo_entry_t *entry = &sh->memo_entry;
+    if (is_background || sh->memo.dir == NULL || memo_key_build(key, &cmd) == -1) {
+        // nothing to key the output on (e.g. the program doesn't exist)
+        run_program(sh, &full, is_background, 0, 0, -1);
+    } else if (memo_lookup(&sh->memo, key, entry)) {
+        replay_output(entry, outputs);
+        memo_entry_close(entry);
+        memo_key_free(key);
+    } else if (memo_begin(&sh->memo, key, entry) == -1) {
+        run_program(sh, &full, 0, 0, 0, -1);
+        memo_key_free(key);
+    } else if (run_program(sh, &cmd, 0, 0, 0, entry->fd) == -1) {
+        memo_abort(entry);
+        memo_key_free(key);
+    } else {
+        // the entry is stored once the command is done (see finish_memoized()),
+        // which owns the key and the redirections until then
+        sh->is_memoizing = 1;
+        outputs = NULL;
+    }
+    strvec_clear(&full);
+    strvec_clear(&cmd);
+    if (outputs != NULL) {
+        strvec_clear(outputs);
+    }
+}
+
+/*
+ * Run one command line: either a builtin or a program in a child process
+ * Commands that wait (for a foreground job, wait-for, wait-all, output
+ * --follow) only put the shell in the state to do so, see wait_until_ready()
+ * sh: The shell's state
+ * tokens: The command's tokens, with any trailing "&" already removed
+ * is_background: 1 if the command ended with "&", 0 otherwise
+ * Returns 1 if the shell should exit, 0 otherwise
+ */
+static int run_line(shell_t *sh, strvec_t *tokens, int is_background) {
+    const char *first_token = strvec_get(tokens, 0);
+    // print current working directory
+    if (strcmp(first_token, "pwd") == 0) {
+        // TODO Task 1: Print the shell's current working directory
+        // Use the getcwd() system call
+        char buf[CMD_LEN];    // buffer to hold current path name
+        if (getcwd(buf, CMD_LEN) == NULL) {
+            perror("getcwd");
+            strvec_clear(tokens);
+
+        } else {
+            // print the current path name
+            printf("%s\n", buf);
+        }
+    }
+
+    else if (strcmp(first_token, "cd") == 0) {
+        // TODO Task 1: Change the shell's current working directory
+        // Use the chdir() system call
+        // If the user supplied an argument (token at index 1), change to that directory
+        // Otherwise, change to the home directory by default
+        // This is available in the HOME environment variable (use getenv())
+
+        char *new_env;
+        int len_args = tokens->length;
+
+        // too many input arguments
+        if (len_args > 2) {
+            printf("Invalid arguments");
+            strvec_clear(tokens);
+
+            // Return to Home Dir
+        } else if (len_args == 1) {
+            // get the home directory
+            if ((new_env = getenv("HOME")) == NULL) {
+                perror("chdir");
+                strvec_clear(tokens);
+
+                // enter the home directory
+            } else if (chdir(new_env) == -1) {
+                perror("chdir");
+                strvec_clear(tokens);
+            }
+
+            // enter a new directory
+        } else if (len_args == 2) {
+            // get the directory to enter
+            new_env = strvec_get(tokens, 1);
+            // enter the new directory
+            if (chdir(new_env) == -1) {
+                perror("chdir");
+                strvec_clear(tokens);
             }
         }
+    }
+
+    else if (strcmp(first_token, "exit") == 0) {
+        strvec_clear(tokens);
+        return 1;
+    }
 
-        // Task 5: Move stopped job into foreground
-        else if (strcmp(first_token, "fg") == 0) {
-            if (resume_job(&tokens, &jobs, 1) == -1) {
-                printf("Failed to resume job in foreground\n");
+    // Task 5: Print out current list of pending jobs
+    else if (strcmp(first_token, "jobs") == 0) {
+        int i = 0;
+        job_t *current = sh->jobs.head;
+        while (current != NULL) {
+            char *status_desc;
+            if (current->deadline != NULL && current->deadline->timed_out) {
+                status_desc = "timed out";
+            } else if (current->status == BACKGROUND) {
+                status_desc = "background";
+            } else {
+                status_desc = "stopped";
+            }
+            if (current->share != NULL) {
+                printf("%d: %s (%s, %u%% CPU)\n", i, current->name, status_desc,
+                       current->share->percent);
+            } else {
+                printf("%d: %s (%s)\n", i, current->name, status_desc);
             }
+            i++;
+            current = current->next;
         }
+    }
 
-        // Task 6: Move stopped job into background
-        else if (strcmp(first_token, "bg") == 0) {
-            if (resume_job(&tokens, &jobs, 0) == -1) {
-                printf("Failed to resume job in background\n");
+    // Task 5: Move stopped job into foreground
+    else if (strcmp(first_token, "fg") == 0) {
+        stop_reading(sh);
+        job_t *job = resume_job(tokens, &sh->jobs, 1);
+        if (job == NULL) {
+            printf("Failed to resume job in foreground\n");
+        } else {
+            start_foreground(sh, job->pid, job, NULL, NULL);
+            if (job->is_done) {
+                finish_foreground(sh, job->wait_status);
             }
         }
+    }
+
+    // Task 6: Move stopped job into background
+    else if (strcmp(first_token, "bg") == 0) {
+        if (resume_job(tokens, &sh->jobs, 0) == NULL) {
+            printf("Failed to resume job in background\n");
+        }
+    }
+
+    // Task 6: Wait for a specific job identified by its index in job list
+    else if (strcmp(first_token, "wait-for") == 0) {
+        if ((sh->waited_job = await_background_job(tokens, &sh->jobs)) == NULL) {
+            printf("Failed to wait for background job\n");
+        } else {
+            start_wait(sh, SHELL_WAIT_JOB);
+        }
+    }
 
-        // Task 6: Wait for a specific job identified by its index in job list
-        else if (strcmp(first_token, "wait-for") == 0) {
-            if (await_background_job(&tokens, &jobs) == -1) {
-                printf("Failed to wait for background job\n");
+    // Task 6: Wait for all background jobs
+    else if (strcmp(first_token, "wait-all") == 0) {
+        start_wait(sh, SHELL_WAIT_ALL);
+    }
+
+    // Run a program with a time limit
+    else if (strcmp(first_token, "timeout") == 0) {
+        unsigned timeout_ms;
+        unsigned kill_after_ms;
+        int cmd_start = deadline_parse(tokens, 1, &timeout_ms, &kill_after_ms);
+        strvec_t cmd;
+        if (cmd_start == -1 || cmd_start >= tokens->length) {
+            fprintf(stderr, "Usage: timeout SECS [-k KILL_AFTER] COMMAND [ARGS...]\n");
+        } else if (strvec_init(&cmd) == 0) {
+            for (unsigned i = cmd_start; i < tokens->length; i++) {
+                strvec_add(&cmd, strvec_get(tokens, i));
             }
+            run_program(sh, &cmd, is_background, timeout_ms, kill_after_ms, -1);
+            strvec_clear(&cmd);
         }
+    }
+
+    // Set or clear the time limit of a job that is already running
+    else if (strcmp(first_token, "deadline") == 0) {
+        if (set_job_deadline(tokens, &sh->jobs, &sh->loop) == -1) {
+            printf("Failed to set job deadline\n");
+        }
+    }
+
+    // Cap the CPU use of a job while it runs in the background
+    else if (strcmp(first_token, "share") == 0) {
+        if (set_job_share(tokens, &sh->jobs, &sh->loop) == -1) {
+            printf("Failed to set job share\n");
+        }
+    }
+
+    // Replay the captured output of a background job
+    else if (strcmp(first_token, "output") == 0) {
+        if (print_job_output(tokens, &sh->jobs, &sh->followed) == -1) {
+            printf("Failed to print job output\n");
+        } else if (sh->followed != NULL) {
+            sh->state = SHELL_FOLLOW;
+        }
+    }
+
+    // Run a command through the output cache
+    else if (strcmp(first_token, "memo") == 0) {
+        run_memoized(sh, tokens, is_background);
+    }
+
+    else {
+        run_program(sh, tokens, is_background, 0, 0, -1);
+    }
+    return 0;
+}
+
+/*
+ * Read commands from the user (standard input) until "exit" or end of input
+ * Input keeps being read while the shell waits, and is run once it is done
+ * Returns the shell's exit status
+ */
+static int run_interactive(shell_t *sh) {
+    strvec_t tokens;
+    strvec_init(&tokens);
+    char cmd[CMD_LEN];
+    line_reader_init(&sh->input, STDIN_FILENO);
+    sh->use_input = 1;
 
-        // Task 6: Wait for all background jobs
-        else if (strcmp(first_token, "wait-all") == 0) {
-            if (await_all_background_jobs(&jobs) == -1) {
-                printf("Failed to wait for all background jobs\n");
+    int ret = 0;
+    int needs_prompt = 1;
+    while (1) {
+        advance(sh);
+        int has_cmd = 0;
+        if (sh->state == SHELL_READY) {
+            if (needs_prompt) {
+                printf("%s", PROMPT);
+                needs_prompt = 0;
+            }
+            if ((has_cmd = line_reader_next(&sh->input, cmd, CMD_LEN)) == -1) {
+                break;
             }
         }
+        if (!has_cmd) {
+            if (run_events(sh) == -1) {
+                ret = 1;
+                break;
+            }
+            continue;
+        }
 
-        else {
-            // TODO Task 2: If the user input does not match any built-in shell command,
-            // treat the input as a program name and command-line arguments
-            // USE THE run_command() FUNCTION DEFINED IN swish_funcs.c IN YOUR IMPLEMENTATION
-            // You should take the following steps:
-            //   1. Use fork() to spawn a child process
-            //   2. Call run_command() in the child process
-            //   2. In the parent, use waitpid() to wait for the program to exit
-
-            // spawn the subprocess for non-built-in commands
-            pid_t pid = fork();
-
-            // check if subprocess successfully initialized
-            if (pid < 0) {
-                perror("fork failed");
-
-                // parent process
-            } else if (pid > 0) {
-                int status;
-                int last_index = strvec_find(&tokens, "&");
-                // check if the & was found in the last position - below is no case
-                if (last_index != (tokens.length - 1)) {
-                    // put the child process in the foreground (keyboard signals redirect to this
-                    // process)
-                    if (tcsetpgrp(STDIN_FILENO, pid) == -1) {
-                        perror("process group change failed");
-                    }
-                    // wait for child to execute
-                    if (waitpid(pid, &status, WUNTRACED) == -1) {
-                        perror("wait failed");
-                    }
-                    // restore keyboard input signals to parent process after execution
-                    if (tcsetpgrp(STDIN_FILENO, getpid()) == -1) {
-                        perror("process group restore failed");
-                    }
-                    // check if the job was stopped
-                    if (WIFSTOPPED(status) == 1) {
-                        if (job_list_add(&jobs, pid, strvec_get(&tokens, 0), status) == -1) {
-                            printf("job list add failed");
-                        }
-                    }
-                } else {
-                    // when & is last symbol -> this runs in background (removes & then adds job)
-                    strvec_take(&tokens, (tokens.length - 1));
-                    if (job_list_add(&jobs, pid, strvec_get(&tokens, 0), BACKGROUND) == -1) {
-                        printf("job list add failed");
+        needs_prompt = 1;
+        if (tokenize(cmd, &tokens) != 0) {
+            printf("Failed to parse command\n");
+            strvec_clear(&tokens);
+            return 1;
+        }
+        if (tokens.length == 0) {
+            continue;
+        }
+        if (read_heredocs(&tokens, next_prompt_line, sh) == -1) {
+            printf("Failed to read here-document\n");
+            strvec_clear(&tokens);
+            continue;
+        }
+        // check if the & was found in the last position, and strip it so the
+        // program doesn't receive it as an argument
+        int is_background = strcmp(strvec_get(&tokens, tokens.length - 1), "&") == 0;
+        if (is_background) {
+            strvec_take(&tokens, (tokens.length - 1));
+        }
+        if (tokens.length > 0 && run_line(sh, &tokens, is_background) == 1) {
+            break;
+        }
+        strvec_clear(&tokens);
+    }
+    strvec_clear(&tokens);
+    return ret;
+}
+
+/*
+ * Run every command of a script file, without prompting
+ * The script is compiled once into a cached binary form (see script_cache.h),
+ * so later runs neither split lines nor look for "&" or here-documents again
+ * Returns the shell's exit status
+ */
+static int run_script(shell_t *sh, const char *path) {
+    script_t script;
+    if (script_load(path, &script) == -1) {
+        fprintf(stderr, "Failed to load script '%s'\n", path);
+        return 1;
+    }
+
+    strvec_t tokens;
+    strvec_init(&tokens);
+    int ret = 0;
+    for (unsigned i = 0; i < script.num_cmds; i++) {
+        if (wait_until_ready(sh) == -1) {
+            ret = 1;
+            break;
+        }
+        // Builtins print through stdio, keep their output in order with the programs'
+        fflush(stdout);
+        int flags;
+        if (script_command(&script, i, &tokens, &flags) == -1) {
+            printf("Failed to parse command\n");
+            ret = 1;
+            break;
+        }
+        if (tokens.length > 0 && run_line(sh, &tokens, flags & SCRIPT_BACKGROUND) == 1) {
+            break;
+        }
+        strvec_clear(&tokens);
+    }
+    // the last command may still be running in the foreground
+    if (ret == 0 && wait_until_ready(sh) == -1) {
+        ret = 1;
+    }
+    strvec_clear(&tokens);
+    script_free(&script);
+    return ret;
+}
+
+/*
+ * Start a command line submitted to the job server as a background job
+ * Returns the job's process ID or -1 if it couldn't be started
+ */
+static pid_t submit_job(strvec_t *tokens, void *arg) {
+    shell_t *sh = arg;
+    unsigned num_jobs = sh->jobs.length;
+    run_program(sh, tokens, 1, 0, 0, -1);
+    if (sh->jobs.length == num_jobs) {
+        return -1;
+    }
+    return job_list_get(&sh->jobs, sh->jobs.length - 1)->pid;
+}
+
+/*
+ * Run jobs submitted over a Unix domain socket (see server.h) until a client
+ * asks the server to shut down
+ * Returns the shell's exit status
+ */
+static int run_server(shell_t *sh, const char *path) {
+    // jobs must not compete for the terminal the server was started from
+    int null_fd = open("/dev/null", O_RDONLY);
+    if (null_fd == -1 || dup2(null_fd, STDIN_FILENO) == -1) {
+        perror("Failed to detach standard input");
+        return 1;
+    }
+    close(null_fd);
+    sh->has_terminal = 0;
+    sh->is_server = 1;
+
+    server_t srv;
+    if (server_init(&srv, path, &sh->loop, &sh->jobs, submit_job, sh) == -1) {
+        return 1;
+    }
+    int ret = 0;
+    while (!server_is_done(&srv)) {
+        // jobs print through the same stdout, keep the shell's own output first
+        fflush(stdout);
+        if (event_loop_run_once(&sh->loop, -1) == -1) {
+            ret = 1;
+            break;
+        }
+    }
+    server_free(&srv);
+    return ret;
+}
+
+/*
+ * Parse a size in bytes, with an optional K or M suffix (e.g. "64K")
+ * Returns 0 on success or -1 if the size is invalid or zero
+ */
+static int parse_size(const char *s, size_t *size) {
+    char *end;
+    unsigned long value = strtoul(s, &end, 10);
+    if (end == s || s[0] == '-') {
+        return -1;
+    }
+    if (*end == 'K' || *end == 'k') {
+        value *= 1024;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        value *= 1024 * 1024;
+        end++;
+    }
+    if (*end != '\0' || value == 0) {
+        return -1;
+    }
+    *size = value;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    // Optional pool of pre-forked helpers used to launch commands
+    int use_zygote = 0;
+    unsigned zygote_size = ZYGOTE_DEFAULT_POOL;
+    int use_subreaper = 0;
+    int use_fusion = 0;
+    // Optional capture of background jobs' output
+    size_t capture_size = 0;
+    const char *spill_dir = NULL;
+    // Cache used by the memo builtin
+    const char *memo_dir = NULL;
+    size_t memo_size = MEMO_DEFAULT_SIZE;
+    // Socket to serve job submissions on, instead of reading commands
+    const char *serve_path = NULL;
+    // File to export metrics to
+    const char *metrics_path = NULL;
+    unsigned metrics_interval_ms = METRICS_DEFAULT_INTERVAL_MS;
+    event_backend_t backend = EVENT_LOOP_URING;
+    static const struct option long_opts[] = {
+        {"zygote", optional_argument, NULL, 'z'},
+        {"capture", optional_argument, NULL, 'c'},
+        {"capture-spill", required_argument, NULL, 's'},
+        {"subreaper", no_argument, NULL, 'r'},
+        {"fuse", no_argument, NULL, 'f'},
+        {"memo-dir", required_argument, NULL, 'm'},
+        {"memo-size", required_argument, NULL, 'M'},
+        {"serve", required_argument, NULL, 'S'},
+        {"metrics", required_argument, NULL, 'p'},
+        {"metrics-interval", required_argument, NULL, 'i'},
+        {"event-loop", required_argument, NULL, 'e'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "z::c::", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'z':
+                use_zygote = 1;
+                if (optarg != NULL) {
+                    int size = atoi(optarg);
+                    if (size <= 0 || size > ZYGOTE_MAX_POOL) {
+                        fprintf(stderr, "Pool size must be between 1 and %d\n", ZYGOTE_MAX_POOL);
+                        return 1;
                     }
+                    zygote_size = size;
                 }
-            } else {
-                // run the child process.
-                if (run_command(&tokens) == -1) {
+                break;
+            case 'c':
+            case 's':
+                if (opt == 's') {
+                    spill_dir = optarg;
+                }
+                if (capture_size == 0) {
+                    capture_size = CAPTURE_DEFAULT_SIZE;
+                }
+                if (opt == 'c' && optarg != NULL && parse_size(optarg, &capture_size) == -1) {
+                    fprintf(stderr, "Invalid capture size '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'r':
+                use_subreaper = 1;
+                break;
+            case 'f':
+                use_fusion = 1;
+                break;
+            case 'm':
+                memo_dir = optarg;
+                break;
+            case 'M':
+                if (parse_size(optarg, &memo_size) == -1) {
+                    fprintf(stderr, "Invalid memo cache size '%s'\n", optarg);
                     return 1;
                 }
+                break;
+            case 'S':
+                serve_path = optarg;
+                break;
+            case 'p':
+                metrics_path = optarg;
+                break;
+            case 'i': {
+                char *end;
+                double seconds = strtod(optarg, &end);
+                if (end == optarg || *end != '\0' || !(seconds >= 0.001 && seconds <= 86400)) {
+                    fprintf(stderr, "Invalid metrics interval '%s'\n", optarg);
+                    return 1;
+                }
+                metrics_interval_ms = seconds * 1000;
+                break;
             }
-
-            // TODO Task 4: Set the child process as the target of signals sent to the terminal
-            // via the keyboard.
-            // To do this, call 'tcsetpgrp(STDIN_FILENO, <child_pid>)', where child_pid is the
-            // child's process ID just returned by fork(). Do this in the parent process.
-
-            // TODO Task 5: Handle the issue of foreground/background terminal process groups.
-            // Do this by taking the following steps in the shell (parent) process:
-            // 1. Modify your call to waitpid(): Wait specifically for the child just forked, and
-            //    use WUNTRACED as your third argument to detect if it has stopped from a signal
-            // 2. After waitpid() has returned, call tcsetpgrp(STDIN_FILENO, <pid>) where pid is
-            //    the process ID of the shell process (use getpid() to obtain it)
-            // 3. If the child status was stopped by a signal, add it to 'jobs', the
-            //    the terminal's jobs list.
-            // You can detect if this has occurred using WIFSTOPPED on the status
-            // variable set by waitpid()
-
-            // TODO Task 6: If the last token input by the user is "&", start the current
-            // command in the background.
-            // 1. Determine if the last token is "&". If present, use strvec_take() to remove
-            //    the "&" from the token list.
-            // 2. Modify the code for the parent (shell) process: Don't use tcsetpgrp() or
-            //    use waitpid() to interact with the newly spawned child process.
-            // 3. Add a new entry to the jobs list with the child's pid, program name,
-            //    and status BACKGROUND.
+            case 'e':
+                if (strcmp(optarg, "uring") == 0) {
+                    backend = EVENT_LOOP_URING;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    backend = EVENT_LOOP_EPOLL;
+                } else {
+                    fprintf(stderr, "Invalid event loop '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
         }
+    }
+    if (serve_path != NULL && optind < argc) {
+        usage(argv[0]);
+        return 1;
+    }
 
-        strvec_clear(&tokens);
-        printf("%s", PROMPT);
+    // Task 4: Set up shell to ignore SIGTTIN, SIGTTOU when put in background
+    // You should adapt this code for use in run_command().
+    struct sigaction sac;
+    sac.sa_handler = SIG_IGN;
+    if (sigfillset(&sac.sa_mask) == -1) {
+        perror("sigfillset");
+        return 1;
+    }
+    sac.sa_flags = 0;
+    if (sigaction(SIGTTIN, &sac, NULL) == -1 || sigaction(SIGTTOU, &sac, NULL) == -1) {
+        perror("sigaction");
+        return 1;
     }
 
-    job_list_free(&jobs);
-    return 0;
+    shell_t sh;
+    sh.state = SHELL_READY;
+    sh.use_zygote = use_zygote;
+    sh.refill_timer = -1;
+    sh.has_terminal = isatty(STDIN_FILENO);
+    sh.capture_size = capture_size;
+    sh.spill_dir = spill_dir;
+    sh.foreground_pid = 0;
+    sh.foreground_job = NULL;
+    sh.foreground_deadline = NULL;
+    sh.waited_job = NULL;
+    sh.followed = NULL;
+    sh.use_input = 0;
+    sh.is_reading = 0;
+    sh.is_server = 0;
+    sh.is_memoizing = 0;
+    if (memo_init(&sh.memo, memo_dir, memo_size) == -1) {
+        fprintf(stderr, "No directory for the memo cache, set HOME or use --memo-dir\n");
+    }
+    reaper_init(&sh.reaper);
+    sh.use_subreaper = use_subreaper && reaper_enable() == 0;
+    // pipelines run in children (including zygotes), which pick this up
+    if (use_fusion) {
+        pipeline_enable_fusion();
+    }
+    job_list_init(&sh.jobs);
+    if (event_loop_init(&sh.loop, backend) == -1) {
+        return 1;
+    }
+    if (sh.use_zygote && zygote_pool_init(&sh.zygotes, zygote_size) == -1) {
+        fprintf(stderr, "Failed to start zygote pool\n");
+        zygote_pool_free(&sh.zygotes);
+        sh.use_zygote = 0;
+    }
+
+    if (sh.use_subreaper) {
+        event_loop_on_child(&sh.loop, on_child_event, &sh);
+    }
+    sh.use_metrics = metrics_path != NULL &&
+                     metrics_export_start(&sh.metrics, &sh.loop, &sh.jobs, metrics_path,
+                                          metrics_interval_ms) == 0;
+
+    int ret;
+    if (serve_path != NULL) {
+        ret = run_server(&sh, serve_path);
+    } else if (optind < argc) {
+        ret = run_script(&sh, argv[optind]);
+    } else {
+        ret = run_interactive(&sh);
+    }
+
+    // a last update, so short-lived shells are seen too
+    if (sh.use_metrics) {
+        metrics_export_write(&sh.metrics);
+        metrics_export_stop(&sh.metrics);
+    }
+    job_list_free(&sh.jobs);
+    reaper_free(&sh.reaper);
+    memo_free(&sh.memo);
+    if (sh.use_zygote) {
+        zygote_pool_free(&sh.zygotes);
+    }
+    event_loop_free(&sh.loop);
+    return ret;
 }
@@ -0,0 +1,171 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// How long to keep trying to reach a server that is still starting up
+#define CONNECT_TIMEOUT_MS 5000
+#define CONNECT_RETRY_MS 10
+
+/*
+ * Client for "swish --serve": sends every request in one batch and shuts down
+ * its end of the socket, then prints the replies in order, one per line (see
+ * server.h for the protocol)
+ */
+
+static void usage(void) {
+    printf("Usage: <socket> [request...]\n"
+           "Requests are read from standard input, one per line, if none are given\n");
+}
+
+static int connect_server(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    struct timespec retry = {.tv_sec = 0, .tv_nsec = CONNECT_RETRY_MS * 1000000L};
+    for (int waited = 0;; waited += CONNECT_RETRY_MS) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1) {
+            perror("socket");
+            return -1;
+        }
+        if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+        int err = errno;
+        close(fd);
+        if ((err != ENOENT && err != ECONNREFUSED) || waited >= CONNECT_TIMEOUT_MS) {
+            errno = err;
+            perror("connect");
+            return -1;
+        }
+        nanosleep(&retry, NULL);
+    }
+}
+
+/*
+ * Append a request frame to a buffer
+ * Returns 0 on success or -1 on error
+ */
+static int add_request(char **buf, size_t *len, size_t *cap, const char *request) {
+    size_t request_len = strlen(request);
+    while (*len + 4 + request_len > *cap) {
+        *cap = *cap > 0 ? *cap * 2 : 4096;
+        if ((*buf = realloc(*buf, *cap)) == NULL) {
+            perror("realloc");
+            return -1;
+        }
+    }
+    unsigned char *header = (unsigned char *) *buf + *len;
+    header[0] = request_len >> 24;
+    header[1] = request_len >> 16;
+    header[2] = request_len >> 8;
+    header[3] = request_len;
+    memcpy(*buf + *len + 4, request, request_len);
+    *len += 4 + request_len;
+    return 0;
+}
+
+static int read_exactly(int fd, void *buf, size_t len) {
+    char *bytes = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, bytes, len);
+        if (n <= 0) {
+            if (n == 0) {
+                fprintf(stderr, "Server closed the connection\n");
+            } else {
+                perror("read");
+            }
+            return -1;
+        }
+        bytes += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+
+    char *batch = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    unsigned num_requests = 0;
+    if (argc > 2) {
+        for (int i = 2; i < argc; i++, num_requests++) {
+            if (add_request(&batch, &len, &cap, argv[i]) == -1) {
+                return 1;
+            }
+        }
+    } else {
+        char *line = NULL;
+        size_t line_cap = 0;
+        ssize_t line_len;
+        while ((line_len = getline(&line, &line_cap, stdin)) != -1) {
+            if (line_len > 0 && line[line_len - 1] == '\n') {
+                line[line_len - 1] = '\0';
+            }
+            if (add_request(&batch, &len, &cap, line) == -1) {
+                return 1;
+            }
+            num_requests++;
+        }
+        free(line);
+    }
+
+    int fd = connect_server(argv[1]);
+    if (fd == -1) {
+        return 1;
+    }
+    for (size_t sent = 0; sent < len;) {
+        ssize_t n = write(fd, batch + sent, len - sent);
+        if (n == -1) {
+            perror("write");
+            return 1;
+        }
+        sent += n;
+    }
+    free(batch);
+    // nothing more to send, the server still answers every request
+    if (shutdown(fd, SHUT_WR) == -1) {
+        perror("shutdown");
+        return 1;
+    }
+
+    int ret = 0;
+    char *reply = NULL;
+    for (unsigned i = 0; i < num_requests; i++) {
+        unsigned char header[4];
+        if (read_exactly(fd, header, 4) == -1) {
+            return 1;
+        }
+        size_t reply_len = (size_t) header[0] << 24 | header[1] << 16 | header[2] << 8 | header[3];
+        if ((reply = realloc(reply, reply_len + 1)) == NULL) {
+            perror("realloc");
+            return 1;
+        }
+        if (read_exactly(fd, reply, reply_len) == -1) {
+            return 1;
+        }
+        reply[reply_len] = '\0';
+        printf("%s\n", reply);
+        if (strncmp(reply, "error", 5) == 0) {
+            ret = 1;
+        }
+    }
+    free(reply);
+    close(fd);
+    return ret;
+}
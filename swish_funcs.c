@@ -3,39 +3,459 @@
 #include "swish_funcs.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "capture.h"
+#include "deadline.h"
 #include "job_list.h"
+#include "metrics.h"
+#include "pathname.h"
+#include "pipeline.h"
+#include "scan.h"
+#include "share.h"
 #include "string_vector.h"
 
-#define MAX_ARGS 10
+#define BUF_SIZE 4096
+#define LINE_LEN 512
+
+static void close_all(int *fds, int n) {
+    for (int i = 0; i < n; i++) {
+        close(fds[i]);
+    }
+}
+
+/*
+ * Put the contents of a here-document or here-string into an anonymous,
+ * sealed memory file, ready to be read from the start
+ * No file system I/O is involved and the body is copied only once
+ * body: Text to place in the file
+ * add_newline: 1 to append a newline (here-strings), 0 otherwise
+ * Returns a read-only descriptor for the file or -1 on error
+ */
+static int here_document_fd(const char *body, int add_newline) {
+    int fd = memfd_create("swish-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        perror("memfd_create");
+        return -1;
+    }
+
+    size_t len = strlen(body);
+    struct iovec iov[2] = {
+        {.iov_base = (char *) body, .iov_len = len},
+        {.iov_base = "\n", .iov_len = add_newline},
+    };
+    int idx = 0;
+    while (idx < 2) {
+        ssize_t n = writev(fd, iov + idx, 2 - idx);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to write here-document");
+            close(fd);
+            return -1;
+        }
+        // Skip over whatever was fully written
+        while (idx < 2 && (size_t) n >= iov[idx].iov_len) {
+            n -= iov[idx].iov_len;
+            idx++;
+        }
+        if (idx < 2) {
+            iov[idx].iov_base = (char *) iov[idx].iov_base + n;
+            iov[idx].iov_len -= n;
+        }
+    }
+
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1 ||
+        lseek(fd, 0, SEEK_SET) == -1) {
+        perror("Failed to seal here-document");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Move exactly 'len' bytes from a pipe into a file
+ * splice() keeps the data in the kernel, but can't write to files opened with
+ * O_APPEND, so those fall back to read()/write()
+ * Returns 0 on success or -1 on error
+ */
+static int drain_pipe(int pipe_fd, int out_fd, size_t len) {
+    char buf[BUF_SIZE];
+    while (len > 0) {
+        ssize_t n = splice(pipe_fd, NULL, out_fd, NULL, len, SPLICE_F_MOVE);
+        if (n == -1 && errno == EINVAL) {
+            n = read(pipe_fd, buf, len < BUF_SIZE ? len : BUF_SIZE);
+            if (n > 0 && write(out_fd, buf, n) != n) {
+                n = -1;
+            }
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Fan a program's output out to several files
+ * Forks: the child returns (with stdout on a pipe) to exec the program, while
+ * the calling process duplicates everything from that pipe into each file with
+ * tee() and splice(), so the data never passes through user space. Once the
+ * program exits and the pipe is drained, the calling process exits with the
+ * program's status, so the shell sees one job that finishes only after every
+ * file has been written.
+ * out_fds: Descriptors of the files to write to
+ * num_outs: Number of descriptors in out_fds (at least 2)
+ * Returns 0 in the child or -1 on error, doesn't return in the parent
+ */
+static int fan_out_output(int *out_fds, int num_outs) {
+    int pipe_fds[2];
+    int scratch[2];
+    if (pipe(pipe_fds) == -1 || pipe(scratch) == -1) {
+        perror("pipe");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    } else if (pid == 0) {
+        close(pipe_fds[0]);
+        close(scratch[0]);
+        close(scratch[1]);
+        if (dup2(pipe_fds[1], STDOUT_FILENO) == -1) {
+            perror("dup2");
+            return -1;
+        }
+        close(pipe_fds[1]);
+        return 0;
+    }
+
+    close(pipe_fds[1]);
+    // tee() can only duplicate as much as fits in the scratch pipe, and every
+    // target must receive the same chunk, so cap each round at its capacity
+    int chunk = fcntl(scratch[1], F_GETPIPE_SZ);
+    if (chunk <= 0) {
+        chunk = BUF_SIZE;
+    }
+    int failed = 0;
+    int done = 0;
+    while (!done && !failed) {
+        // Duplicate the next chunk into each target but the last...
+        ssize_t len = 0;
+        for (int i = 0; i < num_outs - 1 && !done && !failed; i++) {
+            ssize_t n;
+            do {
+                n = tee(pipe_fds[0], scratch[1], i == 0 ? chunk : len, 0);
+            } while (n == -1 && errno == EINTR);
+            if (i == 0 && n == 0) {
+                // No more writers and nothing left to copy
+                done = 1;
+            } else if (n == -1 || (i > 0 && n != len)) {
+                failed = 1;
+            } else {
+                len = n;
+                failed = drain_pipe(scratch[0], out_fds[i], len) == -1;
+            }
+        }
+        // ...then consume it into the last one
+        if (!done && !failed) {
+            failed = drain_pipe(pipe_fds[0], out_fds[num_outs - 1], len) == -1;
+        }
+    }
+    if (failed) {
+        perror("Failed to write output file");
+    }
+    close(pipe_fds[0]);
+    close(scratch[0]);
+    close(scratch[1]);
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            _exit(1);
+        }
+    }
+    if (WIFSIGNALED(status)) {
+        // Die the same way the program did
+        signal(WTERMSIG(status), SIG_DFL);
+        raise(WTERMSIG(status));
+    }
+    _exit(failed ? 1 : WEXITSTATUS(status));
+}
+
+/*
+ * Check whether a word is a redirection operator such as ">" or "<<"
+ * flags: The word's SCAN_* flags
+ */
+static int is_redirect(const char *word, unsigned flags) {
+    return (flags & SCAN_OPERATOR) && word[0] != '\0' && strspn(word, "<>") == strlen(word);
+}
+
+/*
+ * Add one word of a command line to a token vector
+ * "*", "?" and "[...]" patterns are expanded, except in redirection targets
+ * (the word after an operator such as ">" or "<<"). A pattern that matches
+ * nothing is added unchanged
+ * flags: The word's SCAN_* flags
+ * is_target: 1 if the word follows a redirection operator
+ * dir_cache: Directory listings shared by all words on the line
+ * Returns 0 on success or -1 on error
+ */
+static int add_word(strvec_t *tokens, const char *word, unsigned flags, int is_target,
+                    dirent_cache_t *dir_cache) {
+    int num_matches = 0;
+    if (!is_target && (flags & SCAN_PATTERN)) {
+        num_matches = expand_pathname(dir_cache, word, tokens);
+    }
+    if (num_matches == -1 || (num_matches == 0 && strvec_add(tokens, word) == -1)) {
+        return -1;
+    }
+    return 0;
+}
 
 int tokenize(char *s, strvec_t *tokens) {
     // TODO Task 0: Tokenize string s
     // Assume each token is separated by a single space (" ")
-    // Use the strtok() function to accomplish this
     // Add each token to the 'tokens' parameter (a string vector)
     // Return 0 on success, -1 on error
 
-    // initialize tokenization
-    char *token = strtok(s, " ");
+    // Find the word boundaries in one pass, growing the array for long lines
+    size_t len = strlen(s);
+    scan_token_t local[64];
+    scan_token_t *words = local;
+    unsigned num_words = scan_tokens(s, len, words, 64);
+    if (num_words > 64) {
+        if ((words = malloc(num_words * sizeof(scan_token_t))) == NULL) {
+            perror("malloc");
+            return -1;
+        }
+        scan_tokens(s, len, words, num_words);
+    }
+
+    // directories read for pathname expansion, shared by all words on this line
+    dirent_cache_t dir_cache;
+    dirent_cache_init(&dir_cache);
 
-    // loop - continues until string is fully tokenized
-    while (token != NULL) {
-        if (strvec_add(tokens, token) == -1) {
+    int result = 0;
+    int is_target = 0;
+    for (unsigned i = 0; i < num_words; i++) {
+        char *word = s + words[i].start;
+        word[words[i].len] = '\0';
+        if (add_word(tokens, word, words[i].flags, is_target, &dir_cache) == -1) {
             printf("Failed to add token");
+            result = -1;
+            break;
+        }
+        is_target = is_redirect(word, words[i].flags);
+    }
+    dirent_cache_free(&dir_cache);
+    if (words != local) {
+        free(words);
+    }
+    return result;
+}
+
+int expand_words(const char *const *words, unsigned num_words, strvec_t *tokens) {
+    dirent_cache_t dir_cache;
+    dirent_cache_init(&dir_cache);
+    int is_target = 0;
+    for (unsigned i = 0; i < num_words; i++) {
+        size_t len = strlen(words[i]);
+        scan_token_t word;
+        // Each word is a single token, so this only classifies its characters
+        word.flags = 0;
+        scan_tokens(words[i], len, &word, 1);
+        if (add_word(tokens, words[i], word.flags, is_target, &dir_cache) == -1) {
+            dirent_cache_free(&dir_cache);
             return -1;
         }
-        token = strtok(NULL, " ");
+        is_target = is_redirect(words[i], word.flags);
     }
+    dirent_cache_free(&dir_cache);
+    return 0;
+}
+
+/*
+ * Read the body of one here-document from the input, up to its delimiter line
+ * next_line, source: Where to read lines from (see read_heredocs())
+ * delim: The delimiter, with any quotes already removed
+ * strip_tabs: 1 to remove leading tabs from each line (the "<<-" form)
+ * Returns the body (which the caller must free) or NULL on error
+ */
+static char *read_heredoc_body(line_source_t next_line, void *source, const char *delim,
+                               int strip_tabs) {
+    size_t len = 0;
+    size_t capacity = LINE_LEN;
+    char *body = malloc(capacity);
+    if (body == NULL) {
+        return NULL;
+    }
+    body[0] = '\0';
+
+    char line[LINE_LEN];
+    while (1) {
+        if (next_line(source, line, LINE_LEN) != 1) {
+            fprintf(stderr, "warning: here-document delimited by end-of-file (wanted '%s')\n",
+                    delim);
+            break;
+        }
+        char *text = line;
+        while (strip_tabs && *text == '\t') {
+            text++;
+        }
+        if (strcmp(text, delim) == 0) {
+            break;
+        }
+
+        size_t line_len = strlen(text);
+        if (len + line_len + 2 > capacity) {
+            while (len + line_len + 2 > capacity) {
+                capacity *= 2;
+            }
+            char *new_body = realloc(body, capacity);
+            if (new_body == NULL) {
+                free(body);
+                return NULL;
+            }
+            body = new_body;
+        }
+        memcpy(body + len, text, line_len);
+        len += line_len;
+        body[len++] = '\n';
+        body[len] = '\0';
+    }
+    return body;
+}
+
+int read_heredocs(strvec_t *tokens, line_source_t next_line, void *source) {
+    if (strvec_find(tokens, "<<") == -1) {
+        // Quick check for the attached form before rebuilding anything
+        int found = 0;
+        for (unsigned i = 0; i < tokens->length && !found; i++) {
+            const char *token = strvec_get(tokens, i);
+            found = strncmp(token, "<<", 2) == 0 && token[2] != '<';
+        }
+        if (!found) {
+            return 0;
+        }
+    }
+
+    strvec_t result;
+    if (strvec_init(&result) == -1) {
+        return -1;
+    }
+    for (unsigned i = 0; i < tokens->length; i++) {
+        const char *token = strvec_get(tokens, i);
+        if (strncmp(token, "<<", 2) != 0 || token[2] == '<') {
+            if (strvec_add(&result, token) == -1) {
+                strvec_clear(&result);
+                return -1;
+            }
+            continue;
+        }
+
+        const char *delim = token + 2;
+        int strip_tabs = 0;
+        if (*delim == '-') {
+            strip_tabs = 1;
+            delim++;
+        }
+        if (*delim == '\0') {
+            if (i + 1 >= tokens->length) {
+                fprintf(stderr, "Missing here-document delimiter\n");
+                strvec_clear(&result);
+                return -1;
+            }
+            delim = strvec_get(tokens, ++i);
+        }
+        // Quoting the delimiter is accepted, there are no expansions to suppress anyway
+        char unquoted[LINE_LEN];
+        size_t delim_len = strlen(delim);
+        if (delim_len >= LINE_LEN) {
+            fprintf(stderr, "Here-document delimiter too long\n");
+            strvec_clear(&result);
+            return -1;
+        }
+        if (delim_len >= 2 && (delim[0] == '\'' || delim[0] == '"') &&
+            delim[delim_len - 1] == delim[0]) {
+            delim++;
+            delim_len -= 2;
+        }
+        memcpy(unquoted, delim, delim_len);
+        unquoted[delim_len] = '\0';
+
+        char *body = read_heredoc_body(next_line, source, unquoted, strip_tabs);
+        if (body == NULL || strvec_add(&result, "<<") == -1 || strvec_add(&result, body) == -1) {
+            free(body);
+            strvec_clear(&result);
+            return -1;
+        }
+        free(body);
+    }
+
+    strvec_clear(tokens);
+    *tokens = result;
+    return 0;
+}
+
+static int exec_with_redirection(strvec_t *tokens, char **args, int *out_fds);
+
+/*
+ * Make the calling child of the shell a job of its own: put it in its own
+ * process group and undo the shell's signal settings
+ * Returns 0 on success or -1 on error
+ */
+static int become_job(void) {
+    // child process - make child own process group
+    if (setpgid(0, getpid()) == -1) {
+        perror("Failed to separate Child Process");
+        return -1;
+    }
+    // let processes this job leaves behind be traced back to it
+    if (reaper_tag_job() == -1) {
+        perror("setenv");
+        return -1;
+    }
+
+    // the shell blocks SIGCHLD for its event loop, don't pass that on to the program
+    sigset_t empty_mask;
+    sigemptyset(&empty_mask);
+    if (sigprocmask(SIG_SETMASK, &empty_mask, NULL) == -1) {
+        perror("sigprocmask");
+        return -1;
+    }
+
+    // set new mask for child process, with own mask
+    struct sigaction sac;
+    sac.sa_handler = SIG_DFL;
+    if (sigfillset(&sac.sa_mask) == -1) {
+        perror("sigfillset");
+        return -1;
+    }
+    sac.sa_flags = SA_RESTART;
+    if (sigaction(SIGTTIN, &sac, NULL) == -1 || sigaction(SIGTTOU, &sac, NULL) == -1) {
+        perror("sigaction");
+        return -1;
+    }
+
     return 0;
 }
 
@@ -44,106 +464,130 @@ int run_command(strvec_t *tokens) {
     // specified command-line arguments
     // THIS FUNCTION SHOULD BE CALLED FROM A CHILD OF THE MAIN SHELL PROCESS
     // Hint: Build a string array from the 'tokens' vector and pass this into execvp()
-    // Another Hint: You have a guarantee of the longest possible needed array, so you
-    // won't have to use malloc.
+    if (become_job() == -1) {
+        return -1;
+    }
+    // every stage of a pipeline runs in a child of this process
+    if (pipeline_is_pipeline(tokens)) {
+        return pipeline_run(tokens);
+    }
+    return exec_command(tokens);
+}
+
+int exec_command(strvec_t *tokens) {
+    // pathname expansion can produce any number of arguments, so size the
+    // argument and output file arrays from the token count
+    char **args = malloc((tokens->length + 1) * sizeof(char *));
+    int *out_fds = malloc((tokens->length + 1) * sizeof(int));
+    if (args == NULL || out_fds == NULL) {
+        perror("malloc");
+        free(args);
+        free(out_fds);
+        return -1;
+    }
+    int ret = exec_with_redirection(tokens, args, out_fds);
+    // only reached if something went wrong
+    free(args);
+    free(out_fds);
+    return ret;
+}
 
+/*
+ * Body of exec_command(): set up redirection and exec the program
+ * args: Room for at least tokens->length + 1 argument pointers
+ * out_fds: Room for at least tokens->length output descriptors
+ * Doesn't return on success or returns -1 on error
+ */
+static int exec_with_redirection(strvec_t *tokens, char **args, int *out_fds) {
     // create backups for stdout and stdin - restore later
     int stdout_bak = dup(STDOUT_FILENO);
     int stdin_bak = dup(STDIN_FILENO);
 
-    // flags for type output/input redirection - append to output, output+overwrite, input
-    // redirection
+    // output redirection targets, in the order given. With more than one
+    // target the output is fanned out to all of them (e.g. "cmd > a > b")
     int out_flag = -1;
+    int num_outs = 0;
+    // flag for input redirection
     int in_flag = -1;
-    int append_flag = -1;
 
-    // index in token for the input/output redirection
-    int out_loc = 0;
+    // index in token for the input redirection
     int in_loc = 0;
     // total number of arguments
     int num_args = 0;
 
-    char *args[MAX_ARGS];
     for (int i = 0; i < (*tokens).length; i++) {
         // if tokens ends before reaching its length, error
-        if (strvec_get(tokens, i) == NULL) {
+        char *token = strvec_get(tokens, i);
+        if (token == NULL) {
             return -1;
         }
 
-        // overwrite and redirect output file - set flags, and redirect location
-        if (strcmp(strvec_get(tokens, i), ">") == 0) {
-            out_loc = i;
+        int is_out = strcmp(token, ">") == 0;
+        int is_append = strcmp(token, ">>") == 0;
+        int is_here = strcmp(token, "<<") == 0 || strcmp(token, "<<<") == 0;
+        if ((is_out || is_append || is_here || strcmp(token, "<") == 0) &&
+            i + 1 >= tokens->length) {
+            fprintf(stderr, "Missing file name after '%s'\n", token);
+            return -1;
+        }
+
+        // overwrite (>) or append (>>) and redirect output file - open it now so
+        // every target is created even when there are several
+        if (is_out || is_append) {
+            int flags = O_WRONLY | O_CREAT | (is_append ? O_APPEND : O_TRUNC);
+            if ((out_fds[num_outs] = open(strvec_get(tokens, i + 1), flags, S_IRUSR | S_IWUSR)) ==
+                -1) {
+                perror("Failed to open output file");
+                close_all(out_fds, num_outs);
+                return -1;
+            }
+            num_outs++;
             out_flag = 1;
             i++;
             // redirect input file - set flags, and redirect location
-        } else if (strcmp(strvec_get(tokens, i), "<") == 0) {
+            // redirect input from a here-document (<<) or here-string (<<<) as well
+        } else if (strcmp(token, "<") == 0 || is_here) {
             in_loc = i;
             in_flag = 1;
             i++;
-            // append and redirect output file - set flags, and redirect locaton
-        } else if (strcmp(strvec_get(tokens, i), ">>") == 0) {
-            out_loc = i;
-            out_flag = 1;
-            append_flag = 1;
-            i++;
         } else {
             // not a redirection argument - adds to command arguments
-            args[i] = strvec_get(tokens, i);
-            num_args++;
+            args[num_args++] = token;
         }
     }
     // null terminated arguments
     args[num_args++] = NULL;
 
-    // check for output redirection
-    if (out_flag != -1) {
-        int out_fd;
-        // if not appending, truncate/create file, redirect output, and close
-        if (append_flag == -1) {
-            if ((out_fd = open(strvec_get(tokens, out_loc + 1), O_WRONLY | O_CREAT | O_TRUNC,
-                               S_IRUSR | S_IWUSR)) == -1) {
-                perror("Failed to open output file");
-                return -1;
-            }
-            // redirect output to out_fd
-            if (dup2(out_fd, STDOUT_FILENO) == -1) {
-                perror("dup2");
-                close(out_fd);
-                return -1;
-            }
+    // check for output redirection to a single file
+    if (num_outs == 1) {
+        // redirect output to the file
+        if (dup2(out_fds[0], STDOUT_FILENO) == -1) {
+            perror("dup2");
+            close(out_fds[0]);
+            return -1;
+        }
 
-            // close output file, unneeded now
-            if (close(out_fd) == -1) {
-                perror("Failed to close output file");
-                dup2(stdout_bak, STDOUT_FILENO);
-                return -1;
-            }
-            // if appending, open file, redirect output, and close
-        } else {
-            if ((out_fd = open(strvec_get(tokens, out_loc + 1), O_WRONLY | O_CREAT | O_APPEND,
-                               S_IRUSR | S_IWUSR)) == -1) {
-                perror("Failed to open output file");
-                return -1;
-            }
-            // redirect output
-            if (dup2(out_fd, STDOUT_FILENO) == -1) {
-                perror("dup2");
-                close(out_fd);
-                return -1;
-            }
-            // close out_fd, unneeded now
-            if (close(out_fd) == -1) {
-                perror("Failed to close output file");
-                dup2(stdout_bak, STDOUT_FILENO);
-                return -1;
-            }
+        // close output file, unneeded now
+        if (close(out_fds[0]) == -1) {
+            perror("Failed to close output file");
+            dup2(stdout_bak, STDOUT_FILENO);
+            return -1;
         }
     }
-    // if redirecting input, open file for reading, redirect, and close
+    // if redirecting input, open file (or build the here-document) for reading, redirect,
+    // and close
     int in_fd;
     if (in_flag != -1) {
-        if ((in_fd = open(strvec_get(tokens, in_loc + 1), O_RDONLY, S_IRUSR)) == -1) {
-            perror("Failed to open input file");
+        const char *in_op = strvec_get(tokens, in_loc);
+        if (strcmp(in_op, "<") == 0) {
+            if ((in_fd = open(strvec_get(tokens, in_loc + 1), O_RDONLY, S_IRUSR)) == -1) {
+                perror("Failed to open input file");
+            }
+        } else {
+            // the shell already replaced a here-document's delimiter with its body
+            in_fd = here_document_fd(strvec_get(tokens, in_loc + 1), strcmp(in_op, "<<<") == 0);
+        }
+        if (in_fd == -1) {
             if (out_flag != 1) {
                 dup2(stdout_bak, STDOUT_FILENO);
             }
@@ -169,23 +613,14 @@ int run_command(strvec_t *tokens) {
         }
     }
 
-    // child process - make child own process group
-    if (setpgid(0, getpid()) == -1) {
-        perror("Failed to separate Child Process");
-        return -1;
-    }
-
-    // set new mask for child process, with own mask
-    struct sigaction sac;
-    sac.sa_handler = SIG_DFL;
-    if (sigfillset(&sac.sa_mask) == -1) {
-        perror("sigfillset");
-        return -1;
-    }
-    sac.sa_flags = SA_RESTART;
-    if (sigaction(SIGTTIN, &sac, NULL) == -1 || sigaction(SIGTTOU, &sac, NULL) == -1) {
-        perror("sigaction");
-        return -1;
+    // several output files: this process stays behind to copy the output into
+    // all of them, while a child (in the same process group) runs the program
+    if (num_outs > 1) {
+        if (fan_out_output(out_fds, num_outs) == -1) {
+            close_all(out_fds, num_outs);
+            return -1;
+        }
+        close_all(out_fds, num_outs);
     }
 
     // execute the command (with redirection executed prior)
@@ -213,69 +648,82 @@ int run_command(strvec_t *tokens) {
     return 0;
 }
 
-int resume_job(strvec_t *tokens, job_list_t *jobs, int is_foreground) {
+void update_job(job_t *job, int status) {
+    if (status != -1 && WIFSTOPPED(status)) {
+        // stops made to keep the job within its CPU share don't count: the
+        // job is still running as far as the user is concerned
+        if (!share_take_stop(job->share)) {
+            job->status = STOPPED;
+            share_set_active(job->share, 0);
+        }
+    } else if (status == -1 || !WIFCONTINUED(status)) {
+        job->is_done = 1;
+        job->wait_status = status;
+        share_set_active(job->share, 0);
+    }
+}
+
+job_t *resume_job(strvec_t *tokens, job_list_t *jobs, int is_foreground) {
     job_t *temp_job;
-    int status;
     // check if meant to be launched in foreground
     if (is_foreground) {
         // get job_id -> convert to int
         int job_id = atoi(strvec_get(tokens, 1));
         if (job_id < 0) {
-            return -1;
+            return NULL;
         }
         // use id to get actual job
         temp_job = job_list_get(jobs, job_id);
         if (temp_job == NULL) {
             fprintf(stderr, "Job index out of bounds\n");
-            return -1;
+            return NULL;
+        }
+        // a job that already exited only has to be collected
+        if (temp_job->is_done) {
+            return temp_job;
         }
         // sets job to foreground
         if (tcsetpgrp(STDIN_FILENO, temp_job->pid) == -1) {
             perror("tcsetpgrp");
-            return -1;
+            return NULL;
         }
-        // send signal to job to resume execution
-        if (kill(temp_job->pid, SIGCONT) == -1) {
+        // the CPU share only applies in the background, and the SIGCONT
+        // below also undoes any stop it made
+        share_set_active(temp_job->share, 0);
+        // send signal to job's process group to resume execution
+        if (kill(-temp_job->pid, SIGCONT) == -1) {
             perror("kill");
-            return -1;
-        }
-        // wait for it to finish/stop
-        if (waitpid(temp_job->pid, &status, WUNTRACED) == -1) {
-            perror("wait failed");
-            return -1;
-        }
-        // if job terminated -> remove from jobs
-        if (WIFEXITED(status) || WIFSIGNALED(status)) {
-            if (job_list_remove(jobs, job_id) == -1) {
-                return -1;
-            }
+            return NULL;
         }
-        // make calling process foreground again
-        if (tcsetpgrp(STDIN_FILENO, getpid()) == -1) {
-            perror("tcsetpgrp");
-            return -1;
+        // a job with captured output writes to the shell, so pass its new
+        // output through to the terminal while it is in the foreground
+        if (temp_job->capture != NULL) {
+            temp_job->capture->follow_fd = STDOUT_FILENO;
         }
     } else {
         // get job id-> convert to int
         int job_id = atoi(strvec_get(tokens, 1));
         if (job_id < 0) {
-            return -1;
+            return NULL;
         }
         // use job id to get actual job
         temp_job = job_list_get(jobs, job_id);
         if (temp_job == NULL) {
             fprintf(stderr, "Job index out of bounds\n");
-            return -1;
+            return NULL;
         }
         // set job to BACKGROUND
         temp_job->status = BACKGROUND;
-        // send signal to continue job
-        if (kill(temp_job->pid, SIGCONT) == -1) {
+        // send signal to continue job's process group
+        if (kill(-temp_job->pid, SIGCONT) == -1) {
             perror("kill");
-            return -1;
+            return NULL;
+        }
+        if (share_set_active(temp_job->share, 1) == -1) {
+            return NULL;
         }
     }
-    return 0;
+    return temp_job;
     // TODO Task 5: Implement the ability to resume stopped jobs in the foreground
     // 1. Look up the relevant job information (in a job_t) from the jobs list
     //    using the index supplied by the user (in tokens index 1)
@@ -295,40 +743,35 @@ int resume_job(strvec_t *tokens, job_list_t *jobs, int is_foreground) {
     //    (as it was STOPPED before this)
 }
 
-int await_background_job(strvec_t *tokens, job_list_t *jobs) {
+/*
+ * Check whether a job has stopped running, including every process adopted
+ * from it
+ */
+static int is_finished(job_t *job, reaper_t *reaper) {
+    return job->is_done && (reaper == NULL || reaper_count(reaper, job->pid) == 0);
+}
+
+job_t *await_background_job(strvec_t *tokens, job_list_t *jobs) {
     int job_id;
     job_t *temp_job;
-    int status;
     // get job_id -> convert to int
     job_id = atoi(strvec_get(tokens, 1));
     if (job_id < 0) {
         fprintf(stderr, "invalid job id");
-        return -1;
+        return NULL;
     }
     // get job front job_id
     temp_job = job_list_get(jobs, job_id);
     if (temp_job == NULL) {
         fprintf(stderr, "Job index out of bounds\n");
-        return -1;
+        return NULL;
     }
     // only consider BACKGROUND jobs
     if (temp_job->status != BACKGROUND) {
         fprintf(stderr, "Job index is for stopped process not background process\n");
-        return -1;
-    }
-    // wait for BACKGROUND process
-    if (waitpid(temp_job->pid, &status, WUNTRACED) == -1) {
-        perror("waitpid");
-        return -1;
+        return NULL;
     }
-    // if job Terminated -> remove from job list
-    if (WIFEXITED(status) || WIFSIGNALED(status)) {
-        if (job_list_remove(jobs, job_id) == -1) {
-            fprintf(stderr, "failed to remove job");
-            return -1;
-        }
-    }
-    return 0;
+    return temp_job;
     // TODO Task 6: Wait for a specific job to stop or terminate
     // 1. Look up the relevant job information (in a job_t) from the jobs list
     //    using the index supplied by the user (in tokens index 1)
@@ -337,27 +780,31 @@ int await_background_job(strvec_t *tokens, job_list_t *jobs) {
     // 4. If the process terminates (is not stopped by a signal) remove it from the jobs list
 }
 
-int await_all_background_jobs(job_list_t *jobs) {
-    job_t *temp_job;
-    int status;
-    // iterate through all jobs
-    for (int i = 0; i < jobs->length; i++) {
-        // store current jobs
-        temp_job = job_list_get(jobs, i);
-        if (temp_job == NULL) {
-            fprintf(stderr, "Job index out of bounds\n");
-            return -1;
+int collect_background_job(job_list_t *jobs, job_t *job, reaper_t *reaper) {
+    if (job->status == STOPPED) {
+        return 1;
+    }
+    // an exited job is only done once everything it left behind is
+    if (!is_finished(job, reaper)) {
+        return 0;
+    }
+    metrics_record_background_exit(job->wait_status);
+    if (job_list_remove(jobs, job_list_index(jobs, job)) == -1) {
+        fprintf(stderr, "failed to remove job");
+    }
+    return 1;
+}
+
+int collect_all_background_jobs(job_list_t *jobs, reaper_t *reaper) {
+    // iterate through all jobs (walk the list directly, indexing would be quadratic)
+    for (job_t *temp_job = jobs->head; temp_job != NULL; temp_job = temp_job->next) {
+        if (temp_job->status == BACKGROUND && !is_finished(temp_job, reaper)) {
+            return 0;
         }
-        // if job is in BACKGROUND then wait for it to finish
+    }
+    for (job_t *temp_job = jobs->head; temp_job != NULL; temp_job = temp_job->next) {
         if (temp_job->status == BACKGROUND) {
-            if (waitpid(temp_job->pid, &status, WUNTRACED) == -1) {
-                perror("waitpid");
-                return -1;
-            }
-            // if the job got STOPPED then set status
-            if (WIFSTOPPED(status)) {
-                temp_job->status = STOPPED;
-            }
+            metrics_record_background_exit(temp_job->wait_status);
         }
     }
     // Remove all BACKGROUND jobs as they have finished
@@ -371,5 +818,89 @@ int await_all_background_jobs(job_list_t *jobs) {
     // 4. Remove all background jobs (which have all just terminated) from jobs list.
     //    Use the job_list_remove_by_status() function.
 
+    return 1;
+}
+
+int set_job_deadline(strvec_t *tokens, job_list_t *jobs, event_loop_t *loop) {
+    unsigned timeout_ms;
+    unsigned kill_after_ms;
+    if (tokens->length < 3 ||
+        deadline_parse(tokens, 2, &timeout_ms, &kill_after_ms) != tokens->length) {
+        fprintf(stderr, "Usage: deadline JOB SECS [-k KILL_AFTER]\n");
+        return -1;
+    }
+    int job_id = atoi(strvec_get(tokens, 1));
+    job_t *job = job_id < 0 ? NULL : job_list_get(jobs, job_id);
+    if (job == NULL) {
+        fprintf(stderr, "Job index out of bounds\n");
+        return -1;
+    }
+
+    // a new deadline replaces the old one, even one that already fired
+    deadline_free(job->deadline);
+    job->deadline = NULL;
+    if (timeout_ms > 0 &&
+        (job->deadline = deadline_new(loop, job->pid, timeout_ms, kill_after_ms)) == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+int set_job_share(strvec_t *tokens, job_list_t *jobs, event_loop_t *loop) {
+    unsigned percent;
+    if (tokens->length != 3 || share_parse(strvec_get(tokens, 2), &percent) == -1) {
+        fprintf(stderr, "Usage: share JOB PERCENT\n");
+        return -1;
+    }
+    int job_id = atoi(strvec_get(tokens, 1));
+    job_t *job = job_id < 0 ? NULL : job_list_get(jobs, job_id);
+    if (job == NULL) {
+        fprintf(stderr, "Job index out of bounds\n");
+        return -1;
+    }
+
+    // a new share replaces the old one, which lets go of the job first
+    share_free(job->share);
+    job->share = NULL;
+    if (percent == 0) {
+        return 0;
+    }
+    if ((job->share = share_new(loop, job->pid, percent)) == NULL) {
+        return -1;
+    }
+    // a stopped job's share starts once it is resumed in the background
+    if (job->status == BACKGROUND && share_set_active(job->share, 1) == -1) {
+        return -1;
+    }
     return 0;
 }
+
+int print_job_output(strvec_t *tokens, job_list_t *jobs, capture_t **follow) {
+    *follow = NULL;
+    int is_follow = tokens->length == 3 && strcmp(strvec_get(tokens, 2), "--follow") == 0;
+    if (tokens->length < 2 || (tokens->length > 2 && !is_follow)) {
+        fprintf(stderr, "Usage: output JOB [--follow]\n");
+        return -1;
+    }
+    int job_id = atoi(strvec_get(tokens, 1));
+    job_t *job = job_id < 0 ? NULL : job_list_get(jobs, job_id);
+    if (job == NULL) {
+        fprintf(stderr, "Job index out of bounds\n");
+        return -1;
+    }
+    if (job->capture == NULL) {
+        fprintf(stderr, "Output of job %d is not captured\n", job_id);
+        return -1;
+    }
+
+    // anything printed by the shell itself must come out first
+    fflush(stdout);
+    if (is_follow) {
+        if (capture_follow(job->capture, STDOUT_FILENO) == -1) {
+            return -1;
+        }
+        *follow = job->capture;
+        return 0;
+    }
+    return capture_replay(job->capture, STDOUT_FILENO);
+}
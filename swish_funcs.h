@@ -4,7 +4,12 @@
 #ifndef SWISH_FUNCS_H
 #define SWISH_FUNCS_H
 
+#include <stddef.h>
+
+#include "capture.h"
+#include "event_loop.h"
 #include "job_list.h"
+#include "reaper.h"
 #include "string_vector.h"
 
 /*
@@ -12,6 +17,8 @@
  * Divide a string with substrings separated by a single space (" ")
  * into tokens. These tokens should be stored in the 'tokens' vector using
  * "strvec_add".
+ * Words containing "*", "?" or "[...]" patterns are replaced by the sorted
+ * list of matching paths (see pathname.h)
  * s: String to tokenize
  * vec: Pointer to vector in which to store tokens. Must be initialized
  *      before this function is called.
@@ -19,6 +26,36 @@
  */
 int tokenize(char *s, strvec_t *tokens);
 
+/*
+ * Add words that were already split apart to a token vector, expanding
+ * pathname patterns in exactly the same way as tokenize()
+ * words: The words to add
+ * num_words: Number of entries in 'words'
+ * tokens: Pointer to vector in which to store tokens
+ * Returns 0 on success or -1 on error
+ */
+int expand_words(const char *const *words, unsigned num_words, strvec_t *tokens);
+
+/*
+ * Source of input lines, used to read here-document bodies
+ * source: The argument given along with this function
+ * line: Where to store the line, without its trailing newline
+ * size: Size of the 'line' buffer
+ * Returns 1 if a line was stored or -1 at end of input
+ */
+typedef int (*line_source_t)(void *source, char *line, size_t size);
+
+/*
+ * Read the bodies of any here-documents ("cmd <<EOF" or "cmd << EOF") on a
+ * command line, and replace each delimiter token with the body itself so that
+ * run_command() only has to copy it into the program's input
+ * tokens: Tokens of the command line, updated in place
+ * next_line: Function returning the lines following the command line
+ * source: Passed through to next_line
+ * Returns 0 on success or -1 on error
+ */
+int read_heredocs(strvec_t *tokens, line_source_t next_line, void *source);
+
 /*
  * Task 2: Run a user-specified command (including arguments)
  * This should be called within a CHILD process of the shell
@@ -28,35 +65,98 @@ int tokenize(char *s, strvec_t *tokens);
  */
 int run_command(strvec_t *tokens);
 
+/*
+ * Run a single command (not a pipeline) with its redirections in the calling
+ * process, without making it a job of its own as run_command() does. Used
+ * for the stages of a pipeline, which share the pipeline's process group
+ * tokens: Tokens of the command
+ * Doesn't return on success (similar to exec) or returns -1 on error
+ */
+int exec_command(strvec_t *tokens);
+
+/*
+ * Record a change in the state of a job's process, as reported by the event
+ * loop: a job that stops becomes STOPPED (unless the shell stopped it to keep
+ * it within its CPU share), one that ends is done and waits to be collected
+ * job: The job
+ * status: Its wait status (see waitpid()), or -1 if it ended in an unknown way
+ */
+void update_job(job_t *job, int status);
+
 /*
  * Task 5: Resume a stopped (paused) process
  * This can be called from the shell process itself, no need for a fork()
+ * In the foreground, the job is given the terminal and the caller waits for it
+ * to stop or end (see update_job()), then takes the terminal back
  * tokens: Tokens from the command typed in by the user, e.g., "fg 0"
  * jobs: The list of current jobs for the shell
  * is_foreground: 1 if the job should be resumed in the foreground (Task 5), or
  *                0 if the job should be resumed in the background (Task 6)
- * Returns 0 on success or -1 on error
+ * Returns the resumed job or NULL on error
  */
-int resume_job(strvec_t *tokens, job_list_t *jobs, int is_foreground);
+job_t *resume_job(strvec_t *tokens, job_list_t *jobs, int is_foreground);
 
 /*
- * Task 6: Block the calling shell process until a specific background job
- * stops running (either is stopped or exits).
- * If the job process exits, remove it from the jobs list.
+ * Task 6: Look up a specific background job to wait for, until it stops
+ * running (either is stopped or exits), see collect_background_job()
  * tokens: Tokens from the command typed in by the user (e.g., "wait-for 2")
+ * jobs: Pointer to the list of current jobs for the shell
+ * Returns the job or NULL on error
+ */
+job_t *await_background_job(strvec_t *tokens, job_list_t *jobs);
+
+/*
+ * Task 6: Check whether a background job waited for has stopped running
+ * If the job process exited, remove it from the jobs list
+ * jobs: Pointer to the list of current jobs for the shell
+ * job: The job, from await_background_job()
+ * reaper: Processes adopted from jobs (see reaper.h), or NULL if the shell is
+ *         not a subreaper. An exited job is only done once these are too
+ * Returns 1 once the wait is over or 0 while the job still runs
+ */
+int collect_background_job(job_list_t *jobs, job_t *job, reaper_t *reaper);
+
+/*
+ * Task 6: Check whether all background jobs have stopped running (either
+ * stopped or exited)
+ * Once they have, remove all jobs that exited (are not stopped) from the jobs list
+ * jobs: Pointer to the list of current jobs for the shell
+ * reaper: Processes adopted from jobs, or NULL (see collect_background_job())
+ * Returns 1 once the wait is over or 0 while some job still runs
+ */
+int collect_all_background_jobs(job_list_t *jobs, reaper_t *reaper);
+
+/*
+ * Set or clear the time limit of a job, counted from now (see deadline.h)
+ * tokens: Tokens from the command typed in by the user, e.g., "deadline 0 30",
+ *         "deadline 0 30 -k 5" to follow up with SIGKILL 5 seconds after the
+ *         SIGTERM, or "deadline 0 0" to remove the job's time limit
+ * jobs: Pointer to the list of current jobs for the shell
+ * loop: The shell's event loop, which fires the deadline
  * Returns 0 on success or -1 on error
  */
-int await_background_job(strvec_t *tokens, job_list_t *jobs);
+int set_job_deadline(strvec_t *tokens, job_list_t *jobs, event_loop_t *loop);
 
 /*
- * Task 6: Block the calling shell process until all background jobs
- * stop running (either stopped or exited)
- * Remove all jobs that exit (are not stopped) from the jobs list
- * Hint: It's easiest to await all background jobs, then remove them from the
- * shell's job list at the end
+ * Set or clear the CPU share of a job, which the shell enforces by stopping
+ * and continuing it while it runs in the background (see share.h)
+ * tokens: Tokens from the command typed in by the user, e.g., "share 0 25" to
+ *         hold job 0 to a quarter of one CPU, or "share 0 0" to remove the limit
  * jobs: Pointer to the list of current jobs for the shell
- * Returns 0 on success or -1 on failure
+ * loop: The shell's event loop, which runs the share's timer
+ * Returns 0 on success or -1 on error
+ */
+int set_job_share(strvec_t *tokens, job_list_t *jobs, event_loop_t *loop);
+
+/*
+ * Print the captured output of a background job (see capture.h)
+ * tokens: Tokens from the command typed in by the user, e.g., "output 0" or
+ *         "output 0 --follow" to keep printing new output until the job ends
+ * jobs: Pointer to the list of current jobs for the shell
+ * follow: Set to the capture now being followed with --follow (see
+ *         capture_follow()), NULL otherwise
+ * Returns 0 on success or -1 on error
  */
-int await_all_background_jobs(job_list_t *jobs);
+int print_job_output(strvec_t *tokens, job_list_t *jobs, capture_t **follow);
 
 #endif    // SWISH_FUNCS_H
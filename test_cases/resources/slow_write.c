@@ -1,33 +1,277 @@
 // Author: John Kolb <jhkolb@umn.edu>
 // SPDX-License-Identifier: GPL-3.0-or-later
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#define NSEC_PER_SEC 1000000000ULL
+#define MAX_RECORD_SIZE (1 << 20)
+
+// Write latencies are kept in a log-linear histogram: 8 buckets for every
+// power of two, so percentiles are accurate to within 12.5% without storing
+// every sample
+#define SUB_BUCKET_BITS 3
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define NUM_BUCKETS ((64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+
+typedef struct {
+    uint64_t counts[NUM_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} histogram_t;
+
+static void usage(void) {
+    printf("Usage: [options] <max_num> <delay> [out_file]\n"
+           "Writes the numbers 1 to max_num, one record per line, waiting delay\n"
+           "(possibly fractional) seconds after each one\n"
+           "  -l RATE       Pace records to RATE lines per second instead\n"
+           "  -b RATE       Pace records to RATE bytes per second instead\n"
+           "  -s SIZE       Pad every record to SIZE bytes, newline included\n"
+           "  -B N[:SECS]   Write records in bursts of N, pausing SECS more after each\n"
+           "  -r            Report the achieved rate and write latencies on stderr\n"
+           "RATE and SIZE take a k, M or G suffix (powers of 1000)\n");
+}
+
+/*
+ * Parse a non-negative number with an optional k, M or G suffix
+ * Returns 0 on success or -1 if the value is invalid
+ */
+static int parse_amount(const char *s, double *value) {
+    char *end;
+    *value = strtod(s, &end);
+    if (end == s || !(*value >= 0)) {
+        return -1;
+    }
+    switch (*end) {
+    case '\0':
+        return 0;
+    case 'k':
+        *value *= 1e3;
+        break;
+    case 'M':
+        *value *= 1e6;
+        break;
+    case 'G':
+        *value *= 1e9;
+        break;
+    default:
+        return -1;
+    }
+    return end[1] == '\0' ? 0 : -1;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * Sleep until an absolute time on the monotonic clock, so that time spent
+ * writing doesn't push every later record back
+ */
+static void sleep_until(uint64_t deadline_ns) {
+    struct timespec ts = {.tv_sec = deadline_ns / NSEC_PER_SEC,
+                          .tv_nsec = deadline_ns % NSEC_PER_SEC};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+        // Interrupted by a signal (e.g. stopped and continued), keep going
+    }
+}
+
+static unsigned bucket_of(uint64_t value) {
+    if (value < SUB_BUCKETS * 2) {
+        return value;
+    }
+    unsigned shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + (value >> shift) - SUB_BUCKETS;
+}
+
+// Midpoint of the values that fall in a bucket
+static double bucket_value(unsigned bucket) {
+    if (bucket < SUB_BUCKETS * 2) {
+        return bucket;
+    }
+    unsigned shift = bucket / SUB_BUCKETS - 1;
+    uint64_t low = (uint64_t) (bucket % SUB_BUCKETS + SUB_BUCKETS) << shift;
+    return low + ((1ULL << shift) - 1) / 2.0;
+}
+
+static void histogram_add(histogram_t *h, uint64_t value) {
+    h->counts[bucket_of(value)]++;
+    h->total++;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+static double histogram_percentile(const histogram_t *h, double percent) {
+    uint64_t rank = (uint64_t) (h->total * percent / 100);
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < NUM_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen > rank) {
+            return bucket_value(i) < h->max ? bucket_value(i) : h->max;
+        }
+    }
+    return h->max;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            perror("write");
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Format a record: the number, padded with dots up to size bytes (if it fits)
+ * and ended by a newline
+ * Returns the record's length
+ */
+static size_t format_record(char *buf, int num, size_t size) {
+    size_t len = sprintf(buf, "%d", num);
+    if (len + 1 < size) {
+        memset(buf + len, '.', size - 1 - len);
+        len = size - 1;
+    }
+    buf[len++] = '\n';
+    return len;
+}
+
+static void report(const histogram_t *h, uint64_t bytes, uint64_t elapsed_ns) {
+    double secs = elapsed_ns / (double) NSEC_PER_SEC;
+    fprintf(stderr, "records: %llu\n", (unsigned long long) h->total);
+    fprintf(stderr, "bytes: %llu\n", (unsigned long long) bytes);
+    fprintf(stderr, "elapsed: %.3f s\n", secs);
+    if (secs > 0) {
+        fprintf(stderr, "rate: %.1f lines/s, %.1f bytes/s\n", h->total / secs, bytes / secs);
+    }
+    if (h->total > 0) {
+        fprintf(stderr, "write latency (us): p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+                histogram_percentile(h, 50) / 1e3, histogram_percentile(h, 90) / 1e3,
+                histogram_percentile(h, 99) / 1e3, histogram_percentile(h, 99.9) / 1e3,
+                h->max / 1e3);
+    }
+}
+
 int main(int argc, char **argv) {
-    int limit = 0;
-    int delay;
-    FILE *fout;
+    double line_rate = 0;
+    double byte_rate = 0;
+    double record_size = 0;
+    unsigned long burst = 1;
+    double burst_pause = 0;
+    int is_report = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "l:b:s:B:r")) != -1) {
+        char *end;
+        switch (opt) {
+        case 'l':
+            if (parse_amount(optarg, &line_rate) == -1 || line_rate == 0) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'b':
+            if (parse_amount(optarg, &byte_rate) == -1 || byte_rate == 0) {
+                usage();
+                return 1;
+            }
+            break;
+        case 's':
+            if (parse_amount(optarg, &record_size) == -1 || record_size > MAX_RECORD_SIZE) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'B':
+            burst = strtoul(optarg, &end, 10);
+            if (burst == 0 ||
+                (*end != '\0' && (*end != ':' || parse_amount(end + 1, &burst_pause) == -1))) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'r':
+            is_report = 1;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
 
-    if (argc < 3) {
-        printf("Usage: <max_num> <delay> [out_file]\n");
+    if (argc - optind < 2) {
+        usage();
         return 1;
     }
-    limit = atoi(argv[1]);
-    delay = atoi(argv[2]);
+    int limit = atoi(argv[optind]);
+    double delay = strtod(argv[optind + 1], NULL);
+    if (!(delay > 0)) {
+        delay = 0;
+    }
 
-    if (argc >= 4) {
-        fout = fopen(argv[3], "w");
-        if (fout == NULL) {
-            perror("fopen");
+    int fd = STDOUT_FILENO;
+    if (argc - optind >= 3) {
+        fd = open(argv[optind + 2], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd == -1) {
+            perror("open");
             return 1;
         }
-    } else {
-        fout = stdout;
     }
 
+    char *record = malloc((size_t) record_size + 32);
+    histogram_t *latencies = calloc(1, sizeof(histogram_t));
+    if (record == NULL || latencies == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    uint64_t bytes = 0;
+    uint64_t start = now_ns();
+    uint64_t deadline = start;
     for (int i = 1; i <= limit; i++) {
-        fprintf(fout, "%d\n", i);
-        sleep(delay);
+        size_t len = format_record(record, i, (size_t) record_size);
+        uint64_t before = now_ns();
+        if (write_all(fd, record, len) == -1) {
+            return 1;
+        }
+        histogram_add(latencies, now_ns() - before);
+        bytes += len;
+
+        // Each record moves the deadline on by its share of the target rate,
+        // but only the end of a burst waits for it
+        if (byte_rate > 0) {
+            deadline += len * NSEC_PER_SEC / byte_rate;
+        } else if (line_rate > 0) {
+            deadline += NSEC_PER_SEC / line_rate;
+        } else {
+            deadline += delay * NSEC_PER_SEC;
+        }
+        if (i % burst == 0 || i == limit) {
+            if (i % burst == 0) {
+                deadline += burst_pause * NSEC_PER_SEC;
+            }
+            if (deadline > now_ns()) {
+                sleep_until(deadline);
+            }
+        }
+    }
+
+    if (is_report) {
+        report(latencies, bytes, now_ns() - start);
     }
+    free(latencies);
+    free(record);
+    return 0;
 }
@@ -0,0 +1,16 @@
+#!./swish
+echo first line
+cd test_cases/resources
+pwd
+echo the quick brown fox > ../out.txt
+cat ../out.txt
+wc -l <<END
+one
+two
+END
+echo *.txt
+sleep 1 &
+jobs
+wait-all
+jobs
+echo done
@@ -0,0 +1,11 @@
+#!/bin/sh
+# Keep a CPU busy for a second, then check that the process got no more than
+# twice the share given as the argument (the shell only measures every 100ms)
+yes > /dev/null &
+burner=$!
+sleep 1
+awk -v hz="$(getconf CLK_TCK)" -v share="$1" '{
+    percent = ($14 + $15) * 100 / hz
+    print (percent <= 2 * share) ? "within share" : "over share: " percent "%"
+}' /proc/$burner/stat
+kill $burner
@@ -0,0 +1,4 @@
+#!./swish
+true
+false &
+wait-all
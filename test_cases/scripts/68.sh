@@ -0,0 +1,5 @@
+#!/bin/sh
+# Ignore SIGTERM, which sleep inherits, so only SIGKILL ends the job
+trap '' TERM
+sleep 30
+echo "not killed"
@@ -0,0 +1,3 @@
+#!/bin/bash
+sleep 0.2
+echo "late output"
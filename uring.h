@@ -0,0 +1,83 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <time.h>
+
+// Not in the uapi headers of older kernels (added in Linux 6.7)
+#define URING_OP_WAITID 50
+
+/*
+ * An io_uring instance, driven through the raw system calls so nothing beyond
+ * the kernel headers is needed: a submission queue the process fills with
+ * requests and a completion queue the kernel fills with their results
+ */
+typedef struct {
+    int fd;
+    // Submission queue, shared with the kernel
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned num_pending;    // Requests filled in but not submitted yet
+    // Completion queue, shared with the kernel
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    // Mappings to undo when the ring is freed
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+} uring_t;
+
+/*
+ * Set up a ring, if the kernel supports every operation the caller needs
+ * ring: The ring to initialize
+ * entries: Size of the submission queue
+ * ops: Operations (IORING_OP_*) that must be supported
+ * num_ops: Number of entries in 'ops'
+ * Returns 0 on success or -1 if io_uring is unavailable or lacks an operation
+ */
+int uring_init(uring_t *ring, unsigned entries, const int *ops, unsigned num_ops);
+
+/*
+ * Unmap and close a ring, cancelling any requests still in flight
+ * ring: The ring to free
+ */
+void uring_free(uring_t *ring);
+
+/*
+ * Get a cleared submission queue entry to fill in, submitting the queued
+ * ones first if the queue is full
+ * ring: The ring to queue a request on
+ * Returns the entry, or NULL if the queue is full and couldn't be submitted
+ */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+/*
+ * Submit the queued requests and wait for at least one completion
+ * ring: The ring to submit to
+ * timeout_ms: Most time to wait in milliseconds, 0 to only submit, or -1 to
+ *             wait indefinitely
+ * Returns 0 on success (including when the wait timed out or was
+ * interrupted by a signal) or -1 on error
+ */
+int uring_submit_and_wait(uring_t *ring, int timeout_ms);
+
+/*
+ * Take the oldest completion off the completion queue
+ * ring: The ring to take from
+ * cqe: Where to copy the completion
+ * Returns 1 if a completion was taken or 0 if the queue is empty
+ */
+int uring_next_cqe(uring_t *ring, struct io_uring_cqe *cqe);
+
+#endif    // URING_H
@@ -0,0 +1,281 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+
+#include "zygote.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "string_vector.h"
+#include "swish_funcs.h"
+
+// Descriptors passed along with every command: cwd, stdin, stdout, stderr
+#define ZYGOTE_NUM_FDS 4
+
+typedef struct {
+    uint32_t num_tokens;
+    uint32_t payload_len;
+} zygote_msg_t;
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Receive one command from the shell
+ * Returns 0 on success, or -1 if the shell closed its end or sent garbage
+ */
+static int recv_command(int sock, zygote_msg_t *msg, int *fds) {
+    char control[CMSG_SPACE(ZYGOTE_NUM_FDS * sizeof(int))];
+    struct iovec iov = {.iov_base = msg, .iov_len = sizeof(*msg)};
+    struct msghdr hdr = {0};
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &hdr, MSG_WAITALL);
+    } while (n == -1 && errno == EINTR);
+    if (n != sizeof(*msg)) {
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(ZYGOTE_NUM_FDS * sizeof(int))) {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), ZYGOTE_NUM_FDS * sizeof(int));
+    return 0;
+}
+
+/*
+ * Body of a helper process: wait for a command, adopt the shell's state,
+ * then exec through run_command(). Never returns.
+ */
+static void helper_main(int sock) {
+    zygote_msg_t msg;
+    int fds[ZYGOTE_NUM_FDS];
+    if (recv_command(sock, &msg, fds) == -1) {
+        // Shell is shutting down the pool
+        _exit(0);
+    }
+
+    char *payload = malloc(msg.payload_len);
+    if (payload == NULL || read_all(sock, payload, msg.payload_len) == -1) {
+        _exit(1);
+    }
+    close(sock);
+
+    if (fchdir(fds[0]) == -1) {
+        perror("fchdir");
+        _exit(1);
+    }
+    for (int i = 1; i < ZYGOTE_NUM_FDS; i++) {
+        if (fds[i] != i - 1 && dup2(fds[i], i - 1) == -1) {
+            perror("dup2");
+            _exit(1);
+        }
+    }
+    for (int i = 0; i < ZYGOTE_NUM_FDS; i++) {
+        if (fds[i] > STDERR_FILENO) {
+            close(fds[i]);
+        }
+    }
+
+    strvec_t tokens;
+    if (strvec_init(&tokens) == -1) {
+        _exit(1);
+    }
+    char *s = payload;
+    for (unsigned i = 0; i < msg.num_tokens; i++) {
+        if (s >= payload + msg.payload_len || strvec_add(&tokens, s) == -1) {
+            _exit(1);
+        }
+        s += strlen(s) + 1;
+    }
+    free(payload);
+
+    run_command(&tokens);
+    // Only reached if exec failed, run_command() has already reported why
+    strvec_clear(&tokens);
+    _exit(1);
+}
+
+/*
+ * Fork one new helper and append it to the pool
+ * Returns 0 on success or -1 on error
+ */
+static int zygote_fork(zygote_pool_t *pool) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    } else if (pid == 0) {
+        // Don't hold on to other helpers' sockets, or they'd never see EOF
+        for (unsigned i = 0; i < pool->length; i++) {
+            close(pool->helpers[i].sock);
+        }
+        close(sv[0]);
+
+        if (setpgid(0, 0) == -1) {
+            perror("setpgid");
+            _exit(1);
+        }
+        struct sigaction sac;
+        sac.sa_handler = SIG_DFL;
+        sigfillset(&sac.sa_mask);
+        sac.sa_flags = SA_RESTART;
+        if (sigaction(SIGTTIN, &sac, NULL) == -1 || sigaction(SIGTTOU, &sac, NULL) == -1) {
+            perror("sigaction");
+            _exit(1);
+        }
+        helper_main(sv[1]);
+    }
+
+    // Also set the process group from the parent so tcsetpgrp() can't race the child
+    setpgid(pid, pid);
+    close(sv[1]);
+    pool->helpers[pool->length].pid = pid;
+    pool->helpers[pool->length].sock = sv[0];
+    pool->length++;
+    return 0;
+}
+
+int zygote_pool_init(zygote_pool_t *pool, unsigned size) {
+    pool->length = 0;
+    pool->target = size > ZYGOTE_MAX_POOL ? ZYGOTE_MAX_POOL : size;
+    return zygote_pool_refill(pool);
+}
+
+int zygote_pool_refill(zygote_pool_t *pool) {
+    while (pool->length < pool->target) {
+        if (zygote_fork(pool) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+pid_t zygote_pool_spawn(zygote_pool_t *pool, const strvec_t *tokens, int is_foreground,
+                        int out_fd, int err_fd) {
+    zygote_msg_t msg;
+    msg.num_tokens = tokens->length;
+    msg.payload_len = 0;
+    for (unsigned i = 0; i < tokens->length; i++) {
+        msg.payload_len += strlen(strvec_get(tokens, i)) + 1;
+    }
+
+    char *payload = malloc(msg.payload_len);
+    if (payload == NULL) {
+        return -1;
+    }
+    char *s = payload;
+    for (unsigned i = 0; i < tokens->length; i++) {
+        size_t len = strlen(strvec_get(tokens, i)) + 1;
+        memcpy(s, strvec_get(tokens, i), len);
+        s += len;
+    }
+
+    int fds[ZYGOTE_NUM_FDS] = {-1, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    if (out_fd != -1) {
+        fds[2] = out_fd;
+    }
+    if (err_fd != -1) {
+        fds[3] = err_fd;
+    }
+    if ((fds[0] = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        perror("open");
+        free(payload);
+        return -1;
+    }
+
+    char control[CMSG_SPACE(ZYGOTE_NUM_FDS * sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {.iov_base = &msg, .iov_len = sizeof(msg)};
+    struct msghdr hdr = {0};
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(ZYGOTE_NUM_FDS * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, ZYGOTE_NUM_FDS * sizeof(int));
+
+    // Take helpers from the back; a helper that died is reaped and skipped
+    pid_t pid = -1;
+    while (pool->length > 0 && pid == -1) {
+        zygote_t helper = pool->helpers[--pool->length];
+        if (is_foreground && tcsetpgrp(STDIN_FILENO, helper.pid) == -1) {
+            perror("process group change failed");
+        }
+        if (sendmsg(helper.sock, &hdr, MSG_NOSIGNAL) == sizeof(msg) &&
+            write_all(helper.sock, payload, msg.payload_len) == 0) {
+            pid = helper.pid;
+        } else {
+            kill(helper.pid, SIGKILL);
+            waitpid(helper.pid, NULL, 0);
+        }
+        close(helper.sock);
+    }
+
+    close(fds[0]);
+    free(payload);
+    return pid;
+}
+
+void zygote_pool_free(zygote_pool_t *pool) {
+    for (unsigned i = 0; i < pool->length; i++) {
+        close(pool->helpers[i].sock);
+    }
+    for (unsigned i = 0; i < pool->length; i++) {
+        waitpid(pool->helpers[i].pid, NULL, 0);
+    }
+    pool->length = 0;
+}
@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include <sys/types.h>
+
+#include "string_vector.h"
+
+#define ZYGOTE_MAX_POOL 16
+#define ZYGOTE_DEFAULT_POOL 4
+
+typedef struct {
+    pid_t pid;
+    int sock;
+} zygote_t;
+
+typedef struct {
+    zygote_t helpers[ZYGOTE_MAX_POOL];
+    unsigned length;
+    unsigned target;
+} zygote_pool_t;
+
+/*
+ * Initialize a pool of pre-forked helper processes
+ * Each helper already runs in its own process group with the default
+ * SIGTTIN/SIGTTOU handlers and waits for a command to exec
+ * pool: Pointer to the pool to initialize
+ * size: Number of helpers to keep ready (at most ZYGOTE_MAX_POOL)
+ * Returns 0 on success or -1 on error
+ */
+int zygote_pool_init(zygote_pool_t *pool, unsigned size);
+
+/*
+ * Fork new helpers until the pool is back at its target size
+ * pool: Pointer to the pool to refill
+ * Returns 0 on success or -1 on error
+ */
+int zygote_pool_refill(zygote_pool_t *pool);
+
+/*
+ * Hand a command to a ready helper, which runs it through run_command()
+ * The helper receives the shell's current working directory and standard
+ * streams, so it behaves exactly like a freshly forked child
+ * pool: Pointer to the pool to take a helper from
+ * tokens: The command and its arguments (without a trailing "&")
+ * is_foreground: 1 if the helper's process group should be given the terminal
+ *                before it can exec (so it never reads from the terminal in the
+ *                background), 0 otherwise
+ * out_fd: Descriptor to use as the command's standard output instead of the
+ *         shell's, or -1 to use the shell's
+ * err_fd: Descriptor to use as the command's standard error, or -1
+ * Returns the process ID of the helper (now running the command) on success,
+ * or -1 if no helper could accept the command
+ */
+pid_t zygote_pool_spawn(zygote_pool_t *pool, const strvec_t *tokens, int is_foreground,
+                        int out_fd, int err_fd);
+
+/*
+ * Shut down all idle helpers and wait for them to exit
+ * pool: Pointer to the pool to free
+ */
+void zygote_pool_free(zygote_pool_t *pool);
+
+#endif    // ZYGOTE_H